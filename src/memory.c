@@ -15,7 +15,7 @@ static inline void _report_free(urpc_comm_t *uc, char *note)
 		);
 	printf("|      %s\n", note);
 	for (int b = 0; b < 2; b++)
-		printf("| mem[%d] begin=%8u end=%8u %s |\n",
+		printf("| mem[%d] begin=%8lu end=%8lu %s |\n",
 		       b, uc->mem[b].begin, uc->mem[b].end,
 		       uc->active == &uc->mem[b] ? "active" : "      ");
 	printf("+-------------------------------------------+\n");
@@ -30,11 +30,38 @@ static inline free_block_t *_inactive_free_block(urpc_comm_t *uc)
 	return &uc->mem[0];
 }
 
-static inline uint32_t _free_block_size(free_block_t *b)
+static inline uint64_t _free_block_size(free_block_t *b)
 {
 	return b->end - b->begin;
 }
 
+/*
+  Record a payload allocation failure in the transfer queue.
+*/
+static inline void _record_alloc_fail(urpc_comm_t *uc)
+{
+	uc->alloc_fail++;
+	TQ_WRITE64(uc->tq->alloc_fail, uc->alloc_fail);
+}
+
+/*
+  Update the high water mark of data buffer use, publish it when it grew.
+*/
+static inline void _record_high_water(urpc_comm_t *uc)
+{
+	free_block_t *a = uc->active, *b = _inactive_free_block(uc);
+	uint64_t used = uc->data_buff_end - _free_block_size(a);
+
+	// after a rebuild without requests in flight both blocks span the buffer
+	if (b->end <= a->begin || b->begin >= a->end)
+		used -= MIN(_free_block_size(b), used);
+
+	if (used > uc->high_water) {
+		uc->high_water = used;
+		TQ_WRITE64(uc->tq->high_water, used);
+	}
+}
+
 static inline void _fillup_last_and_switch(urpc_comm_t *uc, int slot)
 {
 	// we were called because there is not enough space.
@@ -55,7 +82,7 @@ static inline void _rebuild_free_blocks(urpc_comm_t *uc, uint64_t last_req, int
 	int on_mb = 0;	// search on mailbox or on mlist
 	urpc_mb_t mb;
 	mlist_t *ml;
-	int abeg, aend, alen, obeg = uc->data_buff_end + 1;
+	int64_t abeg, aend, alen, obeg = uc->data_buff_end + 1;
 	int sw = 0;	// switch roles of free blocks after allocated region goes through 0
 	int count = 0;
 
@@ -82,7 +109,7 @@ static inline void _rebuild_free_blocks(urpc_comm_t *uc, uint64_t last_req, int
 			//TQ_FENCE_L(); TQ_FENCE_S();
 			if (mb.c.cmd == URPC_CMD_NONE) // stop search here
 				break;
-			abeg = mb.c.offs;
+			abeg = MB_OFFS(&mb);
 			alen = mb.c.len;
 		} else {
 			// check mlist of current entry
@@ -90,7 +117,7 @@ static inline void _rebuild_free_blocks(urpc_comm_t *uc, uint64_t last_req, int
 			abeg = ml->b.offs;
 			alen = ml->b.len;
 		}
-		aend = abeg + alen;
+		aend = abeg + ALIGN8B(alen);
 		if (alen) {
 			// switch meaning of free blocks when going through zero
 			if (abeg > obeg)
@@ -124,10 +151,11 @@ static inline void _rebuild_free_blocks(urpc_comm_t *uc, uint64_t last_req, int
 /*
   Free payload blocks of finished requests and adjust free block pointers
  */
-static uint32_t _gc_buffer(urpc_comm_t *uc, int wanted)
+static uint64_t _gc_buffer(urpc_comm_t *uc, int wanted)
 {
 	uint64_t last_req = TQ_READ64(uc->tq->last_put_req);
 	//TQ_FENCE_L();
+	uc->gc_runs++;
 #ifdef DEBUGMEM
 	_report_free(uc, "GC: starting");
 #endif
@@ -136,6 +164,8 @@ static uint32_t _gc_buffer(urpc_comm_t *uc, int wanted)
 	//
 	_rebuild_free_blocks(uc, last_req, wanted);
 gc_out:
+	URPC_TRACE(uc->trace, URPC_EV_GC, URPC_CMD_NONE, last_req,
+		   (uint32_t)MIN(_free_block_size(uc->active), UINT32_MAX));
 	return _free_block_size(uc->active);
 }
 	
@@ -148,12 +178,16 @@ gc_out:
 uint64_t alloc_payload(urpc_comm_t *uc, uint32_t size)
 {
 	if (size > uc->data_buff_end) {
-		eprintf("ERROR: data size(%d) exceeds DATA_BUFF_END(%d)\n",size, uc->data_buff_end);
+		eprintf("ERROR: data size(%u) exceeds DATA_BUFF_END(%ld)\n",size, uc->data_buff_end);
+		_record_alloc_fail(uc);
 		return 0;
 	}
 	urpc_mb_t res;
 	uint32_t asize = ALIGN8B(size);
-        long ts = get_time_us();
+#ifdef __ve__
+	urpc_deadline_t d;
+	int waiting = 0;
+#endif
 
 	res.u64 = 0;
 
@@ -163,15 +197,20 @@ uint64_t alloc_payload(urpc_comm_t *uc, uint32_t size)
 	_report_free(uc, msg);
 #endif
 	while (uc->active->end - uc->active->begin < asize) {
-		uint32_t new_free = _gc_buffer(uc, asize);
+		uint64_t new_free = _gc_buffer(uc, asize);
 		if (new_free < asize) {
 			// TODO: delay, count, timeout
 #ifdef __ve__
-			if (timediff_us(ts) > URPC_ALLOC_TIMEOUT_US) {
+			if (!waiting) {
+				urpc_deadline_init(&d, URPC_ALLOC_TIMEOUT_US);
+				waiting = 1;
+			} else if (urpc_deadline_passed(&d)) {
 				eprintf("alloc_payload timed out!\n");
+				_record_alloc_fail(uc);
 				return 0;
 			}
 #else
+			_record_alloc_fail(uc);
 			return 0;
 #endif
 		} else {
@@ -179,14 +218,17 @@ uint64_t alloc_payload(urpc_comm_t *uc, uint32_t size)
                 }
 	}
 	if (uc->active->begin + asize > uc->active->end) {
-		printf("alloc: begin=%u end=%u asize=%u\n",
+		printf("alloc: begin=%lu end=%lu asize=%u\n",
 		       uc->active->begin, uc->active->end, asize);
+		_record_alloc_fail(uc);
 		return 0;
 	}
 		
-	res.c.offs = uc->active->begin;
+	res.c.offs = OFFS2MB(uc->active->begin);
+	URPC_TRACE(uc->trace, URPC_EV_ALLOC, URPC_CMD_NONE, uc->active->begin, size);
 	uc->active->begin += ALIGN8B(size);
 	res.c.len = size;
+	_record_high_water(uc);
 #ifdef DEBUGMEM
 	sprintf(msg, "allocate done (size=%d)", size);
 	_report_free(uc, msg);
@@ -28,6 +28,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/uio.h>
 
 #define MAX_VE_CORES   18
 /* maximum number of peer currently limited to 128 = 8 VEs * 16 cores */
@@ -35,15 +36,55 @@
 /* the length of the mailbox MUST be a power of 2! */
 #define URPC_LEN_MB    256
 #define URPC_BUFF_LEN_PER_THREADS (4 * 1024 * 1024)
+/* adaptive buffer sizing: grow when use exceeded this percentage of the buffer */
+#define URPC_ADAPT_HIGH_WATER_PCT 75
 #define URPC_CMD_BITS (8)
 
 #define URPC_MAX_HANDLERS ((1 << URPC_CMD_BITS) - 1)
 
 #define URPC_CMD_NONE (0)
 
+/*
+  Extended commands: a group command (1..URPC_MAX_HANDLERS) in the mailbox
+  and a sub-command in a urpc_ext_hdr_t in front of the payload.
+ */
+#define URPC_SUBCMD_BITS (8)
+#define URPC_EXT_CMD(grp, sub) (((grp) << URPC_SUBCMD_BITS) | (sub))
+#define URPC_EXT_GROUP(cmd) ((cmd) >> URPC_SUBCMD_BITS)
+#define URPC_EXT_SUB(cmd) ((cmd) & ((1 << URPC_SUBCMD_BITS) - 1))
+#define URPC_MAX_EXT_CMD URPC_EXT_CMD(URPC_MAX_HANDLERS, (1 << URPC_SUBCMD_BITS) - 1)
+
 #define URPC_PAYLOAD_BITS (27)
 #define URPC_MAX_PAYLOAD (1 << URPC_PAYLOAD_BITS)
 #define URPC_OFFSET_BITS (29)
+/* offsets in the mailbox are stored in units of 8 bytes */
+#define URPC_OFFSET_SHIFT (3)
+#define URPC_MAX_DATA_BUFF_LEN (1UL << (URPC_OFFSET_BITS + URPC_OFFSET_SHIFT))
+
+/* urpc_sendv() on VE: DMA chunk size and max number of DMAs in flight */
+#define URPC_SENDV_DMA_CHUNK (256 * 1024)
+#define URPC_SENDV_MAX_DMA 8
+
+/* payload copy methods for urpc_memcpy_method() */
+#define URPC_COPY_AUTO 0
+#define URPC_COPY_PLAIN 1
+#define URPC_COPY_NT 2
+#define URPC_COPY_PARALLEL 3
+/* copies below this size always use memcpy() */
+#define URPC_COPY_NT_MIN (64 * 1024)
+
+/* log2 buckets of the handler time histograms, in cycles */
+#define URPC_STATS_BUCKETS 40
+/* log2 buckets of the ring occupancy samples, 1 ... URPC_LEN_MB requests */
+#define URPC_POLL_OCC_BUCKETS 9
+
+/* block sizes (log2) for urpc_send_sparse(): cache line or page */
+#define URPC_SPARSE_LINE 6
+#define URPC_SPARSE_PAGE 12
+#define URPC_SPARSE_MAGIC 0x5a505255	/* "URPZ" */
+
+/* max number of commands passed to one batch handler call */
+#define URPC_BATCH_MAX 64
 
 #define URPC_DELAY_PEEK 1
 #define URPC_TIMEOUT_US (10 * 1000000)
@@ -52,6 +93,34 @@
 #define ALIGN4B(x) (((uint64_t)(x) + 3UL) & ~3UL)
 #define ALIGN8B(x) (((uint64_t)(x) + 7UL) & ~7UL)
 #define REQ2SLOT(r) (int32_t)((r) & (URPC_LEN_MB - 1))
+/* convert between mailbox offset field and byte offset in the data buffer */
+#define MB_OFFS(m) ((uint64_t)(m)->c.offs << URPC_OFFSET_SHIFT)
+#define OFFS2MB(o) ((uint64_t)(o) >> URPC_OFFSET_SHIFT)
+
+//
+// Shared memory segment header
+//
+#define URPC_SHM_MAGIC    0x5552504353484d31UL	// "URPCSHM1"
+#define URPC_SHM_VERSION  2
+#define URPC_SHM_HDR_SIZE 4096
+#define URPC_SHM_STATS_OFFS 2048	// live counters inside the header page
+#define URPC_SHM_ALIGN    (2 * 1024 * 1024)
+#define URPC_Q_VH2VE 0
+#define URPC_Q_VE2VH 1
+
+//
+// Backing of the shared memory segment (urpc_peer.shm_backing)
+//
+#define URPC_SHM_HUGETLB    1	// SysV shm with SHM_HUGETLB
+#define URPC_SHM_THP        2	// SysV shm, regular pages, MADV_HUGEPAGE
+#define URPC_SHM_PREFAULTED 0x100	// pages were populated at creation
+#define URPC_SHM_LOCKED     0x200	// pages are locked with mlock()
+
+//
+// NUMA placement policies for vh_urpc_peer_create_numa(), values >= 0 are nodes
+//
+#define URPC_NUMA_NONE  -1	// leave placement to first touch
+#define URPC_NUMA_LOCAL -2	// node of the CPU running the calling thread
 
 //
 // Sender and receiver flags
@@ -65,6 +134,16 @@ extern "C" {
 #endif
 
 /*
+  Shared memory segment layout:
+
+  +-----------------
+  | segment header     : URPC_SHM_HDR_SIZE bytes, describes the layout below
+  +-----------------
+  | VH -> VE queue     : send buffer of the VH, receive buffer of the VE
+  +-----------------
+  | VE -> VH queue     : send buffer of the VE, receive buffer of the VH
+  +-----------------
+
   Communication buffer(s) layout in shared memory:
 
   Send buffer
@@ -77,6 +156,10 @@ extern "C" {
   +-----------------
   | read slot ID       : receiver marks which is the last read req. Slot is calculated from it
   +-----------------
+  | alloc failures     : number of failed payload allocations, written by the sender
+  +-----------------
+  | high water mark    : maximum use of the data buffer in bytes, written by the sender
+  +-----------------
   | cmd slot 0         : command slots
   | ...
   | cmd slot N-1
@@ -88,6 +171,7 @@ extern "C" {
   +-----------------
 
   Receive buffer is a send buffer for the other peer. Only the roles are exchanged.
+  The two directions can have different sizes, the segment header records them.
 
   Commands are written in round robin manner into the command slots. When no commands
   have been written, yet, the written slot ID contains a -1. Otherwise it points to
@@ -98,11 +182,19 @@ extern "C" {
   a zero into it. The sender can thus find out when the slot is available again.
 
   A command (in a slot) can be attached to a payload in the data buffer. The command
-  uses 29 bits for the offset into the data buffer (if more space should be needed we
-  could use 8-byte aligned buffers in which case we could actually use up to 32 bits,
-  i.e. address 4GiB buffers by simply defining the offset as (offset / 8)). The command
-  also contains a length field of up to 27 bits (128MiB). The payload should be
-  transferrable by a single DMA transaction therefore must be less than 128MiB.
+  uses 29 bits for the offset into the data buffer. Payloads are 8-byte aligned,
+  therefore the offset is stored divided by 8 (URPC_OFFSET_SHIFT), which allows
+  addressing data buffers of up to 4GiB. The command also contains a length field
+  of up to 27 bits (128MiB). The payload should be transferrable by a single DMA
+  transaction therefore must be less than 128MiB.
+
+  The segment header is written by the VH before the peer process is started. The VE
+  side reads the offset scaling, the queue offsets and the data buffer lengths from it,
+  and refuses to attach if the magic, the version or the offset scaling don't match.
+
+  The second half of the header page holds live message counters of both sides
+  (urpc_shm_stats_t) which external tools like urpc-top read without attaching
+  as a peer.
 
   The space in the payload data buffer must be managed by the sender. Like the slots, it
   is used in a round-robin fashion.
@@ -115,7 +207,8 @@ extern "C" {
   The payload is in the data buffer.
   cmd  : the RPC command
   offs : offset inside payload data buffer, divided by 8 as data
-         must be aligned anyway. This way we can address 512MiB
+         must be aligned anyway. This way we can address 4GiB.
+         Use MB_OFFS() and OFFS2MB() for converting from/to bytes.
   len  : the length of the payload, max 128MiB
   
 */
@@ -128,17 +221,120 @@ union urpc_mb {
 	} c;
 };
 typedef union urpc_mb urpc_mb_t;
+
+struct urpc_shm_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t offs_shift;		// mailbox offsets are in units of (1 << offs_shift)
+	uint64_t q_offs[2];		// offsets of the transfer queues in the segment
+	uint64_t q_len[2];		// lengths of the transfer queues
+	uint64_t data_buff_len[2];	// lengths of the data buffers of the queues
+	uint64_t backing;		// URPC_SHM_* backing and population flags
+	uint64_t stats_offs;		// offset of the urpc_shm_stats_t area
+};
+typedef struct urpc_shm_hdr urpc_shm_hdr_t;
+
+/*
+  Live counters of one side of a queue. Each side counts locally and
+  publishes its counters into the segment every URPC_SHM_STATS_EVERY
+  messages and when its progress loop goes idle, so readers see values
+  which lag by at most that many messages.
+ */
+#define URPC_SHM_STATS_EVERY 64
+#define URPC_SHM_STATS_SPIN_MASK 0xffff	// publish every 64k empty polls
+
+struct urpc_shm_cnt {
+	uint64_t msgs;
+	uint64_t bytes;
+	uint64_t full;			// sender: puts which found the ring full
+	uint64_t spins;			// sender: polls of a busy slot, receiver: empty polls
+	uint64_t alloc_fail;		// sender: failed payload allocations
+	uint64_t last_us;		// get_time_us() of the last activity
+	uint64_t pad[2];
+};
+typedef struct urpc_shm_cnt urpc_shm_cnt_t;
+
+#define URPC_SHM_SENDER   0
+#define URPC_SHM_RECEIVER 1
+
+struct urpc_shm_stats {
+	int32_t pid[2];			// VH and VE process
+	uint32_t pad[14];
+	urpc_shm_cnt_t q[2][2];		// [URPC_Q_*][URPC_SHM_SENDER/RECEIVER]
+};
+typedef struct urpc_shm_stats urpc_shm_stats_t;
+
+/* header of a payload sent with urpc_send_sparse() */
+struct urpc_sparse_hdr {
+	uint32_t magic;
+	uint32_t block_shift;		// log2 of the block size
+	uint64_t len;			// length of the decoded data
+};
+typedef struct urpc_sparse_hdr urpc_sparse_hdr_t;
+
+/*
+  Per command handler statistics, indexed like the handler table. The time
+  of a command covers the payload transfer and the handler. Bucket i of the
+  histogram counts commands which took [2^i, 2^(i+1)) cycles, the last
+  bucket also counts all longer ones.
+ */
+struct urpc_cmd_stats {
+	uint64_t calls;
+	uint64_t bytes;			// payload bytes passed to the handler
+	uint64_t cycles;		// total time
+	uint64_t hist[URPC_STATS_BUCKETS];
+};
+typedef struct urpc_cmd_stats urpc_cmd_stats_t;
+
+/*
+  Poll efficiency of a peer. Times are in cycles of get_cycles(). The
+  occupancy is sampled when a progress call finds commands: bucket i counts
+  samples with [2^i, 2^(i+1)) requests in the receive ring.
+ */
+struct urpc_poll_stats {
+	uint64_t calls;			// progress loop calls
+	uint64_t empty;			// ... which found no command
+	uint64_t empty_cycles;		// time spent in empty calls
+	uint64_t busy_cycles;		// time spent in calls which did work
+	uint64_t full_waits;		// puts which found the send ring full
+	uint64_t full_spins;		// polls of the busy slot
+	uint64_t full_cycles;		// time waiting for a free slot
+	uint64_t req_polls;		// empty polls in urpc_recv_req_timeout()
+	uint64_t req_cycles;		// time waiting there
+	uint64_t timeouts;		// urpc_recv_req_timeout() calls which expired
+	uint64_t occ_samples;
+	uint64_t occ_sum;
+	uint64_t occ_hist[URPC_POLL_OCC_BUCKETS];
+};
+typedef struct urpc_poll_stats urpc_poll_stats_t;
+
+/* payload header of extended commands, user data follows 8 byte aligned */
+struct urpc_ext_hdr {
+	uint32_t cmd;			// full extended command ID
+	uint32_t pad;
+};
+typedef struct urpc_ext_hdr urpc_ext_hdr_t;
 	
 struct transfer_queue {
 	volatile uint32_t sender_flags;
 	volatile uint32_t receiver_flags;
 	volatile int64_t last_put_req;
 	volatile int64_t last_get_req;
+	volatile uint64_t alloc_fail;
+	volatile uint64_t high_water;
 	volatile urpc_mb_t mb[URPC_LEN_MB];
 	volatile uint64_t data[];
 };
 typedef struct transfer_queue transfer_queue_t;
 
+/* length of the data buffer of a transfer queue taking q_len bytes */
+#define URPC_TQ_DATA_LEN(q_len) \
+	((int64_t)(q_len) - (int64_t)offsetof(transfer_queue_t, data))
+
+/*
+  The data buffer is limited to URPC_MAX_DATA_BUFF_LEN (4GiB), therefore byte
+  offsets inside it fit into 32 bits.
+*/
 union mlist {
 	uint64_t u64;
 	struct {
@@ -149,11 +345,54 @@ union mlist {
 typedef union mlist mlist_t;
 
 struct free_block {
-	uint32_t begin;	// offset of beginning of free block
-	uint32_t end;	// offset of end of free block
+	uint64_t begin;	// offset of beginning of free block
+	uint64_t end;	// offset of end of free block
 };
 typedef struct free_block free_block_t;
 
+/*
+  Trace events, recorded in a per peer ring when tracing is enabled.
+ */
+#define URPC_EV_PUT		1	// command put into the send queue, arg: len
+#define URPC_EV_GET		2	// command taken from the recv queue, arg: len
+#define URPC_EV_PAYLOAD		3	// payload ready for the handler, arg: len
+#define URPC_EV_HANDLER_BEGIN	4	// arg: number of commands in the batch
+#define URPC_EV_HANDLER_END	5	// arg: handler return value
+#define URPC_EV_SLOT_DONE	6
+#define URPC_EV_ALLOC		7	// req: buffer offset, arg: size
+#define URPC_EV_GC		8	// req: last put request, arg: free bytes
+
+struct urpc_trace_ev {
+	uint64_t ts;			// get_cycles()
+	int64_t req;
+	uint16_t type;
+	uint16_t cmd;
+	uint32_t arg;
+};
+typedef struct urpc_trace_ev urpc_trace_ev_t;
+
+#define URPC_TRACE_MAGIC 0x5552504354524331UL	/* "URPCTRC1" */
+#define URPC_TRACE_VERSION 1
+
+/* header of a trace dump, followed by nevents urpc_trace_ev_t, oldest first */
+struct urpc_trace_file_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t side;			// 0: VH, 1: VE
+	int32_t segid;
+	int32_t pid;
+	uint64_t nevents;
+	uint64_t lost;			// events overwritten in the ring
+	uint64_t ref_cycles;		// cycles and wall clock (us) when enabled
+	uint64_t ref_us;
+	uint64_t end_cycles;		// cycles and wall clock (us) at dump time
+	uint64_t end_us;
+};
+typedef struct urpc_trace_file_hdr urpc_trace_file_hdr_t;
+
+struct urpc_trace;
+typedef struct urpc_trace urpc_trace_t;
+
 struct urpc_comm {
 	// payload buffer memory management
 	// memory block associated to each mailbox slot in transfer queue
@@ -162,6 +401,13 @@ struct urpc_comm {
 	free_block_t *active;	// active memory block
 	free_block_t mem[2];	// free memory blocks
 	transfer_queue_t *tq;	// communication buffer in shared memory segment
+	uint64_t alloc_fail;	// local copies of the allocation statistics in tq
+	uint64_t high_water;
+	uint64_t gc_runs;	// number of payload buffer garbage collections
+	urpc_trace_t *trace;	// trace ring of the peer, or NULL
+	urpc_shm_cnt_t cnt;	// local counters, published to shm_cnt
+	uint64_t cnt_pub;	// cnt.msgs at the last publication
+	urpc_shm_cnt_t *shm_cnt;	// counters in the segment (VEHVA on the VE)
 #ifdef __ve__
 	uint64_t shm_data_vehva;	// start of payload buffer space in shm segment vehva
 	uint64_t mirr_data_vehva;	// VEHVA address of VE mirror buffer to payload buffer
@@ -174,6 +420,9 @@ typedef struct urpc_comm urpc_comm_t;
 struct urpc_peer;
 typedef struct urpc_peer urpc_peer_t;
 
+struct urpc_pool;
+typedef struct urpc_pool urpc_pool_t;
+
 /*
   URPC handler function type.
 
@@ -185,6 +434,39 @@ typedef struct urpc_peer urpc_peer_t;
   payload length
  */
 typedef int (*urpc_handler_func)(urpc_peer_t *, urpc_mb_t *, int64_t, void *, size_t);
+/*
+  Batch handler: called with n consecutive commands of the same ID,
+  arrays of mailbox entries, request IDs, payload pointers and lengths.
+ */
+typedef int (*urpc_batch_handler_func)(urpc_peer_t *up, int n, urpc_mb_t *m,
+				       int64_t *req, void **payload, size_t *plen);
+
+/*
+  Pre-compiled pack format, see urpc_fmt_compile().
+
+  e[]   : one entry per element ('A' arrays use one element)
+    type  : the format character
+    esize : element size of 'A' arrays
+    offs  : offset of the element in the payload. Valid for the first
+            'nfixed' elements, i.e. up to and including the first buffer.
+  fixed_size : size of all scalars, paddings and buffer length fields
+
+  urpc_fmt_compile() accepts at most URPC_FMT_MAX_ARGS elements, the string
+  functions urpc_generic_send() and urpc_unpack_payload() have no limit.
+ */
+#define URPC_FMT_MAX_ARGS 64
+struct urpc_fmt_elem {
+	char type;
+	uint8_t esize;
+	uint32_t offs;
+};
+struct urpc_fmt {
+	int nargs;
+	int nfixed;
+	uint32_t fixed_size;
+	struct urpc_fmt_elem e[];
+};
+typedef struct urpc_fmt urpc_fmt_t;
 	
 struct urpc_peer {
 	urpc_comm_t send;
@@ -192,6 +474,8 @@ struct urpc_peer {
 	int shm_key, shm_segid;
 	size_t shm_size;
 	void *shm_addr;
+	int shm_backing;
+	int numa_node;		// NUMA node the segment is placed on, or -1
 #ifdef __ve__
 	uint64_t shm_vehva;
 	void *mirr_buff;
@@ -200,8 +484,16 @@ struct urpc_peer {
 	int shm_destroyed;
 	pthread_mutex_t lock;
 	pid_t child_pid;
+	int ready_fd;		// read end of the attach handshake pipe, or -1
 	urpc_handler_func handler[256];
-	int urpc_data_buff_len;
+	urpc_cmd_stats_t *stats;	// handler statistics, NULL when disabled
+	urpc_poll_stats_t *poll;	// poll statistics, NULL when disabled
+	urpc_cmd_stats_t *stats_mem;	// kept while the peer lives, also when disabled
+	urpc_poll_stats_t *poll_mem;
+	urpc_handler_func **ext;	// sub-command tables of the groups, or NULL
+	urpc_batch_handler_func *batch;	// batch handlers, or NULL
+	urpc_trace_t *trace;		// trace ring, or NULL when disabled
+	int64_t urpc_data_buff_len;	// data buffer length of the VH -> VE queue
 };
   
 #ifdef __ve__
@@ -217,7 +509,17 @@ void ve_prev_sent_payload(urpc_peer_t *up, int offs, void **payload, size_t *ple
 # else
 
 urpc_peer_t *vh_urpc_peer_create(void);
+urpc_peer_t *vh_urpc_peer_create_numa(int numa_node);
+int vh_urpc_numa_bind_thread(urpc_peer_t *up);
 int vh_urpc_peer_destroy(urpc_peer_t *up);
+urpc_peer_t *vh_urpc_peer_attach(int segid);
+int vh_urpc_peer_detach(urpc_peer_t *up);
+int vh_urpc_peer_reset(urpc_peer_t *up);
+urpc_pool_t *vh_urpc_pool_create(int npeers, int numa_node, char *binary,
+				 int venode_id, int ve_core);
+urpc_peer_t *vh_urpc_pool_get(urpc_pool_t *pool);
+int vh_urpc_pool_put(urpc_pool_t *pool, urpc_peer_t *up);
+void vh_urpc_pool_destroy(urpc_pool_t *pool);
 int vh_urpc_child_create(urpc_peer_t *up, char *binary,
                          int ve_node, int ve_core);
 int vh_urpc_child_destroy(urpc_peer_t *up);
@@ -228,6 +530,26 @@ int vh_urpc_recv_progress_timeout(urpc_peer_t *up, int ncmds, long timeout_us);
 
 int set_recv_payload(urpc_comm_t *uc, urpc_mb_t *m, void **payload, size_t *plen);
 int64_t urpc_generic_send(urpc_peer_t *up, int cmd, char *fmt, ...);
+int64_t urpc_sendv(urpc_peer_t *up, int cmd, const struct iovec *iov, int n);
+void *urpc_alloc_send_payload(urpc_comm_t *uc, size_t size, urpc_mb_t *mb);
+int64_t urpc_submit_send(urpc_peer_t *up, urpc_mb_t *mb, size_t len);
+void urpc_memcpy(void *dst, const void *src, size_t n);
+void urpc_memcpy_method(int method, void *dst, const void *src, size_t n);
+const char *urpc_memcpy_info(void);
+int64_t urpc_send_sparse(urpc_peer_t *up, int cmd, const void *buf, size_t len,
+			 int block_shift);
+int64_t urpc_sparse_len(const void *payload, size_t plen);
+int64_t urpc_sparse_decode(const void *payload, size_t plen, void *dst, size_t dlen);
+int urpc_stats_enable(urpc_peer_t *up, int enable);
+const urpc_cmd_stats_t *urpc_stats_get(urpc_peer_t *up, int cmd);
+void urpc_stats_reset(urpc_peer_t *up);
+void urpc_stats_dump(urpc_peer_t *up, FILE *f);
+int urpc_poll_stats_enable(urpc_peer_t *up, int enable);
+const urpc_poll_stats_t *urpc_poll_stats_get(urpc_peer_t *up);
+void urpc_poll_stats_reset(urpc_peer_t *up);
+void urpc_poll_stats_dump(urpc_peer_t *up, FILE *f);
+int urpc_trace_enable(urpc_peer_t *up, uint64_t nevents);
+int urpc_trace_dump(urpc_peer_t *up, const char *path);
 int64_t urpc_get_cmd(transfer_queue_t *tq, urpc_mb_t *m);
 uint32_t urpc_get_receiver_flags(urpc_comm_t *uc);
 uint32_t urpc_get_sender_flags(urpc_comm_t *uc);
@@ -236,11 +558,17 @@ int64_t urpc_put_cmd(urpc_peer_t *up, urpc_mb_t *m);
 int urpc_recv_req_timeout(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
                           long timeout_us, void **payload, size_t *plen);
 int urpc_register_handler(urpc_peer_t *up, int cmd, urpc_handler_func h);
+int urpc_unregister_handler(urpc_peer_t *up, int cmd);
+int urpc_register_batch_handler(urpc_peer_t *up, int cmd, urpc_batch_handler_func h);
 void urpc_set_handler_init_hook(void (*func)(urpc_peer_t *up));
 void urpc_set_receiver_flags(urpc_comm_t *uc, uint32_t flags);
 void urpc_set_sender_flags(urpc_comm_t *uc, uint32_t flags);
 void urpc_slot_done(transfer_queue_t *tq, int slot, urpc_mb_t *m);
 int urpc_unpack_payload(void *payload, size_t psz, char *fmt, ...);
+urpc_fmt_t *urpc_fmt_compile(const char *fmt);
+void urpc_fmt_free(urpc_fmt_t *f);
+int64_t urpc_send_fmt(urpc_peer_t *up, int cmd, urpc_fmt_t *f, ...);
+int urpc_unpack_fmt(void *payload, size_t psz, urpc_fmt_t *f, ...);
 int urpc_wait_peer_attach(urpc_peer_t *up);
 int64_t urpc_max_send_cmd_size(urpc_peer_t *up);
 #ifdef __cplusplus
@@ -0,0 +1,336 @@
+#ifndef URPC_HPP_INCLUDE
+#define URPC_HPP_INCLUDE
+
+/**
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *
+ * Header-only C++17 interface with typed pack/unpack.
+ *
+ * Copyright (c) 2020 Erich Focht
+ */
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "urpc.h"
+
+/*
+  A command is described by its ID and its argument types:
+
+    using Add = urpc::command<5, uint32_t, double, urpc::buffer>;
+
+    urpc::send<Add>(up, 1u, 2.0, urpc::buffer{ptr, len});
+
+    int add_handler(urpc_peer_t *up, int64_t req, uint32_t a, double b,
+                    urpc::buffer c);
+    urpc::register_handler<Add, &add_handler>(up);
+
+  Supported argument types are arithmetic types and enums of 4 or 8 bytes,
+  and urpc::buffer. IDs can be extended commands built with URPC_EXT_CMD().
+
+  Payload layout, computed at compile time:
+  - scalars and the 64 bit length fields of buffers are placed in argument
+    order, 8 byte values are padded to 8 byte boundaries,
+  - the buffer contents follow the fixed part, each one starting at an
+    8 byte boundary.
+  With a single buffer as last argument this is the same layout as
+  urpc_generic_send() produces with the corresponding format string
+  (e.g. "IxLP"), so C and C++ peers can talk to each other.
+
+  The receive side trampoline unpacks directly into the handler arguments.
+  Buffers point into the payload, like with urpc_unpack_payload().
+ */
+
+namespace urpc {
+
+struct buffer {
+	const void *ptr;
+	size_t len;
+};
+
+template <int ID, typename... Args>
+struct command {
+	static_assert(ID > 0 && ID <= URPC_MAX_EXT_CMD, "invalid command ID");
+	static constexpr int id = ID;
+	using args = std::tuple<Args...>;
+};
+
+namespace detail {
+
+template <typename T, typename = void>
+struct wire {
+	static_assert(sizeof(T) == 0, "unsupported urpc argument type");
+};
+
+template <typename T>
+struct wire<T, std::enable_if_t<std::is_arithmetic<T>::value || std::is_enum<T>::value>> {
+	static_assert(sizeof(T) == 4 || sizeof(T) == 8,
+		      "urpc scalars must be 4 or 8 bytes wide");
+	static constexpr size_t size = sizeof(T);
+	static constexpr bool is_buffer = false;
+};
+
+template <>
+struct wire<buffer> {
+	static constexpr size_t size = 8;	// length field
+	static constexpr bool is_buffer = true;
+};
+
+constexpr size_t align8(size_t x) { return (x + 7) & ~size_t(7); }
+
+template <typename... Ts>
+struct layout {
+	static constexpr size_t nargs = sizeof...(Ts);
+
+	static constexpr std::array<size_t, nargs> compute_offs()
+	{
+		std::array<size_t, nargs> o{};
+		size_t sizes[] = { wire<Ts>::size..., 0 };
+		size_t off = 0;
+		for (size_t i = 0; i < nargs; i++) {
+			if (sizes[i] == 8)
+				off = align8(off);
+			o[i] = off;
+			off += sizes[i];
+		}
+		return o;
+	}
+
+	static constexpr size_t compute_fixed()
+	{
+		size_t sizes[] = { wire<Ts>::size..., 0 };
+		size_t off = 0;
+		for (size_t i = 0; i < nargs; i++) {
+			if (sizes[i] == 8)
+				off = align8(off);
+			off += sizes[i];
+		}
+		return off;
+	}
+
+	static constexpr std::array<size_t, nargs> offs = compute_offs();
+	static constexpr size_t fixed_size = compute_fixed();
+	static constexpr size_t nbuffers = (0 + ... + (wire<Ts>::is_buffer ? 1 : 0));
+};
+
+template <typename Tuple> struct layout_of;
+template <typename... Ts>
+struct layout_of<std::tuple<Ts...>> : layout<Ts...> {};
+
+template <typename T>
+inline void put(char *payload, size_t off, const T &v, char *&var)
+{
+	if constexpr (std::is_same<T, buffer>::value) {
+		uint64_t len = v.len;
+		std::memcpy(payload + off, &len, 8);
+		if (v.len)
+			urpc_memcpy(var, v.ptr, v.len);
+		var += align8(v.len);
+	} else {
+		std::memcpy(payload + off, &v, sizeof(T));
+	}
+}
+
+template <typename T>
+inline T get(const char *payload, size_t off, const char *&var)
+{
+	if constexpr (std::is_same<T, buffer>::value) {
+		uint64_t len;
+		std::memcpy(&len, payload + off, 8);
+		buffer b{ var, (size_t)len };
+		var += align8(len);
+		return b;
+	} else {
+		T v;
+		std::memcpy(&v, payload + off, sizeof(T));
+		return v;
+	}
+}
+
+template <typename... Ts, size_t... I>
+inline size_t var_size(const std::tuple<Ts...> &t, std::index_sequence<I...>)
+{
+	size_t sz = 0;
+	((sz += [&]() -> size_t {
+		if constexpr (std::is_same<Ts, buffer>::value)
+			return align8(std::get<I>(t).len);
+		else
+			return 0;
+	}()), ...);
+	return sz;
+}
+
+template <typename L, typename... Ts, size_t... I>
+inline void pack(char *payload, const std::tuple<Ts...> &t, std::index_sequence<I...>)
+{
+	char *var = payload + align8(L::fixed_size);
+	(put<Ts>(payload, L::offs[I], std::get<I>(t), var), ...);
+}
+
+template <typename L, typename... Ts, size_t... I>
+inline std::tuple<Ts...> unpack(const char *payload, std::tuple<Ts...> *,
+				std::index_sequence<I...>)
+{
+	const char *var = payload + align8(L::fixed_size);
+	// braced init guarantees left to right evaluation
+	return std::tuple<Ts...>{ get<Ts>(payload, L::offs[I], var)... };
+}
+
+/*
+  Check that the buffers whose lengths are stored in the fixed part fit
+  into the payload, like the overrun check of urpc_unpack_payload().
+ */
+template <typename L, typename... Ts, size_t... I>
+inline bool fits(const char *payload, size_t plen, std::tuple<Ts...> *,
+		 std::index_sequence<I...>)
+{
+	size_t end = align8(L::fixed_size);
+	bool ok = end <= plen;
+	((ok = ok && [&]() -> bool {
+		if constexpr (std::is_same<Ts, buffer>::value) {
+			uint64_t len;
+			std::memcpy(&len, payload + L::offs[I], 8);
+			if (len > plen - end || align8(len) > plen - end)
+				return false;
+			end += align8(len);
+		}
+		return true;
+	}()), ...);
+	return ok;
+}
+
+template <typename Cmd, auto F>
+int trampoline(urpc_peer_t *up, urpc_mb_t *m, int64_t req, void *payload, size_t plen)
+{
+	using args = typename Cmd::args;
+	using L = layout_of<args>;
+	constexpr size_t n = std::tuple_size<args>::value;
+
+	if (plen < L::fixed_size)
+		return -EINVAL;
+	if constexpr (L::nbuffers > 0)
+		if (!fits<L>((const char *)payload, plen, (args *)nullptr,
+			     std::make_index_sequence<n>{}))
+			return -EINVAL;
+	auto t = unpack<L>((const char *)payload, (args *)nullptr,
+			   std::make_index_sequence<n>{});
+	return std::apply([&](auto &&... a) { return F(up, req, a...); }, t);
+}
+
+} // namespace detail
+
+/*
+  Send command Cmd, the arguments are converted to the argument types of Cmd.
+
+  Returns the request ID or a negative error.
+ */
+template <typename Cmd, typename... A>
+int64_t send(urpc_peer_t *up, A &&... a)
+{
+	using args = typename Cmd::args;
+	using L = detail::layout_of<args>;
+	constexpr size_t n = std::tuple_size<args>::value;
+	static_assert(sizeof...(A) == n, "wrong number of arguments for command");
+
+	constexpr bool ext = Cmd::id > URPC_MAX_HANDLERS;
+	constexpr size_t hsz = ext ? sizeof(urpc_ext_hdr_t) : 0;
+	urpc_mb_t mb;
+	mb.u64 = 0;
+	if constexpr (n == 0 && !ext) {
+		mb.c.cmd = Cmd::id;
+		return urpc_submit_send(up, &mb, 0);
+	} else {
+		args t(std::forward<A>(a)...);
+		size_t size = hsz + detail::align8(L::fixed_size);
+		if constexpr (L::nbuffers > 0)
+			size += detail::var_size(t, std::make_index_sequence<n>{});
+		char *payload = (char *)urpc_alloc_send_payload(&up->send, size, &mb);
+		if (payload == nullptr)
+			return -EAGAIN;
+		if constexpr (ext) {
+			urpc_ext_hdr_t h{ (uint32_t)Cmd::id, 0 };
+			std::memcpy(payload, &h, hsz);
+			mb.c.cmd = URPC_EXT_GROUP(Cmd::id);
+		} else {
+			mb.c.cmd = Cmd::id;
+		}
+		detail::pack<L>(payload + hsz, t, std::make_index_sequence<n>{});
+		return urpc_submit_send(up, &mb, size);
+	}
+}
+
+/*
+  Register F as handler for Cmd. F is called with the peer, the request ID
+  and the unpacked arguments:  int F(urpc_peer_t *, int64_t, Args...)
+ */
+template <typename Cmd, auto F>
+int register_handler(urpc_peer_t *up)
+{
+	return urpc_register_handler(up, Cmd::id, &detail::trampoline<Cmd, F>);
+}
+
+/*
+  RAII wrapper around a urpc peer.
+ */
+class Peer {
+public:
+#ifdef __ve__
+	explicit Peer(int segid = 0) : up_(ve_urpc_init(segid))
+	{
+		if (up_ == nullptr)
+			throw std::runtime_error("ve_urpc_init failed");
+	}
+	~Peer() { if (up_) ve_urpc_fini(up_); }
+	int progress(int ncmds) { return ve_urpc_recv_progress(up_, ncmds); }
+#else
+	Peer() : up_(vh_urpc_peer_create())
+	{
+		if (up_ == nullptr)
+			throw std::runtime_error("vh_urpc_peer_create failed");
+	}
+	explicit Peer(int numa_node) : up_(vh_urpc_peer_create_numa(numa_node))
+	{
+		if (up_ == nullptr)
+			throw std::runtime_error("vh_urpc_peer_create failed");
+	}
+	~Peer() { if (up_) vh_urpc_peer_destroy(up_); }
+	int progress(int ncmds) { return vh_urpc_recv_progress(up_, ncmds); }
+#endif
+	Peer(const Peer &) = delete;
+	Peer &operator=(const Peer &) = delete;
+	Peer(Peer &&o) noexcept : up_(o.up_) { o.up_ = nullptr; }
+	Peer &operator=(Peer &&o) noexcept { std::swap(up_, o.up_); return *this; }
+
+	urpc_peer_t *get() const { return up_; }
+
+	template <typename Cmd, typename... A>
+	int64_t send(A &&... a) { return urpc::send<Cmd>(up_, std::forward<A>(a)...); }
+
+	template <typename Cmd, auto F>
+	int handle() { return urpc::register_handler<Cmd, F>(up_); }
+
+private:
+	urpc_peer_t *up_;
+};
+
+} // namespace urpc
+
+#endif /* URPC_HPP_INCLUDE */
@@ -19,6 +19,11 @@
  * Copyright (c) 2020 Erich Focht
  */
 #include <stdarg.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "urpc_common.h"
 #include "ve_inst.h"
@@ -32,14 +37,52 @@
   Wait for the shared memory segment to be attached by two processes.
   When done, mark the shared memory segment as destroyed.
   This avoids left-over shared memory segments in the VH memory.
+
+  Children started by vh_urpc_child_create() report the attach through
+  the handshake pipe, the wait blocks until then or until the child exits.
 */
 int urpc_wait_peer_attach(urpc_peer_t *up)
 {
 #ifndef __ve__
-	return vh_shm_wait_peers(up->child_pid, up->shm_segid);
+	int rc = vh_shm_wait_peers(up->child_pid, up->shm_segid, up->ready_fd);
+	if (up->ready_fd >= 0) {
+		close(up->ready_fd);
+		up->ready_fd = -1;
+	}
+	return rc;
 #endif
 }
 
+/*
+  Child side of the attach handshake: tell the creator of the segment that
+  we attached by writing a byte into the pipe inherited through
+  URPC_READY_FD. Only the first attach of a process reports, the variable
+  is removed such that the fd number isn't used again.
+
+  A launcher or wrapper may have closed the fd and reused its number, so
+  it is only written to and closed if it still is the write end of a pipe.
+*/
+void urpc_signal_attached(void)
+{
+	char *e = getenv("URPC_READY_FD"), *end;
+	struct stat st;
+	char c = 1;
+
+	if (e == NULL)
+		return;
+	long l = strtol(e, &end, 10);
+	int fd = (end != e && *end == 0 && l >= 0 && l <= INT32_MAX) ? (int)l : -1;
+	unsetenv("URPC_READY_FD");
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode)
+	    || (fcntl(fd, F_GETFL) & O_ACCMODE) != O_WRONLY) {
+		dprintf("urpc_signal_attached: fd %d is not a pipe, ignored\n", fd);
+		return;
+	}
+	if (write(fd, &c, 1) != 1)
+		dprintf("urpc_signal_attached: write to fd %d failed\n", fd);
+	close(fd);
+}
+
 uint32_t urpc_get_receiver_flags(urpc_comm_t *uc)
 {
 	return TQ_READ32(uc->tq->receiver_flags);
@@ -79,8 +122,8 @@ int64_t urpc_get_cmd(transfer_queue_t *tq, urpc_mb_t *m)
 		req = last_get + 1;
 		slot = REQ2SLOT(req);
 		m->u64 = TQ_READ64(tq->mb[slot].u64);
-		dprintf("urpc_get_cmd req=%ld cmd=%u offs=%u len=%u\n",
-			req, m->c.cmd, m->c.offs, m->c.len);
+		dprintf("urpc_get_cmd req=%ld cmd=%u offs=%lu len=%u\n",
+			req, m->c.cmd, MB_OFFS(m), m->c.len);
 		TQ_WRITE64(tq->last_get_req, req);
 		TQ_FENCE();
 	}
@@ -96,10 +139,11 @@ int64_t urpc_get_cmd_timeout(transfer_queue_t *tq, urpc_mb_t *m, long timeout_us
 {
 	int64_t res;
 
-	long done_ts = get_time_us();
+	urpc_deadline_t d;
 
+	urpc_deadline_init(&d, timeout_us);
 	while (((res = urpc_get_cmd(tq, m)) == -1) &&
-	       timediff_us(done_ts) < timeout_us);
+	       !urpc_deadline_passed(&d));
 	return res;
 }
 
@@ -123,8 +167,8 @@ int64_t urpc_get_req(transfer_queue_t *tq, urpc_mb_t *m, int64_t req)
 	if (last_put >= req) {
 		slot = REQ2SLOT(req);
 		m->u64 = TQ_READ64(tq->mb[slot].u64);
-		dprintf("urpc_get_req req=%ld cmd=%u offs=%u len=%u\n",
-                        req, m->c.cmd, m->c.offs, m->c.len);
+		dprintf("urpc_get_req req=%ld cmd=%u offs=%lu len=%u\n",
+                        req, m->c.cmd, MB_OFFS(m), m->c.len);
 		if (last_get + 1 == req) {	
 			TQ_WRITE64(tq->last_get_req, req);
 			TQ_FENCE();
@@ -185,15 +229,29 @@ int64_t urpc_put_cmd(urpc_peer_t *up, urpc_mb_t *m)
 	int slot = -1;
 	urpc_mb_t next;
 	int64_t req = TQ_READ64(tq->last_put_req) + 1;
+	uint64_t spins = 0;
+	URPC_POLL_DECL(tw);
 
 	TQ_FENCE();
 	slot = REQ2SLOT(req);
         // wait for next slot to become free
-	do {
+	while (1) {
 		next.u64 = TQ_READ64(tq->mb[slot].u64);
 		TQ_FENCE();
+		if (next.c.cmd == URPC_CMD_NONE)
+			break;
+		if (spins++ == 0)
+			URPC_POLL_START(up, tw);
 		// TODO: timeout
-	} while(next.c.cmd != URPC_CMD_NONE);
+	}
+#ifndef URPC_NO_STATS
+	urpc_poll_stats_t *ps = _urpc_poll_ptr(up);
+	if (spins && ps && tw) {
+		ps->full_waits++;
+		ps->full_spins += spins;
+		ps->full_cycles += get_cycles() - tw;
+	}
+#endif
 
 #if 0
         // next slot is free now, if its memory wasn't garbage collected
@@ -218,14 +276,23 @@ int64_t urpc_put_cmd(urpc_peer_t *up, urpc_mb_t *m)
         mlist_t *ml = &uc->mlist[slot];
 	if (m->c.len) {
 		ml->b.len = m->c.len;
-		ml->b.offs = m->c.offs;
+		ml->b.offs = MB_OFFS(m);
 	} else
 		ml->u64 = 0;
         
 	TQ_WRITE64(tq->mb[slot].u64, m->u64);
 	TQ_WRITE64(tq->last_put_req, req);
-        dprintf("urpc_put_cmd req=%ld cmd=%u offs=%u len=%u\n",
-                req, m->c.cmd, m->c.offs, m->c.len);
+	URPC_TRACE(uc->trace, URPC_EV_PUT, m->c.cmd, req, m->c.len);
+	uc->cnt.msgs++;
+	uc->cnt.bytes += m->c.len;
+	if (spins) {
+		uc->cnt.full++;
+		uc->cnt.spins += spins;
+	}
+	if (spins || uc->cnt.msgs - uc->cnt_pub >= URPC_SHM_STATS_EVERY)
+		_urpc_cnt_publish(uc);
+        dprintf("urpc_put_cmd req=%ld cmd=%u offs=%lu len=%u\n",
+                req, m->c.cmd, MB_OFFS(m), m->c.len);
 	return req;
 }
 
@@ -240,11 +307,11 @@ int set_recv_payload(urpc_comm_t *uc, urpc_mb_t *m, void **payload, size_t *plen
 	//
 	if (m->c.len > 0) {
 #ifdef __ve__
-		*payload = (void *)((char *)uc->mirr_data_buff + m->c.offs);
+		*payload = (void *)((char *)uc->mirr_data_buff + MB_OFFS(m));
 		*plen = m->c.len;
 		if (*plen <= 16) {
-			int aoffs = m->c.offs >> 3;  // divide by 8
-			for (int i = 0; i < *plen >> 3; i++) {
+			int64_t aoffs = m->c.offs;  // offset in 8 byte units
+			for (int i = 0; i < ALIGN8B(*plen) >> 3; i++) {
 				((uint64_t *)(uc->mirr_data_buff))[aoffs + i] =
 					TQ_READ64(tq->data[aoffs + i]);
 			}
@@ -253,8 +320,8 @@ int set_recv_payload(urpc_comm_t *uc, urpc_mb_t *m, void **payload, size_t *plen
 			//
 			// do the DMA transfer synchronously
 			//
-			err = ve_transfer_data_sync(uc->mirr_data_vehva + m->c.offs, // dst
-                                                    uc->shm_data_vehva + m->c.offs,  // src
+			err = ve_transfer_data_sync(uc->mirr_data_vehva + MB_OFFS(m), // dst
+                                                    uc->shm_data_vehva + MB_OFFS(m),  // src
                                                     *plen);
 			if (err) {
 				eprintf("[VE ERROR] ve_dma_post_wait failed: %x\n", err);
@@ -263,7 +330,7 @@ int set_recv_payload(urpc_comm_t *uc, urpc_mb_t *m, void **payload, size_t *plen
 			}
 		}
 #else
-		*payload = (void *)((char *)&tq->data[0] + m->c.offs);
+		*payload = (void *)((char *)&tq->data[0] + MB_OFFS(m));
 		*plen = m->c.len;
 #endif
 
@@ -274,6 +341,47 @@ int set_recv_payload(urpc_comm_t *uc, urpc_mb_t *m, void **payload, size_t *plen
 	return 0;
 }
 
+/*
+  Set the payload pointers of n received commands. On the VE payloads which
+  are adjacent in the data buffer are transferred with one DMA.
+*/
+int set_recv_payload_batch(urpc_comm_t *uc, urpc_mb_t *m, int n, void **payload,
+			   size_t *plen)
+{
+#ifdef __ve__
+	int i = 0, err;
+
+	while (i < n) {
+		if (m[i].c.len == 0) {
+			payload[i] = NULL;
+			plen[i++] = 0;
+			continue;
+		}
+		uint64_t beg = MB_OFFS(&m[i]);
+		uint64_t end = beg + ALIGN8B(m[i].c.len);
+		int j = i + 1;
+		while (j < n && m[j].c.len > 0 && MB_OFFS(&m[j]) == end
+		       && end + ALIGN8B(m[j].c.len) - beg < URPC_MAX_PAYLOAD)
+			end += ALIGN8B(m[j++].c.len);
+		err = ve_transfer_data_sync(uc->mirr_data_vehva + beg,
+					    uc->shm_data_vehva + beg, (int)(end - beg));
+		if (err) {
+			eprintf("[VE ERROR] ve_dma_post_wait failed: %x\n", err);
+			return -EIO;
+		}
+		for (; i < j; i++) {
+			payload[i] = (void *)((char *)uc->mirr_data_buff + MB_OFFS(&m[i]));
+			plen[i] = m[i].c.len;
+		}
+	}
+	return 0;
+#else
+	for (int i = 0; i < n; i++)
+		set_recv_payload(uc, &m[i], &payload[i], &plen[i]);
+	return 0;
+#endif
+}
+
 /*
   Wait for a particular request, with timeout.
 
@@ -286,10 +394,24 @@ int urpc_recv_req_timeout(urpc_peer_t *up, urpc_mb_t *m, int64_t req, long timeo
         urpc_comm_t *uc = &up->recv;
 	transfer_queue_t *tq = uc->tq;
 
-	long done_ts = get_time_us();
+	urpc_deadline_t d;
+	uint64_t polls = 0;
+	URPC_POLL_DECL(tw);
 
+	URPC_POLL_START(up, tw);
+	urpc_deadline_init(&d, timeout_us);
 	while (((res = urpc_get_req(tq, m, req)) == -1) &&
-	       timediff_us(done_ts) < timeout_us);
+	       !urpc_deadline_passed(&d))
+		polls++;
+#ifndef URPC_NO_STATS
+	urpc_poll_stats_t *ps = _urpc_poll_ptr(up);
+	if (ps && tw) {
+		ps->req_polls += polls;
+		ps->req_cycles += get_cycles() - tw;
+		if (res != req)
+			ps->timeouts++;
+	}
+#endif
 	if (res == req) {
 		//
 		// set/receive payload, if needed
@@ -300,15 +422,68 @@ int urpc_recv_req_timeout(urpc_peer_t *up, urpc_mb_t *m, int64_t req, long timeo
 }
 
 /*
-  Register a RPC handler.
+  Group handler of extended commands: strip the payload header and call the
+  sub-command handler. Two table lookups, the tables of a group are 2kB.
+  Sub-commands without handler are rejected with -ENOENT.
+*/
+static int _urpc_ext_dispatch(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			      void *payload, size_t plen)
+{
+	const urpc_ext_hdr_t *h = (const urpc_ext_hdr_t *)payload;
+
+	if (plen < sizeof(urpc_ext_hdr_t) || URPC_EXT_GROUP(h->cmd) != m->c.cmd) {
+		eprintf("extended command in group %d without valid header\n", m->c.cmd);
+		return -EINVAL;
+	}
+	urpc_handler_func func = up->ext[m->c.cmd][URPC_EXT_SUB(h->cmd)];
+	if (func == NULL) {
+		dprintf("no handler for extended cmd=%u\n", h->cmd);
+		return -ENOENT;
+	}
+	return func(up, m, req, (char *)payload + sizeof(urpc_ext_hdr_t),
+		    plen - sizeof(urpc_ext_hdr_t));
+}
+
+static int _urpc_register_ext_handler(urpc_peer_t *up, int cmd, urpc_handler_func handler)
+{
+	int grp = URPC_EXT_GROUP(cmd), sub = URPC_EXT_SUB(cmd);
+
+	if (up->handler[grp] && up->handler[grp] != _urpc_ext_dispatch)
+		return -EEXIST;	// group ID is used by a plain command
+	if (up->ext == NULL) {
+		up->ext = (urpc_handler_func **)calloc(URPC_MAX_HANDLERS + 1,
+						       sizeof(urpc_handler_func *));
+		if (up->ext == NULL)
+			return -ENOMEM;
+	}
+	if (up->ext[grp] == NULL) {
+		up->ext[grp] = (urpc_handler_func *)calloc(1 << URPC_SUBCMD_BITS,
+							   sizeof(urpc_handler_func));
+		if (up->ext[grp] == NULL)
+			return -ENOMEM;
+	}
+	if (up->ext[grp][sub])
+		return -EEXIST;
+	up->ext[grp][sub] = handler;
+	up->handler[grp] = _urpc_ext_dispatch;
+	dprintf("registered handler for extended cmd=%d\n", cmd);
+	return cmd;
+}
+
+/*
+  Register a RPC handler. Commands above URPC_MAX_HANDLERS are extended
+  commands built with URPC_EXT_CMD(), their group ID can not be used as
+  plain command.
 
   Returns cmd ID if successful, a negative number if not.
 */
 int urpc_register_handler(urpc_peer_t *up, int cmd, urpc_handler_func handler)
 {
-	if (cmd <= 0 || cmd > URPC_MAX_HANDLERS)
+	if (cmd <= 0 || cmd > URPC_MAX_EXT_CMD)
 		return -EINVAL;
-	if (up->handler[cmd])
+	if (cmd > URPC_MAX_HANDLERS)
+		return _urpc_register_ext_handler(up, cmd, handler);
+	if (up->handler[cmd] || (up->batch && up->batch[cmd]))
 		return -EEXIST;
 	up->handler[cmd] = handler;
         dprintf("registered handler for cmd=%d\n", cmd);
@@ -322,14 +497,621 @@ int urpc_register_handler(urpc_peer_t *up, int cmd, urpc_handler_func handler)
 */
 int urpc_unregister_handler(urpc_peer_t *up, int cmd)
 {
-	if (cmd <= 0 || cmd > URPC_MAX_HANDLERS)
+	if (cmd <= 0 || cmd > URPC_MAX_EXT_CMD)
 		return -EINVAL;
+	if (cmd > URPC_MAX_HANDLERS) {
+		int grp = URPC_EXT_GROUP(cmd);
+		if (up->ext && up->ext[grp])
+			up->ext[grp][URPC_EXT_SUB(cmd)] = NULL;
+		return 0;
+	}
 	up->handler[cmd] = NULL;
+	if (up->batch)
+		up->batch[cmd] = NULL;
 	return 0;
 }
 
+/*
+  Register a batch handler. The progress loops pass runs of up to
+  URPC_BATCH_MAX consecutive commands with ID cmd to one call of the
+  handler and complete them together. Extended commands are not supported.
+
+  Returns cmd ID if successful, a negative number if not.
+*/
+int urpc_register_batch_handler(urpc_peer_t *up, int cmd, urpc_batch_handler_func handler)
+{
+	if (cmd <= 0 || cmd > URPC_MAX_HANDLERS)
+		return -EINVAL;
+	if (up->handler[cmd] || (up->batch && up->batch[cmd]))
+		return -EEXIST;
+	if (up->batch == NULL) {
+		up->batch = (urpc_batch_handler_func *)
+			calloc(URPC_MAX_HANDLERS + 1, sizeof(urpc_batch_handler_func));
+		if (up->batch == NULL)
+			return -ENOMEM;
+	}
+	up->batch[cmd] = handler;
+	dprintf("registered batch handler for cmd=%d\n", cmd);
+	return cmd;
+}
+
+/*
+  Collect the run of commands with the ID of m0 (already taken from the
+  queue as req0), at most max, and pass them to the batch handler.
+
+  Returns the number of commands handled, their payload size in *bytes.
+*/
+int urpc_batch_dispatch(urpc_peer_t *up, urpc_mb_t *m0, int64_t req0, int max,
+			size_t *bytes)
+{
+	transfer_queue_t *tq = up->recv.tq;
+	urpc_mb_t m[URPC_BATCH_MAX];
+	int64_t req[URPC_BATCH_MAX];
+	void *payload[URPC_BATCH_MAX];
+	size_t plen[URPC_BATCH_MAX];
+	int cmd = m0->c.cmd, n = 1, err;
+
+	if (max > URPC_BATCH_MAX)
+		max = URPC_BATCH_MAX;
+	m[0] = *m0;
+	req[0] = req0;
+
+	// take the whole run from the queue with one update of last_get_req
+	int64_t last_put = TQ_READ64(tq->last_put_req);
+	TQ_FENCE();
+	while (n < max && req[n - 1] < last_put) {
+		m[n].u64 = TQ_READ64(tq->mb[REQ2SLOT(req[n - 1] + 1)].u64);
+		if (m[n].c.cmd != cmd)
+			break;
+		req[n] = req[n - 1] + 1;
+		URPC_TRACE(up->trace, URPC_EV_GET, cmd, req[n], m[n].c.len);
+		n++;
+	}
+	if (n > 1) {
+		TQ_WRITE64(tq->last_get_req, req[n - 1]);
+		TQ_FENCE();
+	}
+
+	*bytes = 0;
+	if (set_recv_payload_batch(&up->recv, m, n, payload, plen) == 0) {
+		URPC_TRACE(up->trace, URPC_EV_PAYLOAD, cmd, req[0], plen[0]);
+		URPC_TRACE(up->trace, URPC_EV_HANDLER_BEGIN, cmd, req[0], n);
+		err = up->batch[cmd](up, n, m, req, payload, plen);
+		URPC_TRACE(up->trace, URPC_EV_HANDLER_END, cmd, req[0], err);
+		if (err)
+			eprintf("Warning: RPC batch handler %d returned %d\n", cmd, err);
+		for (int i = 0; i < n; i++)
+			*bytes += plen[i];
+	}
+
+	// complete all slots of the batch
+	TQ_FENCE();
+	for (int i = 0; i < n; i++) {
+		URPC_TRACE(up->trace, URPC_EV_SLOT_DONE, cmd, req[i], 0);
+		m[i].c.cmd = URPC_CMD_NONE;
+		TQ_WRITE64(tq->mb[REQ2SLOT(req[i])].u64, m[i].u64);
+	}
+	TQ_FENCE();
+	return n;
+}
+
+/*
+  Free the sub-command and batch handler tables of a peer.
+*/
+void urpc_handlers_fini(urpc_peer_t *up)
+{
+	free(up->batch);
+	up->batch = NULL;
+	if (up->ext == NULL)
+		return;
+	for (int i = 0; i <= URPC_MAX_HANDLERS; i++)
+		free(up->ext[i]);
+	free(up->ext);
+	up->ext = NULL;
+}
+
 /////////////////
 
+/*
+  Allocate a payload buffer of 'size' bytes in the send communicator.
+  The offs and len fields of 'mb' are filled in.
+
+  Returns a pointer to the payload buffer which must be filled by the caller
+  (on the VE this is inside the mirror buffer), NULL if allocation failed.
+ */
+void *urpc_alloc_send_payload(urpc_comm_t *uc, size_t size, urpc_mb_t *mb)
+{
+	if (size >= URPC_MAX_PAYLOAD) {
+		eprintf("payload size %lu exceeds maximum %d\n", size, URPC_MAX_PAYLOAD - 1);
+		mb->u64 = 0;
+		return NULL;
+	}
+	mb->u64 = alloc_payload(uc, (uint32_t)size);
+	if (mb->u64 == 0) {
+		dprintf("urpc_alloc_payload failed!\n");
+		return NULL;
+	}
+#ifdef __ve__
+	return (void *)((char *)uc->mirr_data_buff + MB_OFFS(mb));
+#else
+	return (void *)((char *)&uc->tq->data[0] + MB_OFFS(mb));
+#endif
+}
+
+/*
+  Submit a command whose payload was allocated with urpc_alloc_send_payload()
+  and filled with 'len' bytes. On the VE the payload is transfered from the
+  mirror buffer into the shm segment first.
+
+  Returns the request ID or a negative error.
+ */
+int64_t urpc_submit_send(urpc_peer_t *up, urpc_mb_t *mb, size_t len)
+{
+#ifdef __ve__
+	urpc_comm_t *uc = &up->send;
+	int rc;
+
+	if (len) {
+		rc = ve_transfer_data_sync(uc->shm_data_vehva + MB_OFFS(mb),
+					   uc->mirr_data_vehva + MB_OFFS(mb),
+					   (size_t)ALIGN4B(len));
+		if (rc) {
+			eprintf("[VE ERROR] ve_dma_post_wait send failed: %x\n", rc);
+			return -EIO;
+		}
+	}
+#endif
+	// send command
+	return urpc_put_cmd(up, mb);
+}
+
+/*
+  Send a command whose payload is gathered from several user buffers. The
+  receiver gets the concatenated content as payload.
+
+  On the VE the buffers are copied into the mirror buffer and the DMA into
+  the shm segment is posted chunk-wise while copying goes on, so copy and
+  transfer overlap.
+
+  Returns the request ID or a negative error.
+ */
+int64_t urpc_sendv(urpc_peer_t *up, int cmd, const struct iovec *iov, int n)
+{
+	urpc_comm_t *uc = &up->send;
+	urpc_mb_t mb = { .u64 = 0 };
+	size_t size = 0;
+	char *pp, *payload;
+
+	for (int i = 0; i < n; i++)
+		size += iov[i].iov_len;
+	size += _urpc_ext_hdr_size(cmd);
+	if (size == 0) {
+		mb.c.cmd = cmd;
+		return urpc_submit_send(up, &mb, 0);
+	}
+	payload = urpc_alloc_send_payload(uc, ALIGN8B(size), &mb);
+	if (payload == NULL)
+		return -EAGAIN;
+	mb.c.len = size;
+	pp = _urpc_ext_hdr_put(payload, cmd, &mb);
+
+#ifdef __ve__
+	ve_dma_handle_t dh[URPC_SENDV_MAX_DMA];
+	int nposted = 0, ndone = 0, rc = 0;
+	size_t posted = 0;	// bytes handed to DMA so far
+
+	for (int i = 0; i <= n; i++) {
+		size_t chunk;
+
+		if (i < n) {
+			memcpy(pp, iov[i].iov_base, iov[i].iov_len);
+			pp += iov[i].iov_len;
+			// DMA only 8 byte aligned chunks until the end
+			chunk = ((pp - payload) & ~7UL) - posted;
+			if (chunk < URPC_SENDV_DMA_CHUNK)
+				continue;
+		} else {
+			chunk = ALIGN4B(pp - payload) - posted;
+			if (chunk == 0)
+				break;
+		}
+		// wait for the oldest DMA when all handles are busy
+		if (nposted - ndone == URPC_SENDV_MAX_DMA) {
+			while ((rc = ve_dma_poll(&dh[ndone % URPC_SENDV_MAX_DMA])) == -EAGAIN);
+			if (rc)
+				break;
+			ndone++;
+		}
+		rc = ve_dma_post(uc->shm_data_vehva + MB_OFFS(&mb) + posted,
+				 uc->mirr_data_vehva + MB_OFFS(&mb) + posted,
+				 (int)chunk, &dh[nposted % URPC_SENDV_MAX_DMA]);
+		if (rc)
+			break;
+		nposted++;
+		posted += chunk;
+	}
+	for (; ndone < nposted; ndone++) {
+		int err;
+		while ((err = ve_dma_poll(&dh[ndone % URPC_SENDV_MAX_DMA])) == -EAGAIN);
+		if (err && !rc)
+			rc = err;
+	}
+	if (rc) {
+		eprintf("[VE ERROR] urpc_sendv DMA failed: %x\n", rc);
+		return -EIO;
+	}
+	return urpc_put_cmd(up, &mb);
+#else
+	for (int i = 0; i < n; i++) {
+		urpc_memcpy(pp, iov[i].iov_base, iov[i].iov_len);
+		pp += iov[i].iov_len;
+	}
+	return urpc_submit_send(up, &mb, size);
+#endif
+}
+
+/*
+  Pack format elements:
+
+  'I' : unsigned 32 bit integer
+  'L' : unsigned 64 bit integer
+  'F' : float, 32 bit
+  'D' : double, 64 bit
+  'B' : unsigned 8 bit integer, occupies a 32 bit slot
+  'x' : 32 bit padding
+  'P' : buffer with content, 64 bit length followed by the content
+  'Q' : buffer without content, 64 bit length followed by uninitialized space
+  'S' : NUL-terminated string, 64 bit length (including the NUL) and content
+  'A' : counted array, followed by the element type 'I', 'L', 'F', 'D' or 'B'.
+        64 bit element count followed by the elements
+  'V' : scatter-gather list, 64 bit length followed by the gathered content
+
+  The elements after the 64 bit length field of a buffer-like element
+  ('P', 'Q', 'S', 'A', 'V') are called variable, their offsets depend on
+  the buffer size.
+ */
+static inline int _fmt_is_var(char t)
+{
+	return t == 'P' || t == 'Q' || t == 'S' || t == 'A' || t == 'V';
+}
+
+static inline int _fmt_elem_size(char t)
+{
+	switch (t) {
+	case 'B': return 1;
+	case 'I': case 'F': return 4;
+	case 'L': case 'D': return 8;
+	}
+	return 0;
+}
+
+#define URPC_FMT_SIZE(n) (sizeof(urpc_fmt_t) + (n) * sizeof(struct urpc_fmt_elem))
+
+/*
+  Compile format string into descriptor 'f' which has room for 'maxargs'
+  elements. With 'strict' unset illegal characters are reported and
+  skipped, as urpc_generic_send() always did.
+
+  Returns 0 if all went well, -EINVAL otherwise.
+ */
+static int _fmt_compile(urpc_fmt_t *f, const char *fmt, int strict, int maxargs)
+{
+	uint32_t offs = 0;
+	int n = 0;
+
+	f->nfixed = -1;
+	for (const char *p = fmt; *p != '\0'; p++) {
+		char t = *p;
+		int esize = 0;
+
+		switch (t) {
+		case 'I': case 'F': case 'B': case 'x':
+		case 'L': case 'D':
+		case 'P': case 'Q': case 'S': case 'V':
+			break;
+		case 'A':
+			esize = _fmt_elem_size(p[1]);
+			if (esize) {
+				p++;
+				break;
+			}
+			// fall through
+		default:
+			eprintf("ERROR: illegal pack type in '%s'!\n", fmt);
+			if (strict)
+				return -EINVAL;
+			continue;
+		}
+		if (n == maxargs) {
+			eprintf("too many pack elements in '%s'!\n", fmt);
+			return -EINVAL;
+		}
+		f->e[n].type = t;
+		f->e[n].esize = esize;
+		f->e[n].offs = offs;
+		if (t == 'L' || t == 'D' || _fmt_is_var(t))
+			offs += 8;
+		else
+			offs += 4;
+		// offsets after the first buffer depend on its size
+		if (_fmt_is_var(t) && f->nfixed < 0)
+			f->nfixed = n + 1;
+		n++;
+	}
+	f->nargs = n;
+	f->fixed_size = offs;
+	if (f->nfixed < 0)
+		f->nfixed = n;
+	return 0;
+}
+
+/*
+  Compile a pack format string into a descriptor which can be used with
+  urpc_send_fmt() and urpc_unpack_fmt(). The format characters are the same
+  as for urpc_generic_send(). Commands which always use the same format save
+  the parsing of the string on each call.
+
+  Returns the descriptor, or NULL if the format is invalid. Free it with
+  urpc_fmt_free().
+ */
+urpc_fmt_t *urpc_fmt_compile(const char *fmt)
+{
+	// a format has at most as many elements as characters
+	size_t len = strlen(fmt);
+	int maxargs = len < URPC_FMT_MAX_ARGS ? (int)len : URPC_FMT_MAX_ARGS;
+	urpc_fmt_t *f = (urpc_fmt_t *)malloc(URPC_FMT_SIZE(maxargs));
+	if (f == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(f, 0, URPC_FMT_SIZE(maxargs));
+	if (_fmt_compile(f, fmt, 1, maxargs) < 0) {
+		free(f);
+		errno = EINVAL;
+		return NULL;
+	}
+	return f;
+}
+
+void urpc_fmt_free(urpc_fmt_t *f)
+{
+	free(f);
+}
+
+/*
+  Descriptor for the string functions, which accept formats of any length.
+  It is compiled into 'buf' (room for URPC_FMT_MAX_ARGS elements) or, for
+  longer formats, allocated. Release it with _fmt_string_free().
+ */
+static urpc_fmt_t *_fmt_string(const char *fmt, void *buf)
+{
+	size_t len = strlen(fmt);
+	urpc_fmt_t *f = (urpc_fmt_t *)buf;
+
+	if (len > URPC_FMT_MAX_ARGS) {
+		f = (urpc_fmt_t *)malloc(URPC_FMT_SIZE(len));
+		if (f == NULL)
+			return NULL;
+	}
+	_fmt_compile(f, fmt, 0, len > URPC_FMT_MAX_ARGS ? (int)len : URPC_FMT_MAX_ARGS);
+	return f;
+}
+
+static void _fmt_string_free(urpc_fmt_t *f, void *buf)
+{
+	if (f != (urpc_fmt_t *)buf)
+		free(f);
+}
+
+#define URPC_FMT_STACK_WORDS ((URPC_FMT_SIZE(URPC_FMT_MAX_ARGS) + 7) / 8)
+
+/*
+  Pack the payload described by 'f' from the variadic arguments and send it.
+  The arguments are walked only once.
+ */
+static int64_t _send_fmt_v(urpc_peer_t *up, int cmd, urpc_fmt_t *f, va_list ap)
+{
+	urpc_comm_t *uc = &up->send;
+	urpc_mb_t mb = { .u64 = 0 };
+	struct {
+		uint64_t val;		// scalar value or length field
+		uint64_t clen;		// content length of variable elements
+		const void *ptr;
+		int cnt;
+	} stack_args[URPC_FMT_MAX_ARGS], *a = stack_args;
+	size_t size = f->fixed_size;
+	char *pp, *base, *payload = NULL;
+	int64_t req;
+	int i;
+
+	if (f->nargs > URPC_FMT_MAX_ARGS) {
+		a = malloc(f->nargs * sizeof(stack_args[0]));
+		if (a == NULL)
+			return -ENOMEM;
+	}
+
+	for (i = 0; i < f->nargs; i++) {
+		a[i].clen = 0;
+		switch (f->e[i].type) {
+		case 'I':
+			a[i].val = va_arg(ap, uint32_t);
+			break;
+		case 'B':
+			a[i].val = (uint8_t)va_arg(ap, int);
+			break;
+		case 'L':
+			a[i].val = va_arg(ap, uint64_t);
+			break;
+		case 'F': {
+			float fv = (float)va_arg(ap, double);
+			uint32_t u;
+			memcpy(&u, &fv, 4);
+			a[i].val = u;
+			break;
+		}
+		case 'D': {
+			double dv = va_arg(ap, double);
+			memcpy(&a[i].val, &dv, 8);
+			break;
+		}
+		case 'P':
+			a[i].ptr = va_arg(ap, void *);
+			a[i].val = a[i].clen = va_arg(ap, size_t);
+			break;
+		case 'Q':
+			a[i].ptr = va_arg(ap, void *);
+			a[i].val = va_arg(ap, size_t);
+			size += a[i].val;	// space only, no content
+			break;
+		case 'S':
+			a[i].ptr = va_arg(ap, char *);
+			a[i].val = a[i].clen = strlen((const char *)a[i].ptr) + 1;
+			break;
+		case 'A':
+			a[i].ptr = va_arg(ap, void *);
+			a[i].val = va_arg(ap, size_t);
+			a[i].clen = a[i].val * f->e[i].esize;
+			break;
+		case 'V': {
+			const struct iovec *iov = va_arg(ap, const struct iovec *);
+			a[i].ptr = iov;
+			a[i].cnt = va_arg(ap, int);
+			for (int k = 0; k < a[i].cnt; k++)
+				a[i].clen += iov[k].iov_len;
+			a[i].val = a[i].clen;
+			break;
+		}
+		}
+		size += a[i].clen;
+	}
+	size = ALIGN8B(size);
+	size_t hsz = _urpc_ext_hdr_size(cmd);
+	if (size + hsz == 0) {
+		mb.c.cmd = cmd;
+		req = urpc_submit_send(up, &mb, 0);
+		goto out;
+	}
+
+	base = urpc_alloc_send_payload(uc, hsz + size, &mb);
+	if (base == NULL) {
+		req = -EAGAIN;
+		goto out;
+	}
+
+	pp = payload = _urpc_ext_hdr_put(base, cmd, &mb);
+	for (i = 0; i < f->nargs; i++) {
+		// elements with known offsets
+		if (i < f->nfixed)
+			pp = payload + f->e[i].offs;
+		switch (f->e[i].type) {
+		case 'I':
+		case 'F':
+			*((uint32_t *)pp) = (uint32_t)a[i].val;
+			pp += 4;
+			break;
+		case 'B':
+			*((uint32_t *)pp) = 0;
+			*((uint8_t *)pp) = (uint8_t)a[i].val;
+			pp += 4;
+			break;
+		case 'x':
+			pp += 4;
+			break;
+		case 'L':
+		case 'D':
+		case 'Q':
+			*((uint64_t *)pp) = a[i].val;
+			pp += 8;
+			break;
+		case 'P':
+		case 'S':
+		case 'A':
+			*((uint64_t *)pp) = a[i].val;
+			pp += 8;
+			if (a[i].clen)
+				urpc_memcpy(pp, a[i].ptr, a[i].clen);
+			pp += a[i].clen;
+			break;
+		case 'V': {
+			const struct iovec *iov = (const struct iovec *)a[i].ptr;
+			*((uint64_t *)pp) = a[i].val;
+			pp += 8;
+			for (int k = 0; k < a[i].cnt; k++) {
+				urpc_memcpy(pp, iov[k].iov_base, iov[k].iov_len);
+				pp += iov[k].iov_len;
+			}
+			break;
+		}
+		}
+	}
+	req = urpc_submit_send(up, &mb, (size_t)(pp - base));
+out:
+	if (a != stack_args)
+		free(a);
+	return req;
+}
+
+/*
+  Unpack the payload described by 'f' into the variadic arguments.
+
+  Returns 0 if all went well, -1 if we ran out of the payload buffer.
+ */
+static int _unpack_fmt_v(void *payload, size_t psz, urpc_fmt_t *f, va_list ap)
+{
+	char *pp = (char *)payload;
+	long lsz = (long)psz;
+	void **dummyp;
+	size_t *dummys;
+
+	for (int i = 0; i < f->nargs && lsz >= 0; i++) {
+		if (i < f->nfixed)
+			pp = (char *)payload + f->e[i].offs;
+		switch (f->e[i].type) {
+		case 'I':
+		case 'F':
+			memcpy(va_arg(ap, uint32_t *), pp, 4);
+			pp += 4;
+			break;
+		case 'B':
+			*va_arg(ap, uint8_t *) = *((uint8_t *)pp);
+			pp += 4;
+			break;
+		case 'x':
+			pp += 4;
+			break;
+		case 'L':
+		case 'D':
+			memcpy(va_arg(ap, uint64_t *), pp, 8);
+			pp += 8;
+			break;
+		case 'S':
+			*va_arg(ap, char **) = pp + 8;
+			pp += 8 + *((uint64_t *)pp);
+			break;
+		case 'A':
+			dummyp = va_arg(ap, void **);
+			dummys = va_arg(ap, size_t *);
+			*dummys = (size_t) *((uint64_t *)pp);
+			pp += 8;
+			*dummyp = (void *)pp;
+			pp += *dummys * f->e[i].esize;
+			break;
+		case 'P':
+		case 'Q':
+		case 'V':
+			dummyp = va_arg(ap, void **);
+			dummys = va_arg(ap, size_t *);
+			*dummys = (size_t) *((uint64_t *)pp);
+			pp += 8;
+			*dummyp = (void *)pp;
+			pp += *dummys;
+			break;
+		}
+		lsz = (long)psz - (pp - (char *)payload);
+	}
+	return lsz < 0 ? -1 : 0;
+}
+
 /*
   Generic send command which:
   - computes the payload size
@@ -340,6 +1122,9 @@ int urpc_unregister_handler(urpc_peer_t *up, int cmd)
   It can contain following characters:
   'I' : expect an unsigned 32 bit integer
   'L' : expect an unsigned 64 bit integer
+  'F' : expect a float (passed as double, as all variadic floats)
+  'D' : expect a double
+  'B' : expect an unsigned 8 bit integer, it occupies 32 bits in the payload
   'x' : 32 bit padding (no argument expected)
   'P' : a buffer pointer, expects a "void *" and a "size_t" for the buffer size.
         The buffer size is packed as uint64_t into the payload and is followed by
@@ -350,6 +1135,13 @@ int urpc_unregister_handler(urpc_peer_t *up, int cmd)
         The buffer size is packed as uint64_t into the payload. The allocated
         space is not used by other transfers until the current req is marked done.
         This argument must be the last one in the list and show up only once!
+  'S' : a NUL-terminated string, expects a "char *". Packed like a 'P' buffer
+        whose size includes the terminating NUL.
+  'A' : a counted array, must be followed by the element type 'I', 'L', 'F',
+        'D' or 'B' (e.g. "AD"). Expects a pointer to the elements and a "size_t"
+        element count. The count is packed as uint64_t followed by the elements.
+  'V' : a scatter-gather list, expects a "const struct iovec *" and an "int"
+        count. Packed like a 'P' buffer containing the gathered content.
   64 bit values and the buffer should better start at an 8 byte boundary, so use
   padding in the fmt string to achieve that. The payload length will also be
   filled to the next 8 byte boundary, such that the next payload is again 8b aligned.
@@ -358,130 +1150,17 @@ int urpc_unregister_handler(urpc_peer_t *up, int cmd)
  */
 int64_t urpc_generic_send(urpc_peer_t *up, int cmd, char *fmt, ...)
 {
-	int rc;
-	char *p, *pp, *payload;
-	urpc_comm_t *uc = &up->send;
-	transfer_queue_t *tq = uc->tq;
-	urpc_mb_t mb = { .u64 = 0 };
-        int64_t req;
-
-        // protect from others messing with the mailboxes
-        //pthread_mutex_lock(&uc->lock);
-	va_list ap1, ap2;
-	va_start(ap1, fmt);
-	va_copy(ap2, ap1);
-
-	// estimate size of payload
-	uint32_t dummy32;
-	uint64_t dummy64;
-	void *dummyp;
-	size_t dummys;
-	size_t size = 0;
-	for (p = fmt; *p != '\0'; p++) {
-		switch (*p) {
-		case 'I': // 32 bit value
-			size += 4;
-			dummy32 = va_arg(ap1, uint32_t);
-			break;
-		case 'L': // 64 bit value
-			size += 8;
-			dummy64 = va_arg(ap1, uint64_t);
-			break;
-		case 'P': // 64 bit value
-			size += 8;
-			dummyp = va_arg(ap1, void *);
-			dummys = va_arg(ap1, size_t);
-			size += dummys;
-			break;
-		case 'Q': // 64 bit value
-			size += 8;
-			dummyp = va_arg(ap1, void *);
-			dummys = va_arg(ap1, size_t);
-			size += dummys;
-			break;
-		case 'x': // 32 bit padding
-			size += 4;
-			break;
-		default:
-			eprintf("ERROR: illegal pack type in '%s'!\n", fmt);
-			break;
-		}
-	}
-	size = ALIGN8B(size);
-	va_end(ap1);
-        dprintf("generic_send allocating %ld bytes payload\n", size);
-	if (size) {
-#ifdef __ve__
-		//dhq_state(up);
-#endif
-		// allocate payload on data buffer
-		mb.u64 = alloc_payload(uc, (uint32_t)size);
-		if (mb.u64 == 0) {
-			dprintf("generic_send: failed to allocate payload\n");
-			dprintf("urpc_alloc_payload failed!\n");
-                        //pthread_mutex_unlock(&uc->lock);
-			return -EAGAIN;
-		}
-
-		// fill payload buffer
-#ifdef __ve__
-		payload = (void *)((char *)uc->mirr_data_buff + mb.c.offs);
-#else
-		payload = (void *)((char *)&tq->data[0] + mb.c.offs);
-#endif
-		pp = payload;
-		for (p = fmt; *p != '\0'; p++) {
-			switch (*p) {
-			case 'I': // 32 bit value
-				*((uint32_t *)pp) = va_arg(ap2, uint32_t);
-				pp += 4;
-				break;
-			case 'L': // 64 bit value
-				*((uint64_t *)pp) = va_arg(ap2, uint64_t);
-				pp += 8;
-				break;
-			case 'P': // 64 bit value
-				dummyp = va_arg(ap2, void *);
-				dummys = va_arg(ap2, size_t);
-				*((uint64_t *)pp) = dummys;
-				pp += 8;
-                                if (dummys)
-					memcpy((void *)pp, dummyp, (size_t)dummys);
-				pp += dummys;
-				break;
-			case 'Q': // 64 bit value
-				dummyp = va_arg(ap2, void *);
-				dummys = va_arg(ap2, size_t);
-				*((uint64_t *)pp) = dummys;
-				pp += 8;
-				break;
-			case 'x': // 32 bit padding
-				pp += 4;
-				break;
-			default:
-				eprintf("ERROR: illegal pack type in '%s'!\n", fmt);
-				break;
-			}
-		}
-
-	}
-	va_end(ap2);
-	mb.c.cmd = cmd;
+	uint64_t buf[URPC_FMT_STACK_WORDS];
+	int64_t req;
 
-#ifdef __ve__
-       if (size) {
-               rc = ve_transfer_data_sync(uc->shm_data_vehva + mb.c.offs,
-                                          uc->mirr_data_vehva + mb.c.offs,
-                                          (size_t)ALIGN4B(pp - payload));
-               if (rc) {
-                       eprintf("[VE ERROR] ve_dma_post_wait send failed: %x\n", rc);
-                        //pthread_mutex_unlock(&uc->lock);
-                       return -EIO;
-               }
-       }
-#endif 
-       // send command
-        req = urpc_put_cmd(up, &mb);
+	urpc_fmt_t *f = _fmt_string(fmt, buf);
+	if (f == NULL)
+		return -ENOMEM;
+	va_list ap;
+	va_start(ap, fmt);
+	req = _send_fmt_v(up, cmd, f, ap);
+	va_end(ap);
+	_fmt_string_free(f, buf);
 	return req;
 }
 
@@ -497,6 +1176,9 @@ int64_t urpc_generic_send(urpc_peer_t *up, int cmd, char *fmt, ...)
   The fmt string can contain following characters:
   'I' : expect an unsigned 32 bit integer. Corresponds to a "uint32_t *" in the args.
   'L' : expect an unsigned 64 bit integer. Corresponds to a "uint64_t *" in the args.
+  'F' : expect a float. Corresponds to a "float *" in the args.
+  'D' : expect a double. Corresponds to a "double *" in the args.
+  'B' : expect an unsigned 8 bit integer. Corresponds to a "uint8_t *" in the args.
   'x' : 32 bit padding (no argument expected). Nothing in the arguments.
   'P' : a buffer pointer, expects a "void *" and a "size_t" for the buffer size.
         The buffer size is packed as uint64_t into the payload and is followed by
@@ -507,6 +1189,12 @@ int64_t urpc_generic_send(urpc_peer_t *up, int cmd, char *fmt, ...)
         The buffer size is packed as uint64_t into the payload. The allocated
         space is not used by other transfers until the current req is marked done.
         This argument must be the last one in the list and show up only once!
+  'S' : a string. Corresponds to a "char **" which points to the string inside
+        the payload.
+  'A' : a counted array followed by its element type. Corresponds to a "void **"
+        pointing to the elements inside the payload and a "size_t *" for the count.
+  'V' : gathered content of a scatter-gather list. Corresponds to a "void **" and
+        a "size_t *", like 'P'.
   64 bit values and the buffer should better start at an 8 byte boundary, so use
   padding in the fmt string to achieve that. The payload length will also be
   filled to the next 8 byte boundary, such that the next payload is again 8b aligned.
@@ -515,64 +1203,50 @@ int64_t urpc_generic_send(urpc_peer_t *up, int cmd, char *fmt, ...)
  */
 int urpc_unpack_payload(void *payload, size_t psz, char *fmt, ...)
 {
-	int rc = 0;
-	char *p;
-	char *pp = (char *)payload;
-	long lsz = (long)psz;
+	uint64_t buf[URPC_FMT_STACK_WORDS];
+	int rc;
 
+	urpc_fmt_t *f = _fmt_string(fmt, buf);
+	if (f == NULL)
+		return -1;
 	va_list ap;
 	va_start(ap, fmt);
+	rc = _unpack_fmt_v(payload, psz, f, ap);
+	va_end(ap);
+	_fmt_string_free(f, buf);
+	return rc;
+}
 
-	// estimate size of payload
-	uint32_t *dummy32;
-	uint64_t *dummy64;
-	void **dummyp;
-	size_t *dummys;
-	for (p = fmt; *p != '\0' && lsz >= 0; p++) {
-		switch (*p) {
-		case 'I': // 32 bit value
-			dummy32 = va_arg(ap, uint32_t *);
-			*dummy32 = *((uint32_t *)pp);
-			pp += 4;
-                        lsz -= 4;
-			break;
-		case 'L': // 64 bit value
-			dummy64 = va_arg(ap, uint64_t *);
-			*dummy64 = *((uint64_t *)pp);
-			pp += 8;
-                        lsz -= 8;
-			break;
-		case 'P': // 64 bit value
-			dummyp = va_arg(ap, void **);
-			dummys = va_arg(ap, size_t *);
-			*dummys = (size_t) *((uint64_t *)pp);
-			pp += 8;
-                        lsz -= 8;
-			*dummyp = (void *)pp;
-			pp += *dummys;
-                        lsz -= *dummys;
-			break;
-		case 'Q': // 64 bit value
-			dummyp = va_arg(ap, void **);
-			dummys = va_arg(ap, size_t *);
-			*dummys = (size_t) *((uint64_t *)pp);
-			pp += 8;
-                        lsz -= 8;
-			*dummyp = (void *)pp;
-			pp += *dummys;
-                        lsz -= *dummys;
-			break;
-		case 'x': // 32 bit padding
-			pp += 4;
-                        lsz -= 4;
-			break;
-		default:
-			eprintf("ERROR: illegal pack type in '%s'!\n", fmt);
-			break;
-		}
-	}
-	if (lsz < 0)
-		rc = -1;
+/*
+  Send command with payload described by a pre-compiled format descriptor.
+  The variadic arguments are the same as for urpc_generic_send().
+
+  Returns the request ID or a negative error.
+ */
+int64_t urpc_send_fmt(urpc_peer_t *up, int cmd, urpc_fmt_t *f, ...)
+{
+	int64_t req;
+
+	va_list ap;
+	va_start(ap, f);
+	req = _send_fmt_v(up, cmd, f, ap);
+	va_end(ap);
+	return req;
+}
+
+/*
+  Unpack payload according to a pre-compiled format descriptor. This is the
+  counterpart of urpc_send_fmt(), arguments are as for urpc_unpack_payload().
+
+  Returns 0 if all went well, -1 if we ran out of the payload buffer.
+ */
+int urpc_unpack_fmt(void *payload, size_t psz, urpc_fmt_t *f, ...)
+{
+	int rc;
+
+	va_list ap;
+	va_start(ap, f);
+	rc = _unpack_fmt_v(payload, psz, f, ap);
 	va_end(ap);
 	return rc;
 }
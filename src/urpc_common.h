@@ -24,6 +24,7 @@
 
 #include "urpc.h"
 #include "urpc_debug.h"
+#include "urpc_time.h"
 #ifdef __ve__
 #include <vedma.h>
 //#include "dma_handler.h"
@@ -55,6 +56,237 @@
 # define TQ_FENCE_S()
 #endif
 
+/*
+  Handler statistics hooks in the progress loops. A command is accounted
+  from taking it out of the mailbox until its handler returned, i.e.
+  including the payload transfer. The end time of a command is the start time of the
+  next one, so the clock is read only once per command.
+  Build with -DURPC_NO_STATS to compile them out.
+ */
+#ifndef URPC_NO_STATS
+/*
+  Statistics can be disabled from another thread, the hooks load the
+  pointer once. The memory stays valid until the peer is destroyed.
+ */
+static inline urpc_cmd_stats_t *_urpc_stats_ptr(urpc_peer_t *up)
+{
+	return __atomic_load_n(&up->stats, __ATOMIC_ACQUIRE);
+}
+
+static inline urpc_poll_stats_t *_urpc_poll_ptr(urpc_peer_t *up)
+{
+	return __atomic_load_n(&up->poll, __ATOMIC_ACQUIRE);
+}
+
+static inline uint64_t _urpc_stats_account(urpc_cmd_stats_t *s, int n, size_t bytes,
+					   uint64_t t0)
+{
+	uint64_t now = get_cycles();
+	uint64_t cyc = now - t0;
+	uint64_t per = cyc / n;
+	int b = per ? 63 - __builtin_clzl(per) : 0;
+
+	s->calls += n;
+	s->bytes += bytes;
+	s->cycles += cyc;
+	s->hist[b < URPC_STATS_BUCKETS ? b : URPC_STATS_BUCKETS - 1] += n;
+	return now;
+}
+# define URPC_STATS_DECL(t0) uint64_t t0 = 0
+# define URPC_STATS_START(up, t0)					\
+	do {								\
+		if (t0 == 0 && _urpc_stats_ptr(up))			\
+			t0 = get_cycles();				\
+	} while (0)
+# define URPC_STATS_END(up, cmd, plen, t0) URPC_STATS_END_N(up, cmd, 1, plen, t0)
+/* batches are accounted with their mean time per command */
+# define URPC_STATS_END_N(up, cmd, n, bytes, t0)			\
+	do {								\
+		urpc_cmd_stats_t *_s = _urpc_stats_ptr(up);		\
+		if (_s && t0)						\
+			t0 = _urpc_stats_account(&_s[cmd], n, bytes, t0); \
+		else							\
+			t0 = 0;						\
+	} while (0)
+#else
+# define URPC_STATS_DECL(t0)
+# define URPC_STATS_START(up, t0)
+# define URPC_STATS_END(up, cmd, plen, t0)
+# define URPC_STATS_END_N(up, cmd, n, bytes, t0)
+#endif
+
+/*
+  Poll statistics hooks, also compiled out by -DURPC_NO_STATS. The
+  progress loops are timed per call, waits for a free send slot only
+  when the slot was busy.
+ */
+#ifndef URPC_NO_STATS
+static inline void _urpc_poll_account(urpc_poll_stats_t *p, int done, uint64_t t)
+{
+	uint64_t cyc = get_cycles() - t;
+
+	p->calls++;
+	if (done)
+		p->busy_cycles += cyc;
+	else {
+		p->empty++;
+		p->empty_cycles += cyc;
+	}
+}
+
+static inline void _urpc_poll_occ(urpc_poll_stats_t *p, transfer_queue_t *tq,
+				  int64_t req)
+{
+	uint64_t occ = TQ_READ64(tq->last_put_req) - req + 1;
+	int b = 63 - __builtin_clzl(occ | 1);
+
+	p->occ_samples++;
+	p->occ_sum += occ;
+	p->occ_hist[b < URPC_POLL_OCC_BUCKETS ? b : URPC_POLL_OCC_BUCKETS - 1]++;
+}
+# define URPC_POLL_DECL(t) uint64_t t = 0
+# define URPC_POLL_START(up, t)						\
+	do {								\
+		t = _urpc_poll_ptr(up) ? get_cycles() : 0;		\
+	} while (0)
+# define URPC_POLL_END(up, done, t)					\
+	do {								\
+		urpc_poll_stats_t *_p = _urpc_poll_ptr(up);		\
+		if (_p && t)						\
+			_urpc_poll_account(_p, done, t);		\
+	} while (0)
+/* sample the ring occupancy with the first command of a progress call */
+# define URPC_POLL_OCC(up, tq, req, done)				\
+	do {								\
+		urpc_poll_stats_t *_p = _urpc_poll_ptr(up);		\
+		if (_p && (done) == 0)					\
+			_urpc_poll_occ(_p, tq, req);			\
+	} while (0)
+#else
+# define URPC_POLL_DECL(t)
+# define URPC_POLL_START(up, t)
+# define URPC_POLL_END(up, done, t)
+# define URPC_POLL_OCC(up, tq, req, done)
+#endif
+
+/*
+  Trace ring. Writers reserve entries with an atomic increment of head,
+  so the send path and the progress loop can trace concurrently.
+  Build with -DURPC_NO_TRACE to compile the trace points out.
+ */
+struct urpc_trace {
+	uint64_t head;			// total number of events recorded
+	uint64_t mask;			// ring size - 1
+	uint64_t ref_cycles;
+	uint64_t ref_us;
+	urpc_trace_ev_t ev[];
+};
+
+#ifndef URPC_NO_TRACE
+static inline void _urpc_trace(urpc_trace_t *t, int type, int cmd, int64_t req,
+			       uint32_t arg)
+{
+	uint64_t i = __atomic_fetch_add(&t->head, 1, __ATOMIC_RELAXED) & t->mask;
+	urpc_trace_ev_t *e = &t->ev[i];
+
+	e->ts = get_cycles();
+	e->req = req;
+	e->type = type;
+	e->cmd = cmd;
+	e->arg = arg;
+}
+# define URPC_TRACE(t, type, cmd, req, arg)				\
+	do {								\
+		if (t)							\
+			_urpc_trace(t, type, cmd, req, arg);		\
+	} while (0)
+#else
+# define URPC_TRACE(t, type, cmd, req, arg)
+#endif
+
+/*
+  Live counters in the segment, see urpc_shm_stats_t. The hot paths only
+  update the local copy in urpc_comm_t.
+ */
+static inline void _urpc_cnt_publish(urpc_comm_t *uc)
+{
+	urpc_shm_cnt_t *s = uc->shm_cnt;
+
+	if (s == NULL)
+		return;
+	if (uc->cnt.msgs != uc->cnt_pub)
+		uc->cnt.last_us = get_time_us();
+	uc->cnt_pub = uc->cnt.msgs;
+	uc->cnt.alloc_fail = uc->alloc_fail;
+	TQ_WRITE64(s->msgs, uc->cnt.msgs);
+	TQ_WRITE64(s->bytes, uc->cnt.bytes);
+	TQ_WRITE64(s->full, uc->cnt.full);
+	TQ_WRITE64(s->spins, uc->cnt.spins);
+	TQ_WRITE64(s->alloc_fail, uc->cnt.alloc_fail);
+	TQ_WRITE64(s->last_us, uc->cnt.last_us);
+}
+
+/*
+  Account a call of the progress loop which did ndone commands. When it
+  found nothing to do, the pending counters of both directions are
+  published.
+ */
+static inline void _urpc_cnt_progress(urpc_peer_t *up, int ndone)
+{
+	urpc_comm_t *uc = &up->recv;
+
+	if (ndone) {
+		uc->cnt.msgs += ndone;
+		if (uc->cnt.msgs - uc->cnt_pub >= URPC_SHM_STATS_EVERY)
+			_urpc_cnt_publish(uc);
+		return;
+	}
+	uc->cnt.spins++;
+	if (uc->cnt.msgs != uc->cnt_pub || up->send.cnt.msgs != up->send.cnt_pub
+	    || (uc->cnt.spins & URPC_SHM_STATS_SPIN_MASK) == 0) {
+		_urpc_cnt_publish(uc);
+		_urpc_cnt_publish(&up->send);
+	}
+}
+
+/*
+  Side of a peer: 0 for the creator of the segment, 1 for the VE or a VH
+  process attached with vh_urpc_peer_attach(). The creator sends on the
+  queue right behind the segment header.
+ */
+static inline int _urpc_peer_side(urpc_peer_t *up)
+{
+#ifdef __ve__
+	return 1;
+#else
+	return (char *)up->send.tq != (char *)up->shm_addr + URPC_SHM_HDR_SIZE;
+#endif
+}
+
+/*
+  Extended commands carry their ID in a header in front of the payload.
+ */
+static inline size_t _urpc_ext_hdr_size(int cmd)
+{
+	return cmd > URPC_MAX_HANDLERS ? sizeof(urpc_ext_hdr_t) : 0;
+}
+
+/*
+  Set the mailbox command and, for extended commands, write the payload
+  header. Returns the start of the user payload.
+ */
+static inline char *_urpc_ext_hdr_put(char *payload, int cmd, urpc_mb_t *mb)
+{
+	if (cmd <= URPC_MAX_HANDLERS) {
+		mb->c.cmd = cmd;
+		return payload;
+	}
+	urpc_ext_hdr_t *h = (urpc_ext_hdr_t *)payload;
+	h->cmd = cmd;
+	h->pad = 0;
+	mb->c.cmd = URPC_EXT_GROUP(cmd);
+	return payload + sizeof(urpc_ext_hdr_t);
+}
 
 #ifdef __cplusplus
 extern "C" {
@@ -66,7 +298,20 @@ int ve_transfer_data_sync(uint64_t dst_vehva, uint64_t src_vehva, int len);
 
 int64_t urpc_get_cmd_timeout(transfer_queue_t *tq, urpc_mb_t *m, long timeout_us);
 void urpc_run_handler_init_hooks(urpc_peer_t *up);
+void urpc_stats_init(urpc_peer_t *up);
+void urpc_stats_fini(urpc_peer_t *up);
+void urpc_poll_stats_init(urpc_peer_t *up);
+void urpc_poll_stats_fini(urpc_peer_t *up);
+void urpc_handlers_fini(urpc_peer_t *up);
+void urpc_trace_init(urpc_peer_t *up);
+void urpc_trace_fini(urpc_peer_t *up);
+int set_recv_payload_batch(urpc_comm_t *uc, urpc_mb_t *m, int n, void **payload,
+			   size_t *plen);
+int urpc_batch_dispatch(urpc_peer_t *up, urpc_mb_t *m0, int64_t req0, int max,
+			size_t *bytes);
 uint64_t alloc_payload(urpc_comm_t *uc, uint32_t size);
+void urpc_shm_stats_init(urpc_peer_t *up, urpc_shm_stats_t *s, int side);
+void urpc_signal_attached(void);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,270 @@
+/**
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *
+ * Payload copy engine with size dispatched strategies.
+ *
+ * Copyright (c) 2020 Erich Focht
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "urpc_common.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+  Payloads are copied into the shared memory data buffer and never read
+  again by the sender. Large copies therefore use non-temporal stores which
+  bypass the caches of the sender. Very large copies can be split across
+  helper threads.
+
+  Tunables (environment, read once):
+  URPC_COPY_NT_THRESHOLD   : use streaming stores from this size on
+                             (default URPC_COPY_NT_DEFAULT, 0 disables)
+  URPC_COPY_THREADS        : number of helper threads (default 0, off)
+  URPC_COPY_PAR_THRESHOLD  : use helper threads from this size on
+                             (default URPC_COPY_PAR_DEFAULT)
+
+  The VE has no non-temporal stores, its libc memcpy is used for all sizes.
+ */
+#define URPC_COPY_NT_DEFAULT  (1024 * 1024)
+#define URPC_COPY_PAR_DEFAULT (16 * 1024 * 1024)
+#define URPC_COPY_MAX_THREADS 16
+
+typedef void (*copy_func_t)(void *, const void *, size_t);
+
+static pthread_once_t _copy_once = PTHREAD_ONCE_INIT;
+static size_t _nt_threshold = URPC_COPY_NT_DEFAULT;
+static size_t _par_threshold = URPC_COPY_PAR_DEFAULT;
+static copy_func_t _nt_copy = NULL;
+static const char *_nt_name = "none";
+
+static void _plain_copy(void *dst, const void *src, size_t n)
+{
+	memcpy(dst, src, n);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void _avx2_nt_copy(void *dst, const void *src, size_t n)
+{
+	char *d = (char *)dst;
+	const char *s = (const char *)src;
+	size_t head = (32 - ((uintptr_t)d & 31)) & 31;
+
+	if (head > n)
+		head = n;
+	memcpy(d, s, head);
+	d += head; s += head; n -= head;
+	for (; n >= 128; n -= 128, d += 128, s += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(s));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+		__m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+		_mm256_stream_si256((__m256i *)(d), a);
+		_mm256_stream_si256((__m256i *)(d + 32), b);
+		_mm256_stream_si256((__m256i *)(d + 64), c);
+		_mm256_stream_si256((__m256i *)(d + 96), e);
+	}
+	_mm_sfence();
+	memcpy(d, s, n);
+}
+
+__attribute__((target("avx512f")))
+static void _avx512_nt_copy(void *dst, const void *src, size_t n)
+{
+	char *d = (char *)dst;
+	const char *s = (const char *)src;
+	size_t head = (64 - ((uintptr_t)d & 63)) & 63;
+
+	if (head > n)
+		head = n;
+	memcpy(d, s, head);
+	d += head; s += head; n -= head;
+	for (; n >= 256; n -= 256, d += 256, s += 256) {
+		__m512i a = _mm512_loadu_si512((const void *)(s));
+		__m512i b = _mm512_loadu_si512((const void *)(s + 64));
+		__m512i c = _mm512_loadu_si512((const void *)(s + 128));
+		__m512i e = _mm512_loadu_si512((const void *)(s + 192));
+		_mm512_stream_si512((void *)(d), a);
+		_mm512_stream_si512((void *)(d + 64), b);
+		_mm512_stream_si512((void *)(d + 128), c);
+		_mm512_stream_si512((void *)(d + 192), e);
+	}
+	_mm_sfence();
+	memcpy(d, s, n);
+}
+#endif
+
+//
+// Helper threads for parallel copies
+//
+static struct {
+	pthread_mutex_t job_lock;	// one parallel copy at a time
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int nthreads;
+	uint64_t gen;
+	char *dst;
+	const char *src;
+	size_t len, part;
+	int pending;
+} _cpool = {
+	.job_lock = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void _copy_part(int idx)
+{
+	size_t begin = idx * _cpool.part;
+	size_t end = begin + _cpool.part;
+
+	if (end > _cpool.len)
+		end = _cpool.len;
+	if (begin < end)
+		(_nt_copy ? _nt_copy : _plain_copy)(_cpool.dst + begin,
+						    _cpool.src + begin, end - begin);
+}
+
+static void *_copy_helper(void *arg)
+{
+	int idx = (int)(intptr_t)arg;
+	uint64_t seen = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&_cpool.lock);
+		while (_cpool.gen == seen)
+			pthread_cond_wait(&_cpool.cond, &_cpool.lock);
+		seen = _cpool.gen;
+		pthread_mutex_unlock(&_cpool.lock);
+		_copy_part(idx);
+		__atomic_sub_fetch(&_cpool.pending, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static void _parallel_copy(void *dst, const void *src, size_t n)
+{
+	pthread_mutex_lock(&_cpool.job_lock);
+	pthread_mutex_lock(&_cpool.lock);
+	_cpool.dst = (char *)dst;
+	_cpool.src = (const char *)src;
+	_cpool.len = n;
+	_cpool.part = ALIGN8B((n + _cpool.nthreads) / (_cpool.nthreads + 1));
+	_cpool.pending = _cpool.nthreads;
+	_cpool.gen++;
+	pthread_cond_broadcast(&_cpool.cond);
+	pthread_mutex_unlock(&_cpool.lock);
+
+	// the caller does the last part
+	_copy_part(_cpool.nthreads);
+	while (__atomic_load_n(&_cpool.pending, __ATOMIC_ACQUIRE) > 0);
+	pthread_mutex_unlock(&_cpool.job_lock);
+}
+
+static size_t _env_size(const char *name, size_t dflt)
+{
+	char *e = getenv(name);
+	return e ? (size_t)strtoull(e, NULL, 0) : dflt;
+}
+
+static void _copy_init(void)
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		_nt_copy = _avx512_nt_copy;
+		_nt_name = "avx512";
+	} else if (__builtin_cpu_supports("avx2")) {
+		_nt_copy = _avx2_nt_copy;
+		_nt_name = "avx2";
+	}
+#endif
+	_nt_threshold = _env_size("URPC_COPY_NT_THRESHOLD", URPC_COPY_NT_DEFAULT);
+	if (_nt_threshold == 0)
+		_nt_copy = NULL;
+	_par_threshold = _env_size("URPC_COPY_PAR_THRESHOLD", URPC_COPY_PAR_DEFAULT);
+	int nthreads = (int)_env_size("URPC_COPY_THREADS", 0);
+	if (nthreads > URPC_COPY_MAX_THREADS)
+		nthreads = URPC_COPY_MAX_THREADS;
+	for (int i = 0; i < nthreads; i++) {
+		pthread_t t;
+		if (pthread_create(&t, NULL, _copy_helper, (void *)(intptr_t)i) != 0)
+			break;
+		pthread_detach(t);
+		_cpool.nthreads++;
+	}
+	dprintf("urpc copy: nt=%s nt_threshold=%lu threads=%d par_threshold=%lu\n",
+		_nt_name, _nt_threshold, _cpool.nthreads, _par_threshold);
+}
+
+/*
+  Copy with an explicitly selected method, falls back to the plain copy if
+  the method is not available. Used for benchmarking.
+ */
+void urpc_memcpy_method(int method, void *dst, const void *src, size_t n)
+{
+	pthread_once(&_copy_once, _copy_init);
+	switch (method) {
+	case URPC_COPY_NT:
+		if (_nt_copy) {
+			_nt_copy(dst, src, n);
+			return;
+		}
+		break;
+	case URPC_COPY_PARALLEL:
+		if (_cpool.nthreads) {
+			_parallel_copy(dst, src, n);
+			return;
+		}
+		break;
+	case URPC_COPY_AUTO:
+		urpc_memcpy(dst, src, n);
+		return;
+	}
+	memcpy(dst, src, n);
+}
+
+/*
+  Copy payload data, the strategy is selected by size.
+ */
+void urpc_memcpy(void *dst, const void *src, size_t n)
+{
+	if (n < URPC_COPY_NT_MIN) {
+		memcpy(dst, src, n);
+		return;
+	}
+	pthread_once(&_copy_once, _copy_init);
+	if (_cpool.nthreads && n >= _par_threshold)
+		_parallel_copy(dst, src, n);
+	else if (_nt_copy && n >= _nt_threshold)
+		_nt_copy(dst, src, n);
+	else
+		memcpy(dst, src, n);
+}
+
+/*
+  Name of the streaming store implementation selected at runtime.
+ */
+const char *urpc_memcpy_info(void)
+{
+	pthread_once(&_copy_once, _copy_init);
+	return _nt_name;
+}
@@ -0,0 +1,221 @@
+/**
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *
+ * Zero block elision for sparse payloads.
+ *
+ * Copyright (c) 2020 Erich Focht
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "urpc_common.h"
+
+/*
+  Sparse payload encoding:
+
+  +---------------------+
+  | urpc_sparse_hdr_t   |  magic, block shift, decoded length
+  +---------------------+
+  | bitmap              |  one bit per block, set if the block is non-zero,
+  |                     |  padded to 8 bytes
+  +---------------------+
+  | non-zero blocks     |  in order, the last block may be partial
+  +---------------------+
+
+  Only the encoded size is copied into the data buffer and, on the VE,
+  transferred by DMA. The handler of the command reconstructs the data with
+  urpc_sparse_decode().
+ */
+
+#define BITMAP_WORDS(nb) (((nb) + 63) / 64)
+/* bitmaps up to this size are kept on the stack while encoding */
+#define SPARSE_STACK_BITMAP 512
+
+/*
+  Zero test of one block. The loop has no early exit so that it vectorizes.
+ */
+static inline int _block_is_zero(const char *p, size_t len)
+{
+	size_t nw = len >> 3;
+	uint64_t acc = 0;
+
+	for (size_t i = 0; i < nw; i++) {
+		uint64_t w;
+		memcpy(&w, p + (i << 3), 8);	// buf may be unaligned
+		acc |= w;
+	}
+	for (size_t i = nw << 3; i < len; i++)
+		acc |= (uint8_t)p[i];
+	return acc == 0;
+}
+
+/*
+  Fill the bitmap, return the number of bytes in non-zero blocks.
+ */
+static size_t _sparse_scan(const char *buf, size_t len, int shift,
+			   uint64_t *bitmap, uint64_t nblocks)
+{
+	size_t bs = 1UL << shift, nzbytes = 0;
+
+	memset(bitmap, 0, BITMAP_WORDS(nblocks) * 8);
+	for (uint64_t b = 0; b < nblocks; b++) {
+		size_t off = b << shift;
+		size_t sz = (off + bs > len) ? len - off : bs;
+		if (!_block_is_zero(buf + off, sz)) {
+			bitmap[b >> 6] |= 1UL << (b & 63);
+			nzbytes += sz;
+		}
+	}
+	return nzbytes;
+}
+
+/*
+  Send buf as sparse payload with zero blocks of (1 << block_shift) bytes
+  elided. Use URPC_SPARSE_LINE or URPC_SPARSE_PAGE as block_shift.
+
+  Returns the request ID, -EAGAIN if the send buffer is full for now (as
+  urpc_generic_send()) or another negative error.
+ */
+int64_t urpc_send_sparse(urpc_peer_t *up, int cmd, const void *buf, size_t len,
+			 int block_shift)
+{
+	uint64_t stack_bitmap[SPARSE_STACK_BITMAP];
+	uint64_t *bitmap = stack_bitmap;
+	const char *src = (const char *)buf;
+	urpc_mb_t mb;
+	int64_t rc;
+
+	if (block_shift < URPC_SPARSE_LINE || block_shift > URPC_SPARSE_PAGE
+	    || (len > 0 && buf == NULL)) {
+		eprintf("urpc_send_sparse: invalid arguments\n");
+		return -EINVAL;
+	}
+	uint64_t nblocks = (len + (1UL << block_shift) - 1) >> block_shift;
+	if (BITMAP_WORDS(nblocks) > SPARSE_STACK_BITMAP) {
+		bitmap = (uint64_t *)malloc(BITMAP_WORDS(nblocks) * 8);
+		if (bitmap == NULL)
+			return -ENOMEM;
+	}
+	size_t nzbytes = _sparse_scan(src, len, block_shift, bitmap, nblocks);
+	size_t bmbytes = BITMAP_WORDS(nblocks) * 8;
+	size_t hsz = _urpc_ext_hdr_size(cmd);
+	size_t size = hsz + sizeof(urpc_sparse_hdr_t) + bmbytes + nzbytes;
+
+	char *payload = (char *)urpc_alloc_send_payload(&up->send, size, &mb);
+	if (payload == NULL) {
+		rc = -EAGAIN;
+		goto out;
+	}
+	payload = _urpc_ext_hdr_put(payload, cmd, &mb);
+	urpc_sparse_hdr_t *hdr = (urpc_sparse_hdr_t *)payload;
+	hdr->magic = URPC_SPARSE_MAGIC;
+	hdr->block_shift = block_shift;
+	hdr->len = len;
+	memcpy(payload + sizeof(urpc_sparse_hdr_t), bitmap, bmbytes);
+
+	// copy runs of consecutive non-zero blocks at once
+	char *pp = payload + sizeof(urpc_sparse_hdr_t) + bmbytes;
+	uint64_t b = 0;
+	while (b < nblocks) {
+		if (!(bitmap[b >> 6] & (1UL << (b & 63)))) {
+			b++;
+			continue;
+		}
+		uint64_t e = b + 1;
+		while (e < nblocks && (bitmap[e >> 6] & (1UL << (e & 63))))
+			e++;
+		size_t off = b << block_shift;
+		size_t end = e << block_shift;
+		if (end > len)
+			end = len;
+		urpc_memcpy(pp, src + off, end - off);
+		pp += end - off;
+		b = e;
+	}
+	rc = urpc_submit_send(up, &mb, size);
+out:
+	if (bitmap != stack_bitmap)
+		free(bitmap);
+	return rc;
+}
+
+/*
+  Decoded length of a sparse payload, or -EINVAL if it is not one.
+ */
+int64_t urpc_sparse_len(const void *payload, size_t plen)
+{
+	const urpc_sparse_hdr_t *hdr = (const urpc_sparse_hdr_t *)payload;
+
+	if (payload == NULL || plen < sizeof(urpc_sparse_hdr_t)
+	    || hdr->magic != URPC_SPARSE_MAGIC
+	    || hdr->block_shift < URPC_SPARSE_LINE
+	    || hdr->block_shift > URPC_SPARSE_PAGE)
+		return -EINVAL;
+	return (int64_t)hdr->len;
+}
+
+/*
+  Reconstruct a sparse payload into dst, which must hold at least
+  urpc_sparse_len() bytes. Zero blocks are written with memset().
+
+  Returns the decoded length or a negative error.
+ */
+int64_t urpc_sparse_decode(const void *payload, size_t plen, void *dst, size_t dlen)
+{
+	const urpc_sparse_hdr_t *hdr = (const urpc_sparse_hdr_t *)payload;
+	int64_t len = urpc_sparse_len(payload, plen);
+
+	if (len < 0)
+		return len;
+	if ((size_t)len > dlen)
+		return -ENOSPC;
+
+	int shift = hdr->block_shift;
+	uint64_t nblocks = ((uint64_t)len + (1UL << shift) - 1) >> shift;
+	size_t bmbytes = BITMAP_WORDS(nblocks) * 8;
+	if (plen < sizeof(urpc_sparse_hdr_t) + bmbytes)
+		return -EINVAL;
+	const uint64_t *bitmap = (const uint64_t *)((const char *)payload
+						    + sizeof(urpc_sparse_hdr_t));
+	const char *pp = (const char *)bitmap + bmbytes;
+	const char *pend = (const char *)payload + plen;
+	char *d = (char *)dst;
+
+	// handle runs of equal bits with one memset() or memcpy() each
+	uint64_t b = 0;
+	while (b < nblocks) {
+		uint64_t bit = bitmap[b >> 6] & (1UL << (b & 63));
+		uint64_t e = b + 1;
+		while (e < nblocks && !(bitmap[e >> 6] & (1UL << (e & 63))) == !bit)
+			e++;
+		size_t off = b << shift;
+		size_t end = e << shift;
+		if (end > (size_t)len)
+			end = len;
+		if (bit) {
+			if (pp + (end - off) > pend)
+				return -EINVAL;
+			memcpy(d + off, pp, end - off);
+			pp += end - off;
+		} else {
+			memset(d + off, 0, end - off);
+		}
+		b = e;
+	}
+	return len;
+}
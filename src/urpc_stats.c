@@ -0,0 +1,240 @@
+/**
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *
+ * Per command handler statistics.
+ *
+ * Copyright (c) 2020 Erich Focht
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "urpc_common.h"
+
+/*
+  The statistics are updated by the thread running the progress loop of the
+  peer, without atomics. Reading them from another thread gives approximate
+  values. They can be enabled, disabled and reset from any thread: disabling
+  only unhooks them, their memory is freed when the peer is destroyed.
+
+  Setting URPC_STATS in the environment enables the statistics for all peers
+  and dumps them to stderr when the peer is destroyed.
+
+  Independent of them, the message counters of both queues are always
+  published into the segment header page (urpc_shm_stats_t), where
+  urpc-top reads them.
+ */
+
+/*
+  Enable or disable the handler statistics of a peer. Enabling clears them.
+ */
+int urpc_stats_enable(urpc_peer_t *up, int enable)
+{
+	if (!enable) {
+		__atomic_store_n(&up->stats, NULL, __ATOMIC_RELEASE);
+		return 0;
+	}
+	if (up->stats_mem == NULL) {
+		up->stats_mem = (urpc_cmd_stats_t *)
+			calloc(URPC_MAX_HANDLERS + 1, sizeof(urpc_cmd_stats_t));
+		if (up->stats_mem == NULL)
+			return -ENOMEM;
+	} else
+		memset(up->stats_mem, 0, (URPC_MAX_HANDLERS + 1) * sizeof(urpc_cmd_stats_t));
+	__atomic_store_n(&up->stats, up->stats_mem, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+  Statistics of command cmd, NULL if they are disabled.
+ */
+const urpc_cmd_stats_t *urpc_stats_get(urpc_peer_t *up, int cmd)
+{
+	if (up->stats == NULL || cmd < 0 || cmd > URPC_MAX_HANDLERS)
+		return NULL;
+	return &up->stats[cmd];
+}
+
+void urpc_stats_reset(urpc_peer_t *up)
+{
+	if (up->stats)
+		memset(up->stats, 0, (URPC_MAX_HANDLERS + 1) * sizeof(urpc_cmd_stats_t));
+}
+
+/*
+  Upper bound (in cycles) of the bucket containing the given percentile.
+ */
+static uint64_t _stats_percentile(const urpc_cmd_stats_t *s, double pct)
+{
+	uint64_t want = (uint64_t)(s->calls * pct / 100.0), sum = 0;
+
+	for (int b = 0; b < URPC_STATS_BUCKETS; b++) {
+		sum += s->hist[b];
+		if (sum > want)
+			return 2UL << b;
+	}
+	return 2UL << (URPC_STATS_BUCKETS - 1);
+}
+
+/*
+  Print a table of all commands which were called, with their share of the
+  total handler time. Times are in cycles of get_cycles().
+ */
+void urpc_stats_dump(urpc_peer_t *up, FILE *f)
+{
+	uint64_t total = 0;
+
+	if (up->stats == NULL)
+		return;
+	for (int c = 0; c <= URPC_MAX_HANDLERS; c++)
+		total += up->stats[c].cycles;
+#ifdef __ve__
+	fprintf(f, "[VE] ");
+#else
+	fprintf(f, "[VH] ");
+#endif
+	urpc_clock_check();
+	fprintf(f, "urpc handler statistics, peer %p (times in cycles, %.1f cycles/us)\n",
+		(void *)up, urpc_clock.cycles_per_us);
+	fprintf(f, "%4s %12s %14s %16s %6s %10s %10s %10s\n", "cmd", "calls",
+		"bytes", "cycles", "time%", "mean", "p50<", "p99<");
+	for (int c = 0; c <= URPC_MAX_HANDLERS; c++) {
+		const urpc_cmd_stats_t *s = &up->stats[c];
+		if (s->calls == 0)
+			continue;
+		fprintf(f, "%4d %12lu %14lu %16lu %6.1f %10lu %10lu %10lu\n", c,
+			s->calls, s->bytes, s->cycles,
+			total ? 100.0 * s->cycles / total : 0.0, s->cycles / s->calls,
+			_stats_percentile(s, 50.0), _stats_percentile(s, 99.0));
+	}
+}
+
+void urpc_stats_init(urpc_peer_t *up)
+{
+	if (getenv("URPC_STATS"))
+		urpc_stats_enable(up, 1);
+}
+
+/*
+  Called when the peer is destroyed or reset, no progress loop runs on it.
+ */
+void urpc_stats_fini(urpc_peer_t *up)
+{
+	if (up->stats && getenv("URPC_STATS"))
+		urpc_stats_dump(up, stderr);
+	up->stats = NULL;
+	free(up->stats_mem);
+	up->stats_mem = NULL;
+}
+
+/*
+  Poll statistics. Setting URPC_POLL_STATS in the environment enables them
+  for all peers and dumps them to stderr when the peer is destroyed.
+ */
+int urpc_poll_stats_enable(urpc_peer_t *up, int enable)
+{
+	if (!enable) {
+		__atomic_store_n(&up->poll, NULL, __ATOMIC_RELEASE);
+		return 0;
+	}
+	if (up->poll_mem == NULL) {
+		up->poll_mem = (urpc_poll_stats_t *)calloc(1, sizeof(urpc_poll_stats_t));
+		if (up->poll_mem == NULL)
+			return -ENOMEM;
+	} else
+		memset(up->poll_mem, 0, sizeof(urpc_poll_stats_t));
+	__atomic_store_n(&up->poll, up->poll_mem, __ATOMIC_RELEASE);
+	return 0;
+}
+
+const urpc_poll_stats_t *urpc_poll_stats_get(urpc_peer_t *up)
+{
+	return up->poll;
+}
+
+void urpc_poll_stats_reset(urpc_peer_t *up)
+{
+	if (up->poll)
+		memset(up->poll, 0, sizeof(urpc_poll_stats_t));
+}
+
+void urpc_poll_stats_dump(urpc_peer_t *up, FILE *f)
+{
+	const urpc_poll_stats_t *p = up->poll;
+
+	if (p == NULL)
+		return;
+	uint64_t total = p->empty_cycles + p->busy_cycles;
+#ifdef __ve__
+	fprintf(f, "[VE] ");
+#else
+	fprintf(f, "[VH] ");
+#endif
+	urpc_clock_check();
+	fprintf(f, "urpc poll statistics, peer %p (times in cycles, %.1f cycles/us)\n",
+		(void *)up, urpc_clock.cycles_per_us);
+	fprintf(f, "  progress calls %lu, empty %lu (%.1f%%), empty time %.1f%%, "
+		"%lu cycles per empty call\n", p->calls, p->empty,
+		p->calls ? 100.0 * p->empty / p->calls : 0.0,
+		total ? 100.0 * p->empty_cycles / total : 0.0,
+		p->empty ? p->empty_cycles / p->empty : 0);
+	fprintf(f, "  send ring full %lu times, %lu polls, %lu cycles, %lu cycles per wait\n",
+		p->full_waits, p->full_spins, p->full_cycles,
+		p->full_waits ? p->full_cycles / p->full_waits : 0);
+	fprintf(f, "  request waits: %lu empty polls, %lu cycles, %lu timeouts\n",
+		p->req_polls, p->req_cycles, p->timeouts);
+	fprintf(f, "  recv ring occupancy: mean %.1f of %d, samples %lu\n   ",
+		p->occ_samples ? (double)p->occ_sum / p->occ_samples : 0.0,
+		URPC_LEN_MB, p->occ_samples);
+	for (int b = 0; b < URPC_POLL_OCC_BUCKETS; b++)
+		fprintf(f, " %d:%lu", 1 << b, p->occ_hist[b]);
+	fprintf(f, "\n");
+}
+
+void urpc_poll_stats_init(urpc_peer_t *up)
+{
+	if (getenv("URPC_POLL_STATS"))
+		urpc_poll_stats_enable(up, 1);
+}
+
+void urpc_poll_stats_fini(urpc_peer_t *up)
+{
+	if (up->poll && getenv("URPC_POLL_STATS"))
+		urpc_poll_stats_dump(up, stderr);
+	up->poll = NULL;
+	free(up->poll_mem);
+	up->poll_mem = NULL;
+}
+
+/*
+  Point the send and receive counters of a peer into the statistics area
+  of its segment. side is 0 on the VH, 1 on the VE; on the VE s is a VEHVA.
+ */
+void urpc_shm_stats_init(urpc_peer_t *up, urpc_shm_stats_t *s, int side)
+{
+	int qsend = side ? URPC_Q_VE2VH : URPC_Q_VH2VE;
+	int qrecv = side ? URPC_Q_VH2VE : URPC_Q_VE2VH;
+
+	memset(&up->send.cnt, 0, sizeof(urpc_shm_cnt_t));
+	memset(&up->recv.cnt, 0, sizeof(urpc_shm_cnt_t));
+	up->send.cnt_pub = 0;
+	up->recv.cnt_pub = 0;
+	up->send.shm_cnt = &s->q[qsend][URPC_SHM_SENDER];
+	up->recv.shm_cnt = &s->q[qrecv][URPC_SHM_RECEIVER];
+	TQ_WRITE32(s->pid[side], getpid());
+}
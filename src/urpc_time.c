@@ -0,0 +1,166 @@
+/**
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *
+ * Calibrated time source.
+ *
+ * Copyright (c) 2020 Erich Focht
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef __ve__
+#include <cpuid.h>
+#endif
+
+#include "urpc_common.h"
+
+/*
+  Environment:
+  URPC_CLOCK=monotonic   do not use the cycle counter, always call
+                         clock_gettime(CLOCK_MONOTONIC)
+ */
+#define URPC_CLOCK_CALIBRATE_NS 1000000
+
+struct urpc_clock urpc_clock = {
+	.ns_per_cycle = 1.0,
+	.cycles_per_us = 1000.0,
+	.use_cycles = 0,
+};
+
+static uint64_t _mono_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+/*
+  The TSC can only be used if it ticks at a constant rate in all P- and
+  C-states: CPUID leaf 0x80000007, EDX bit 8.
+ */
+static int _cycles_usable(void)
+{
+#ifdef __ve__
+	return 1;
+#else
+	unsigned int a, b, c, d;
+
+	if (!__get_cpuid(0x80000007, &a, &b, &c, &d))
+		return 0;
+	return (d >> 8) & 1;
+#endif
+}
+
+/*
+  TSC frequency from CPUID leaf 0x15 (crystal clock and TSC/crystal ratio),
+  in Hz. Returns 0 if the CPU doesn't report it, as most hypervisors and
+  older CPUs.
+ */
+static double _cycles_hz_cpuid(void)
+{
+#ifdef __ve__
+	return 0.0;
+#else
+	unsigned int a, b, c, d;
+
+	if (__get_cpuid_max(0, NULL) < 0x15)
+		return 0.0;
+	__cpuid(0x15, a, b, c, d);
+	if (a == 0 || b == 0 || c == 0)
+		return 0.0;
+	return (double)c * b / a;
+#endif
+}
+
+/*
+  Sample the cycle counter and CLOCK_MONOTONIC. The clock_gettime() calls
+  bracket the cycle counter read, which is attributed to the middle.
+ */
+static void _calibrate(uint64_t *cyc, uint64_t *ns)
+{
+	uint64_t t0 = _mono_ns();
+	uint64_t c = get_cycles();
+	uint64_t t1 = _mono_ns();
+
+	*cyc = c;
+	*ns = t0 + (t1 - t0) / 2;
+}
+
+static uint64_t _load_cycles, _load_ns;
+
+static void _set_frequency(double ns_per_cycle, uint64_t cyc, uint64_t ns)
+{
+	urpc_clock.ns_per_cycle = ns_per_cycle;
+	urpc_clock.cycles_per_us = 1000.0 / ns_per_cycle;
+	urpc_clock.base_cycles = cyc;
+	urpc_clock.base_ns = ns;
+	__atomic_store_n(&urpc_clock.calibrated, 1, __ATOMIC_RELEASE);
+	dprintf("urpc clock: %.3f MHz cycle counter\n", urpc_clock.cycles_per_us);
+}
+
+/*
+  Choose the clock source when the library is loaded. This must be cheap,
+  it runs in every process, e.g. in each launched child.
+ */
+__attribute__((constructor))
+static void _urpc_clock_init(void)
+{
+	char *e = getenv("URPC_CLOCK");
+	double hz;
+
+	if (!_cycles_usable() || (e && strcmp(e, "monotonic") == 0)) {
+		urpc_clock.use_cycles = 0;
+		urpc_clock.ns_per_cycle = 1.0;
+		urpc_clock.cycles_per_us = 1000.0;
+		urpc_clock.base_cycles = 0;
+		urpc_clock.base_ns = _mono_ns();
+		urpc_clock.calibrated = 1;
+		return;
+	}
+	urpc_clock.use_cycles = 1;
+	_calibrate(&_load_cycles, &_load_ns);
+	hz = _cycles_hz_cpuid();
+	if (hz > 0.0)
+		_set_frequency(1e9 / hz, _load_cycles, _load_ns);
+}
+
+/*
+  Measure the cycle counter frequency against CLOCK_MONOTONIC over the
+  interval since the library was loaded, spinning only if that was less
+  than URPC_CLOCK_CALIBRATE_NS ago. Called on first use of the frequency,
+  see urpc_clock_check(). Concurrent callers compute equivalent values.
+ */
+void urpc_clock_calibrate(void)
+{
+	uint64_t c1, n1;
+
+	if (__atomic_load_n(&urpc_clock.calibrated, __ATOMIC_ACQUIRE))
+		return;
+	do {
+		_calibrate(&c1, &n1);
+	} while (n1 - _load_ns < URPC_CLOCK_CALIBRATE_NS);
+
+	if (c1 <= _load_cycles) {
+		urpc_clock.use_cycles = 0;
+		urpc_clock.base_ns = _mono_ns();
+		__atomic_store_n(&urpc_clock.calibrated, 1, __ATOMIC_RELEASE);
+		return;
+	}
+	_set_frequency((double)(n1 - _load_ns) / (double)(c1 - _load_cycles),
+		       c1, n1);
+}
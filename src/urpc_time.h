@@ -23,8 +23,34 @@
  */
 
 #include <stdint.h>
+#include <time.h>
 #include <sys/time.h>
 
+/*
+  Time is measured with the cycle counter (usrcc on the VE, the TSC on the
+  VH). Its frequency is taken from CPUID when the CPU reports it, otherwise
+  it is calibrated against CLOCK_MONOTONIC on first use, i.e. processes
+  which never convert cycles don't pay for the calibration. On hosts
+  without invariant TSC clock_gettime() is used instead.
+ */
+struct urpc_clock {
+	double ns_per_cycle;
+	double cycles_per_us;
+	uint64_t base_cycles;		// cycle counter at calibration
+	uint64_t base_ns;		// CLOCK_MONOTONIC at calibration
+	int use_cycles;			// 0 if the cycle counter is not usable
+	int calibrated;			// 0 until the frequency is known
+};
+extern struct urpc_clock urpc_clock;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void urpc_clock_calibrate(void);
+#ifdef __cplusplus
+}
+#endif
+
 #ifdef __ve__
 
 static inline long getusrcc()
@@ -32,36 +58,105 @@ static inline long getusrcc()
 	asm("smir %s0, %usrcc");
 }
 
-static inline long get_time_us(void)
+static inline uint64_t get_cycles(void)
 {
-	/* This implies that the VE runs with 1400MHz,
-	   the exact frequency doesn't actually matter for this purpose,
-	   but should eventually be fixed.
-	*/
-	return getusrcc() / 1400;
+	return (uint64_t)getusrcc();
 }
 
 #else /* VH, i.e. x86_64 */
 
-static inline long get_time_us(void)
-{
-	struct timeval t;
+#include <x86intrin.h>
 
-	gettimeofday(&t, NULL);
-	return (long)(t.tv_sec * 1000000 + t.tv_usec);
+static inline uint64_t get_cycles(void)
+{
+	return __rdtsc();
 }
 
 #endif
 
+static inline void urpc_clock_check(void)
+{
+	if (__builtin_expect(!urpc_clock.calibrated, 0))
+		urpc_clock_calibrate();
+}
+
+static inline uint64_t urpc_cycles_to_ns(uint64_t cycles)
+{
+	urpc_clock_check();
+	return (uint64_t)((double)cycles * urpc_clock.ns_per_cycle);
+}
+
+/*
+  Monotonic time in nanoseconds.
+ */
+static inline uint64_t urpc_get_time_ns(void)
+{
+	if (urpc_clock.use_cycles) {
+		urpc_clock_check();
+		return urpc_clock.base_ns
+			+ urpc_cycles_to_ns(get_cycles() - urpc_clock.base_cycles);
+	}
+
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+static inline long get_time_us(void)
+{
+	return (long)(urpc_get_time_ns() / 1000);
+}
+
 static inline long timediff_us(long ts)
 {
 	return get_time_us() - ts;
 }
 
+/*
+  Deadlines for spin loops. The deadline is kept in the units of the clock
+  source and the clock is read only every URPC_DEADLINE_CHECK_EVERY checks.
+
+    urpc_deadline_t d;
+    urpc_deadline_init(&d, timeout_us);
+    while (!ready() && !urpc_deadline_passed(&d));
+ */
+#define URPC_DEADLINE_CHECK_EVERY 64
+
+typedef struct urpc_deadline {
+	uint64_t end;
+	uint32_t count;
+} urpc_deadline_t;
+
+static inline uint64_t _urpc_clock_now(void)
+{
+	return urpc_clock.use_cycles ? get_cycles() : urpc_get_time_ns();
+}
+
+static inline void urpc_deadline_init(urpc_deadline_t *d, long timeout_us)
+{
+	urpc_clock_check();
+	uint64_t delta = urpc_clock.use_cycles
+		? (uint64_t)(timeout_us * urpc_clock.cycles_per_us)
+		: (uint64_t)timeout_us * 1000;
+
+	d->end = _urpc_clock_now() + delta;
+	d->count = 0;
+}
+
+static inline int urpc_deadline_passed(urpc_deadline_t *d)
+{
+	if (++d->count < URPC_DEADLINE_CHECK_EVERY)
+		return 0;
+	d->count = 0;
+	return _urpc_clock_now() >= d->end;
+}
+
 static inline void busy_sleep_us(long us)
 {
-	long ts = get_time_us();
-	do {} while (timediff_us(ts) < us);
+	urpc_deadline_t d;
+
+	urpc_deadline_init(&d, us);
+	while (!urpc_deadline_passed(&d));
 }
 
 #endif /* VE_URPC_COMM_INCLUDE */
@@ -0,0 +1,150 @@
+/**
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *
+ * Binary request tracing.
+ *
+ * Copyright (c) 2020 Erich Focht
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "urpc_common.h"
+
+/*
+  Environment:
+  URPC_TRACE=<nevents>      enable tracing for all peers, with a ring of
+                            nevents entries (rounded up to a power of 2,
+                            default URPC_TRACE_DEFAULT_EVENTS)
+  URPC_TRACE_FILE=<prefix>  dump the ring at peer teardown to
+                            <prefix>.vh.<segid> or <prefix>.ve.<segid>
+
+  Convert dumps with urpc-trace2json to Chrome/Perfetto trace JSON.
+ */
+#define URPC_TRACE_DEFAULT_EVENTS (64 * 1024)
+
+static uint64_t _wall_us(void)
+{
+	struct timeval t;
+
+	gettimeofday(&t, NULL);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static void _trace_set(urpc_peer_t *up, urpc_trace_t *t)
+{
+	up->trace = t;
+	up->send.trace = t;
+	up->recv.trace = t;
+}
+
+/*
+  Enable tracing into a ring of nevents entries, 0 disables it. Should be
+  called while the peer is idle.
+
+  Returns 0 or a negative error.
+ */
+int urpc_trace_enable(urpc_peer_t *up, uint64_t nevents)
+{
+	urpc_trace_t *old = up->trace, *t = NULL;
+
+	if (nevents) {
+		uint64_t n = 1;
+		while (n < nevents)
+			n <<= 1;
+		t = (urpc_trace_t *)calloc(1, sizeof(urpc_trace_t) + n * sizeof(urpc_trace_ev_t));
+		if (t == NULL)
+			return -ENOMEM;
+		t->mask = n - 1;
+		t->ref_us = _wall_us();
+		t->ref_cycles = get_cycles();
+	}
+	_trace_set(up, t);
+	free(old);
+	return 0;
+}
+
+/*
+  Write the trace ring to a file, oldest event first.
+
+  Returns 0 or a negative error.
+ */
+int urpc_trace_dump(urpc_peer_t *up, const char *path)
+{
+	urpc_trace_t *t = up->trace;
+	urpc_trace_file_hdr_t hdr;
+
+	if (t == NULL)
+		return -EINVAL;
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return -errno;
+
+	uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+	uint64_t n = head < t->mask + 1 ? head : t->mask + 1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = URPC_TRACE_MAGIC;
+	hdr.version = URPC_TRACE_VERSION;
+	hdr.side = _urpc_peer_side(up);
+	hdr.segid = up->shm_segid;
+	hdr.pid = getpid();
+	hdr.nevents = n;
+	hdr.lost = head - n;
+	hdr.ref_cycles = t->ref_cycles;
+	hdr.ref_us = t->ref_us;
+	hdr.end_us = _wall_us();
+	hdr.end_cycles = get_cycles();
+
+	int rc = 0;
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		rc = -EIO;
+	for (uint64_t i = head - n; i < head && rc == 0; i++)
+		if (fwrite(&t->ev[i & t->mask], sizeof(urpc_trace_ev_t), 1, f) != 1)
+			rc = -EIO;
+	if (fclose(f) != 0 && rc == 0)
+		rc = -EIO;
+	if (rc)
+		eprintf("writing trace to %s failed\n", path);
+	return rc;
+}
+
+void urpc_trace_init(urpc_peer_t *up)
+{
+	char *e = getenv("URPC_TRACE");
+
+	_trace_set(up, NULL);
+	if (e) {
+		uint64_t n = strtoull(e, NULL, 0);
+		urpc_trace_enable(up, n ? n : URPC_TRACE_DEFAULT_EVENTS);
+	}
+}
+
+void urpc_trace_fini(urpc_peer_t *up)
+{
+	char *prefix = getenv("URPC_TRACE_FILE");
+
+	if (up->trace && prefix) {
+		char path[512];
+		snprintf(path, sizeof(path), "%s.%s.%d", prefix,
+			 _urpc_peer_side(up) ? "ve" : "vh", up->shm_segid);
+		urpc_trace_dump(up, path);
+	}
+	urpc_trace_enable(up, 0);
+}
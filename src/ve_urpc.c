@@ -66,6 +66,30 @@ static int vhshm_register(urpc_peer_t *up)
 	return 0;
 }
 
+/*
+  Read the segment header written by the VH side and check that we
+  understand the layout.
+*/
+static int ve_urpc_read_shm_hdr(urpc_peer_t *up, urpc_shm_hdr_t *hdr)
+{
+	uint64_t *src = (uint64_t *)up->shm_vehva;
+	uint64_t *dst = (uint64_t *)hdr;
+
+	for (int i = 0; i < sizeof(urpc_shm_hdr_t) / sizeof(uint64_t); i++)
+		dst[i] = TQ_READ64(src[i]);
+	if (hdr->magic != URPC_SHM_MAGIC || hdr->version != URPC_SHM_VERSION) {
+		eprintf("VE: shm segment %d has an unknown header, magic=%lx version=%u\n",
+			up->shm_segid, hdr->magic, hdr->version);
+		return -EINVAL;
+	}
+	if (hdr->offs_shift != URPC_OFFSET_SHIFT) {
+		eprintf("VE: shm segment offset shift %u, expected %u\n",
+			hdr->offs_shift, URPC_OFFSET_SHIFT);
+		return -EINVAL;
+	}
+	return 0;
+}
+
 /**
  * @brief Pin the thread to a core. In case of OpenMP: pin all threads to consecutive cores.
  *
@@ -129,6 +153,9 @@ static void ve_urpc_comm_init(urpc_comm_t *uc, int64_t data_buff_end)
 	uc->mem[1].end = 0;
 	uc->active = &uc->mem[0];
 	uc->data_buff_end = data_buff_end;
+	uc->alloc_fail = 0;
+	uc->high_water = 0;
+	uc->gc_runs = 0;
         pthread_mutex_init(&uc->lock, NULL);
 }
 
@@ -168,20 +195,6 @@ urpc_peer_t *ve_urpc_init(int segid)
 		}
 	}
 
-	int64_t urpc_data_buff_len = 0;
-	e = getenv("URPC_DATA_BUFF_LEN");
-	if (e) {
-		urpc_data_buff_len = atoi(e);
-	} else {
-		eprintf("env variable URPC_BUFF_LEN not found.\n");
-		free(up);
-		errno = ENOENT;
-		return NULL;
-	}
-	int64_t urpc_buff_len = urpc_data_buff_len + 8*(URPC_LEN_MB + 2);
-	int64_t data_buff_end = urpc_data_buff_len - 4096;
-	up->urpc_data_buff_len = urpc_data_buff_len;
-
 	// find and register shm segment
 	err = vhshm_register(up);
 	if (err) {
@@ -191,18 +204,33 @@ urpc_peer_t *ve_urpc_init(int segid)
 		return NULL;
 	}
 
-	up->recv.tq = (transfer_queue_t *)(up->shm_vehva);
-	up->send.tq = (transfer_queue_t *)(up->shm_vehva + urpc_buff_len);
-        up->recv.shm_data_vehva = up->shm_vehva + offsetof(transfer_queue_t, data);
-        up->send.shm_data_vehva = up->shm_vehva + urpc_buff_len
-		+ offsetof(transfer_queue_t, data);
+	// the segment header describes the layout of the queues
+	urpc_shm_hdr_t hdr;
+	err = ve_urpc_read_shm_hdr(up, &hdr);
+	if (err) {
+		vh_shmdt(up->shm_addr);
+		free(up);
+		errno = -err;
+		return NULL;
+	}
+	up->urpc_data_buff_len = hdr.data_buff_len[URPC_Q_VH2VE];
+	e = getenv("URPC_DATA_BUFF_LEN");
+	if (e && strtoll(e, NULL, 0) != up->urpc_data_buff_len)
+		eprintf("VE: URPC_DATA_BUFF_LEN=%s differs from shm header (%ld)\n",
+			e, up->urpc_data_buff_len);
+	int64_t recv_buff_len = hdr.q_len[URPC_Q_VH2VE];
+
+	up->recv.tq = (transfer_queue_t *)(up->shm_vehva + hdr.q_offs[URPC_Q_VH2VE]);
+	up->send.tq = (transfer_queue_t *)(up->shm_vehva + hdr.q_offs[URPC_Q_VE2VH]);
+        up->recv.shm_data_vehva = (uint64_t)up->recv.tq + offsetof(transfer_queue_t, data);
+        up->send.shm_data_vehva = (uint64_t)up->send.tq + offsetof(transfer_queue_t, data);
 
-	ve_urpc_comm_init(&up->send, data_buff_end);
+	ve_urpc_comm_init(&up->send, hdr.data_buff_len[URPC_Q_VE2VH] - 4096);
 
 	char *buff_base;
 	uint64_t buff_base_vehva;
 	size_t align_64mb = 64 * 1024 * 1024;
-	size_t buff_size = 2 * urpc_buff_len;
+	size_t buff_size = hdr.q_len[URPC_Q_VH2VE] + hdr.q_len[URPC_Q_VE2VH];
 	buff_size = (buff_size + align_64mb - 1) & ~(align_64mb - 1);
 
 	// allocate read and write buffers in one call
@@ -223,20 +251,31 @@ urpc_peer_t *ve_urpc_init(int segid)
 	dprintf("ve_register_mem_to_dmaatb succeeded for %p\n", buff_base);
 
 	up->recv.mirr_data_buff = buff_base + offsetof(transfer_queue_t, data);
-	up->send.mirr_data_buff = buff_base + urpc_buff_len
+	up->send.mirr_data_buff = buff_base + recv_buff_len
 		+ offsetof(transfer_queue_t, data);
 	
 	up->recv.mirr_data_vehva = buff_base_vehva + offsetof(transfer_queue_t, data);
-	up->send.mirr_data_vehva = buff_base_vehva + urpc_buff_len
+	up->send.mirr_data_vehva = buff_base_vehva + recv_buff_len
 		+ offsetof(transfer_queue_t, data);
 
         // initialize handler table
 	for (int i = 0; i <= URPC_MAX_HANDLERS; i++)
 		up->handler[i] = NULL;
+	up->stats = NULL;
+	up->poll = NULL;
+	up->stats_mem = NULL;
+	up->poll_mem = NULL;
+	up->ext = NULL;
+	up->batch = NULL;
+	urpc_shm_stats_init(up, (urpc_shm_stats_t *)(up->shm_vehva + hdr.stats_offs), 1);
+	urpc_stats_init(up);
+	urpc_poll_stats_init(up);
+	urpc_trace_init(up);
         urpc_run_handler_init_hooks(up);
 
 	// don't remove this
 	up->core = -1;
+	urpc_signal_attached();
 	return up;
 }
 
@@ -290,6 +329,10 @@ void ve_urpc_fini(urpc_peer_t *up)
 			up->shm_vehva = 0;
 		}
 	}
+	urpc_stats_fini(up);
+	urpc_poll_stats_fini(up);
+	urpc_trace_fini(up);
+	urpc_handlers_fini(up);
 	free(up);
 }
 
@@ -343,46 +386,77 @@ int ve_urpc_recv_progress(urpc_peer_t *up, int ncmds)
         void *payload;
         size_t plen;
         int err;
+	URPC_STATS_DECL(t0);
+	URPC_POLL_DECL(tp);
+
+	URPC_POLL_START(up, tp);
 	while (done < ncmds) {
 		int64_t req = urpc_get_cmd(tq, &m);
 		if (req < 0)
 			break;
+		URPC_POLL_OCC(up, tq, req, done);
+		URPC_STATS_START(up, t0);
+		URPC_TRACE(up->trace, URPC_EV_GET, m.c.cmd, req, m.c.len);
+		if (up->batch && up->batch[m.c.cmd]) {
+			size_t bytes;
+			int n = urpc_batch_dispatch(up, &m, req, ncmds - done, &bytes);
+			URPC_STATS_END_N(up, m.c.cmd, n, bytes, t0);
+			uc->cnt.bytes += bytes;
+			done += n;
+			continue;
+		}
 		//
 		// set/receive payload, if needed
 		//
 		set_recv_payload(uc, &m, &payload, &plen);
+		URPC_TRACE(up->trace, URPC_EV_PAYLOAD, m.c.cmd, req, plen);
 		//
 		// call handler
 		//
 		func = up->handler[m.c.cmd];
 		if (func) {
+			URPC_TRACE(up->trace, URPC_EV_HANDLER_BEGIN, m.c.cmd, req, 1);
 			err = func(up, &m, req, payload, plen);
+			URPC_TRACE(up->trace, URPC_EV_HANDLER_END, m.c.cmd, req, err);
 			if (err)
 				eprintf("Warning: RPC handler %d returned %d\n",
 					m.c.cmd, err);
 		}
 
+		URPC_STATS_END(up, m.c.cmd, plen, t0);
+		uc->cnt.bytes += plen;
+		URPC_TRACE(up->trace, URPC_EV_SLOT_DONE, m.c.cmd, req, 0);
 		urpc_slot_done(tq, REQ2SLOT(req), &m);
 		++done;
 	}
+	URPC_POLL_END(up, done, tp);
+	_urpc_cnt_progress(up, done);
 	return done;
 }
 
 /*
-  Progress loop with timeout.
+  Progress loop with timeout: run until no command arrived for timeout_us.
+
+  Returns the number of commands done.
 */
 int ve_urpc_recv_progress_timeout(urpc_peer_t *up, int ncmds, long timeout_us)
 {
-	long done_ts = 0;
+	urpc_deadline_t d = {0};
+	int idle = 0, total = 0;
+
 	do {
 		int done = ve_urpc_recv_progress(up, ncmds);
 		if (done == 0) {
-			if (done_ts == 0)
-				done_ts = get_time_us();
-		} else
-			done_ts = 0;
-
-	} while (done_ts == 0 || timediff_us(done_ts) < timeout_us);
+			if (!idle) {
+				urpc_deadline_init(&d, timeout_us);
+				idle = 1;
+			}
+		} else {
+			total += done;
+			idle = 0;
+		}
+	} while (!idle || !urpc_deadline_passed(&d));
+	return total;
 }
 
 /*
@@ -396,6 +470,6 @@ void ve_prev_sent_payload(urpc_peer_t *up, int offs, void **payload, size_t *ple
         int64_t req = TQ_READ64(tq->last_put_req) - offs;
 	int slot = REQ2SLOT(req);
         m.u64 = TQ_READ64(tq->mb[slot].u64);
-	*payload = (void *)((char *)uc->mirr_data_buff + m.c.offs);
+	*payload = (void *)((char *)uc->mirr_data_buff + MB_OFFS(&m));
 	*plen = m.c.len;
 }
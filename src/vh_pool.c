@@ -0,0 +1,319 @@
+/**
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *
+ * Warm pool of pre-created VH peers.
+ *
+ * Copyright (c) 2020 Erich Focht
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "urpc_common.h"
+
+/*
+  A pool keeps up to 'target' peers ready. A background thread creates
+  the peers and, if a binary was given, launches their children and waits
+  until they attached. Peers returned with vh_urpc_pool_put() are reset
+  in place and reused, their segments keep the populated pages.
+
+  Children are started with PR_SET_PDEATHSIG, which fires when the thread
+  that launched them exits. Therefore all pool children are launched by
+  one process-wide launcher thread, created at the first launch and never
+  exiting, which outlives every pool and the peers it handed out.
+ */
+struct urpc_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		// wakes up the refill thread
+	pthread_t thread;
+	int target;			// number of peers kept ready
+	int numa_node;
+	char *binary;			// child to pre-launch, or NULL
+	int venode_id, ve_core;
+	int nready, nrecycled, nbusy;
+	urpc_peer_t *ready[URPC_MAX_PEERS];
+	urpc_peer_t *recycled[URPC_MAX_PEERS];	// reset, child not launched
+	int stop;
+	uint64_t hits, misses, failed;
+};
+
+struct launch_req {
+	urpc_peer_t *up;
+	urpc_pool_t *pool;
+	int rc, done;
+	struct launch_req *next;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		// wakes up the launcher thread
+	pthread_cond_t done;		// wakes up the requesters
+	struct launch_req *head, *tail;
+	int rc;				// pthread_create() result
+} _launcher = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+static pthread_once_t _launcher_once = PTHREAD_ONCE_INIT;
+
+static void *_launcher_thread(void *arg)
+{
+	pthread_mutex_lock(&_launcher.lock);
+	for (;;) {
+		struct launch_req *r = _launcher.head;
+		if (r == NULL) {
+			pthread_cond_wait(&_launcher.cond, &_launcher.lock);
+			continue;
+		}
+		_launcher.head = r->next;
+		if (_launcher.head == NULL)
+			_launcher.tail = NULL;
+		pthread_mutex_unlock(&_launcher.lock);
+
+		int rc = vh_urpc_child_create(r->up, r->pool->binary,
+					      r->pool->venode_id, r->pool->ve_core);
+
+		pthread_mutex_lock(&_launcher.lock);
+		r->rc = rc;
+		r->done = 1;
+		pthread_cond_broadcast(&_launcher.done);
+	}
+	return NULL;
+}
+
+static void _launcher_start(void)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	_launcher.rc = pthread_create(&thread, &attr, &_launcher_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (_launcher.rc)
+		eprintf("peer pool: launcher pthread_create failed: %s\n",
+			strerror(_launcher.rc));
+}
+
+/*
+  Launch the child of a peer from the launcher thread and wait until it
+  attached. Only the launch is serialized, attach waits run in parallel.
+ */
+static int _pool_launch(urpc_pool_t *pool, urpc_peer_t *up)
+{
+	struct launch_req r = { .up = up, .pool = pool };
+
+	pthread_once(&_launcher_once, _launcher_start);
+	if (_launcher.rc)
+		return -_launcher.rc;
+
+	pthread_mutex_lock(&_launcher.lock);
+	if (_launcher.tail)
+		_launcher.tail->next = &r;
+	else
+		_launcher.head = &r;
+	_launcher.tail = &r;
+	pthread_cond_signal(&_launcher.cond);
+	while (!r.done)
+		pthread_cond_wait(&_launcher.done, &_launcher.lock);
+	pthread_mutex_unlock(&_launcher.lock);
+
+	int rc = r.rc;
+	if (rc == 0 && urpc_wait_peer_attach(up) != 0) {
+		vh_urpc_child_destroy(up);
+		rc = -ECHILD;
+	}
+	return rc;
+}
+
+/*
+  Make a ready peer, reusing a recycled one if there is any.
+ */
+static urpc_peer_t *_pool_make(urpc_pool_t *pool, urpc_peer_t *up)
+{
+	if (up == NULL)
+		up = vh_urpc_peer_create_numa(pool->numa_node);
+	if (up && pool->binary && _pool_launch(pool, up) != 0) {
+		vh_urpc_peer_destroy(up);
+		up = NULL;
+	}
+	return up;
+}
+
+static void *_pool_thread(void *arg)
+{
+	urpc_pool_t *pool = (urpc_pool_t *)arg;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stop) {
+		if (pool->nready + pool->nbusy >= pool->target) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+		urpc_peer_t *up = pool->nrecycled ? pool->recycled[--pool->nrecycled] : NULL;
+		pool->nbusy++;
+		pthread_mutex_unlock(&pool->lock);
+
+		up = _pool_make(pool, up);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->nbusy--;
+		if (up) {
+			pool->ready[pool->nready++] = up;
+			continue;
+		}
+		// don't spin on persistent failures, e.g. URPC_MAX_PEERS reached
+		pool->failed++;
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		pthread_cond_timedwait(&pool->cond, &pool->lock, &ts);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/*
+  Create a pool keeping 'npeers' peers ready, on the given NUMA node (see
+  vh_urpc_peer_create_numa()). If 'binary' is not NULL each peer gets its
+  child launched as with vh_urpc_child_create() and is handed out only
+  after the child attached.
+
+  Returns the pool or NULL if it could not be created.
+ */
+urpc_pool_t *vh_urpc_pool_create(int npeers, int numa_node, char *binary,
+				 int venode_id, int ve_core)
+{
+	if (npeers < 1 || npeers > URPC_MAX_PEERS) {
+		errno = EINVAL;
+		return NULL;
+	}
+	urpc_pool_t *pool = (urpc_pool_t *)malloc(sizeof(urpc_pool_t));
+	if (pool == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(pool, 0, sizeof(urpc_pool_t));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->target = npeers;
+	pool->numa_node = numa_node;
+	pool->venode_id = venode_id;
+	pool->ve_core = ve_core;
+	if (binary) {
+		pool->binary = strdup(binary);
+		if (pool->binary == NULL) {
+			free(pool);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	int rc = pthread_create(&pool->thread, NULL, &_pool_thread, pool);
+	if (rc) {
+		eprintf("vh_urpc_pool_create: pthread_create failed: %s\n", strerror(rc));
+		free(pool->binary);
+		free(pool);
+		errno = rc;
+		return NULL;
+	}
+	return pool;
+}
+
+/*
+  Take a peer out of the pool. If none is ready, one is created (and its
+  child launched) synchronously in the caller.
+
+  Returns the peer or NULL if it could not be created.
+ */
+urpc_peer_t *vh_urpc_pool_get(urpc_pool_t *pool)
+{
+	urpc_peer_t *up = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->nready > 0) {
+		up = pool->ready[--pool->nready];
+		pool->hits++;
+	} else
+		pool->misses++;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	if (up == NULL)
+		up = _pool_make(pool, NULL);
+	return up;
+}
+
+/*
+  Return a peer to the pool. Its child must have exited or detached, the
+  peer is then reset in place and reused. Peers which can't be reset and
+  peers exceeding the pool size are destroyed.
+
+  Returns 0 if the peer was kept for reuse, 1 if it was destroyed.
+ */
+int vh_urpc_pool_put(urpc_pool_t *pool, urpc_peer_t *up)
+{
+	int kept = 0;
+
+	if (vh_urpc_peer_reset(up) == 0) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->binary == NULL && pool->nready < pool->target) {
+			pool->ready[pool->nready++] = up;
+			kept = 1;
+		} else if (pool->binary && pool->nrecycled < pool->target) {
+			pool->recycled[pool->nrecycled++] = up;
+			pthread_cond_signal(&pool->cond);
+			kept = 1;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	if (kept)
+		return 0;
+	if (up->child_pid > 0)
+		vh_urpc_child_destroy(up);
+	vh_urpc_peer_destroy(up);
+	return 1;
+}
+
+/*
+  Stop the refill thread and destroy all pooled peers, killing their
+  pre-launched children. Peers handed out by vh_urpc_pool_get() stay
+  usable, their children are not affected.
+ */
+void vh_urpc_pool_destroy(urpc_pool_t *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	pthread_join(pool->thread, NULL);
+
+	dprintf("peer pool: %lu hits, %lu misses, %lu failed refills\n",
+		pool->hits, pool->misses, pool->failed);
+	for (int i = 0; i < pool->nready; i++) {
+		if (pool->ready[i]->child_pid > 0)
+			vh_urpc_child_destroy(pool->ready[i]);
+		vh_urpc_peer_destroy(pool->ready[i]);
+	}
+	for (int i = 0; i < pool->nrecycled; i++)
+		vh_urpc_peer_destroy(pool->recycled[i]);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->binary);
+	free(pool);
+}
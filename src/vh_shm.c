@@ -24,14 +24,33 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include <poll.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/ipc.h>
+#include <sys/mman.h>
 #include <sys/shm.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+#include "urpc.h"
 #include "urpc_debug.h"
 #include "urpc_time.h"
+#include "vh_shm.h"
+
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+// from linux/mempolicy.h, we don't want to depend on libnuma
+#define VH_MPOL_PREFERRED 1
+#define VH_MPOL_MF_MOVE   (1 << 1)
+#define VH_MAX_NUMA_NODES 1024
+
+#define VH_SHM_WAIT_TIMEOUT_US 50000000
+// interval of the shm_nattch checks, with and without handshake pipe
+#define VH_SHM_WAIT_POLL_MS    10
+#define VH_SHM_WAIT_SLEEP_US   100
 
 static void _vh_shm_destroy(int segid)
 {
@@ -46,15 +65,32 @@ static void _vh_shm_destroy(int segid)
 }
 
 /*
+  Create and attach a shm segment.
+
+  Hugepages are preferred. When the hugepage pool is exhausted (or hugepages
+  are not available at all) fall back to a segment with regular pages and
+  ask for transparent hugepages. A memfd can not be used as fallback, the
+  VE side can only attach SysV segments.
+
+  The backing actually used is returned in *backing (URPC_SHM_HUGETLB or
+  URPC_SHM_THP).
+
   Returns: the segment ID of the shm segment.
  */
-int _vh_shm_init(int key, size_t size, void **local_addr)
+int _vh_shm_init(int key, size_t size, void **local_addr, int *backing)
 {
 	int err = 0;
 	struct shmid_ds ds;
 	int shmat_errno = 0;
 
+	*backing = URPC_SHM_HUGETLB;
 	int segid = shmget(key, size, SHM_HUGETLB | S_IRWXU);
+	if (segid == -1) {
+		dprintf("[vh_shm_init] shmget with SHM_HUGETLB failed: %s. "
+			"Falling back to regular pages.\n", strerror(errno));
+		*backing = URPC_SHM_THP;
+		segid = shmget(key, size, S_IRWXU);
+	}
 	if (segid == -1) {
 		eprintf("[vh_shm_init] shmget failed: %s\n", strerror(errno));
 		return -errno;
@@ -68,10 +104,78 @@ int _vh_shm_init(int key, size_t size, void **local_addr)
 		shmctl(segid, IPC_RMID, NULL);
 		return -shmat_errno;
 	}
+	if (*backing == URPC_SHM_THP &&
+	    madvise(*local_addr, size, MADV_HUGEPAGE) < 0)
+		dprintf("[vh_shm_init] madvise(MADV_HUGEPAGE) failed: %s\n",
+			strerror(errno));
         _vh_shm_destroy(segid);
 	return segid;
 }
 
+/*
+  Return the NUMA node of the CPU the calling thread runs on.
+ */
+int _vh_numa_local_node(void)
+{
+	unsigned cpu, node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+		return -errno;
+	return (int)node;
+}
+
+/*
+  Set a preferred NUMA node memory policy on an attached segment. This must
+  be done before the pages are populated. A preferred policy is used
+  instead of binding: if the node runs out of (huge)pages the segment is
+  placed elsewhere instead of failing on fault.
+
+  Returns: 0 on success, -errno otherwise.
+ */
+int _vh_shm_mbind(void *local_addr, size_t size, int node)
+{
+	unsigned long nodemask[VH_MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+
+	if (node < 0 || node >= VH_MAX_NUMA_NODES)
+		return -EINVAL;
+	memset(nodemask, 0, sizeof(nodemask));
+	nodemask[node / (8 * sizeof(unsigned long))] |=
+		1UL << (node % (8 * sizeof(unsigned long)));
+	if (syscall(SYS_mbind, local_addr, size, VH_MPOL_PREFERRED, nodemask,
+		    VH_MAX_NUMA_NODES, VH_MPOL_MF_MOVE) < 0) {
+		eprintf("[vh_shm_mbind] mbind to node %d failed: %s\n",
+			node, strerror(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+  Populate the pages of an attached segment such that the first messages
+  don't take page faults, and optionally lock them into memory.
+  Failing to lock is not fatal.
+
+  Returns: the flags which were applied successfully.
+ */
+int _vh_shm_populate(void *local_addr, size_t size, int flags)
+{
+	int done = 0;
+
+	if (flags & URPC_SHM_PREFAULTED) {
+		size_t pagesize = sysconf(_SC_PAGE_SIZE);
+		for (size_t off = 0; off < size; off += pagesize)
+			((volatile char *)local_addr)[off] = 0;
+		done |= URPC_SHM_PREFAULTED;
+	}
+	if (flags & URPC_SHM_LOCKED) {
+		if (mlock(local_addr, size) == 0)
+			done |= URPC_SHM_LOCKED;
+		else
+			eprintf("[vh_shm_populate] mlock failed: %s\n", strerror(errno));
+	}
+	return done;
+}
+
 int _vh_shm_fini(int segid, void *local_addr)
 {
 	int err = 0;
@@ -90,13 +194,64 @@ int _vh_shm_fini(int segid, void *local_addr)
 	return err;
 }
 
-int vh_shm_wait_peers(pid_t pid, int segid)
+/*
+  Check whether process 'pid' has the SysV segment 'segid' mapped. The
+  inode field of such mappings is the segment ID.
+ */
+static int _pid_maps_seg(pid_t pid, int segid)
+{
+	char path[64], line[512];
+	unsigned long inode;
+	int found = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	while (!found && fgets(line, sizeof(line), f)) {
+		char *p = strstr(line, "/SYSV");
+		if (p && sscanf(line, "%*s %*s %*s %*s %lu", &inode) == 1)
+			found = inode == (unsigned long)segid;
+	}
+	fclose(f);
+	return found;
+}
+
+/*
+  Wait until the child 'pid' attached to the segment.
+
+  With a handshake pipe (ready_fd >= 0) we sleep in poll() until the
+  child writes its ready byte or exits, which closes the pipe. Children
+  which don't write into the pipe (e.g. linked with an older library)
+  are detected by the shm_nattch check done every VH_SHM_WAIT_POLL_MS,
+  which then also requires that the child attached: it must be the last
+  process that attached or have the segment mapped. Observers like
+  urpc-top attach segments for a moment and would be taken for the child
+  otherwise. Without pipe, or after the pipe was closed
+  without ready byte, only shm_nattch is checked, every
+  VH_SHM_WAIT_SLEEP_US.
+
+  Returns: 0 when the peer attached, -1 if the child exited, on timeout
+  or on error.
+ */
+int vh_shm_wait_peers(pid_t pid, int segid, int ready_fd)
 {
 	struct shmid_ds ds;
-        long ts = get_time_us();
-        int rc = 0;
+	long ts = get_time_us();
 
 	for (;;) {
+		if (ready_fd >= 0) {
+			struct pollfd pfd = { .fd = ready_fd, .events = POLLIN };
+			int rc = poll(&pfd, 1, VH_SHM_WAIT_POLL_MS);
+			if (rc > 0) {
+				char c;
+				if (read(ready_fd, &c, 1) == 1)
+					return 0;
+				// EOF: the child exited or closed the pipe
+				ready_fd = -1;
+			}
+		} else
+			usleep(VH_SHM_WAIT_SLEEP_US);
 		int ret = waitpid(pid, 0, WNOHANG);
 		if (ret != 0)
 			return -1;
@@ -104,13 +259,12 @@ int vh_shm_wait_peers(pid_t pid, int segid)
 			perror("[vh_shm_wait_peers] Failed shmctl IPC_STAT");
 			return -1;
 		}
-		if (ds.shm_nattch == 2)
-			break;
-                if (timediff_us(ts) > 50000000) {
-			rc = -1;
-			perror("[vh_shm_wait_peers] Timeout while waiting for peer.");
-			break;
+		if (ds.shm_nattch == 2 && (ready_fd < 0 || ds.shm_lpid == pid
+					       || _pid_maps_seg(pid, segid)))
+			return 0;
+		if (timediff_us(ts) > VH_SHM_WAIT_TIMEOUT_US) {
+			eprintf("[vh_shm_wait_peers] Timeout while waiting for peer.\n");
+			return -1;
 		}
 	}
-	return rc;
 }
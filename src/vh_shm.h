@@ -24,8 +24,13 @@
 
 #include <sys/types.h>
 
-int _vh_shm_init(int key, size_t size, void **local_addr);
+#include <stddef.h>
+
+int _vh_shm_init(int key, size_t size, void **local_addr, int *backing);
+int _vh_shm_populate(void *local_addr, size_t size, int flags);
+int _vh_shm_mbind(void *local_addr, size_t size, int node);
+int _vh_numa_local_node(void);
 int _vh_shm_fini(int segid, void *local_addr);
-int vh_shm_wait_peers(pid_t pid, int segid);
+int vh_shm_wait_peers(pid_t pid, int segid, int ready_fd);
 
 #endif /* VEO_UDMA_VHSHM_INCLUDE */
@@ -19,6 +19,7 @@
  * Copyright (c) 2020 Erich Focht
  */
 
+#define _GNU_SOURCE
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <errno.h>
@@ -26,8 +27,10 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sched.h>
 #include <sys/time.h>
 #include <time.h>
+#include <fcntl.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
 #include <sys/ipc.h>
@@ -44,6 +47,8 @@
 #include "urpc_time.h"
 static int _urpc_num_peers = 0;
 static struct sigaction __reaper_sa = {0};
+// queue lengths learned by adaptive sizing, indexed by URPC_Q_*
+static int64_t _urpc_adapt_buff_len[2] = { 0, 0 };
 
 
 static void vh_urpc_comm_init(urpc_comm_t *uc, int64_t data_buff_end)
@@ -56,6 +61,11 @@ static void vh_urpc_comm_init(urpc_comm_t *uc, int64_t data_buff_end)
 	TQ_WRITE32(uc->tq->receiver_flags, 0);
 	TQ_WRITE64(uc->tq->last_put_req, -1);
 	TQ_WRITE64(uc->tq->last_get_req, -1);
+	TQ_WRITE64(uc->tq->alloc_fail, 0);
+	TQ_WRITE64(uc->tq->high_water, 0);
+	uc->alloc_fail = 0;
+	uc->high_water = 0;
+	uc->gc_runs = 0;
 	uc->mem[0].begin = 0;
 	uc->mem[0].end = data_buff_end;
 	uc->mem[1].begin = 0;
@@ -65,32 +75,157 @@ static void vh_urpc_comm_init(urpc_comm_t *uc, int64_t data_buff_end)
         pthread_mutex_init(&uc->lock, NULL);
 }
 
+static void _vh_urpc_peer_init(urpc_peer_t *up, int64_t *urpc_buff_len);
+
+/*
+  Fill the segment header which describes the layout of the segment
+  to the VE side.
+*/
+static void vh_urpc_shm_hdr_init(urpc_peer_t *up, int64_t *urpc_buff_len)
+{
+	urpc_shm_hdr_t *hdr = (urpc_shm_hdr_t *)up->shm_addr;
+
+	memset(hdr, 0, URPC_SHM_HDR_SIZE);
+	hdr->version = URPC_SHM_VERSION;
+	hdr->offs_shift = URPC_OFFSET_SHIFT;
+	hdr->backing = up->shm_backing;
+	hdr->stats_offs = URPC_SHM_STATS_OFFS;
+	hdr->q_offs[URPC_Q_VH2VE] = URPC_SHM_HDR_SIZE;
+	hdr->q_offs[URPC_Q_VE2VH] = URPC_SHM_HDR_SIZE + urpc_buff_len[URPC_Q_VH2VE];
+	for (int q = 0; q < 2; q++) {
+		hdr->q_len[q] = urpc_buff_len[q];
+		hdr->data_buff_len[q] = URPC_TQ_DATA_LEN(urpc_buff_len[q]);
+	}
+	// magic goes last, the header is valid from now on
+	hdr->magic = URPC_SHM_MAGIC;
+}
+
+/*
+  Read a buffer size from an environment variable. The value is in bytes
+  and may carry a K, M or G suffix.
+
+  Returns the size or 0 if the variable is not set or invalid.
+*/
+static int64_t _env_buff_len(const char *name)
+{
+	char *end;
+	const char *e = getenv(name);
+
+	if (e == NULL)
+		return 0;
+	int64_t len = strtoll(e, &end, 0);
+	switch (*end) {
+	case 'g': case 'G': len <<= 10;	// fall through
+	case 'm': case 'M': len <<= 10;	// fall through
+	case 'k': case 'K': len <<= 10;	// fall through
+	case '\0':
+		break;
+	default:
+		eprintf("invalid size in %s=%s, ignoring it\n", name, e);
+		return 0;
+	}
+	if (URPC_TQ_DATA_LEN(len) <= 4096) {
+		eprintf("%s=%s is too small, ignoring it\n", name, e);
+		return 0;
+	}
+	return len;
+}
+
+/*
+  Determine the queue length for one direction.
+
+  URPC_SEND_BUFF_LEN and URPC_RECV_BUFF_LEN (VH point of view) override
+  the default of VE_OMP_NUM_THREADS * URPC_BUFF_LEN_PER_THREADS. When
+  URPC_BUFF_ADAPTIVE is set, a length learned from previous peers is used
+  if it is larger.
+*/
+static int64_t _vh_urpc_buff_len(int q)
+{
+	int64_t len;
+	uint64_t omp_num_threads = -1;
+
+	len = _env_buff_len(q == URPC_Q_VH2VE ? "URPC_SEND_BUFF_LEN"
+			    : "URPC_RECV_BUFF_LEN");
+	if (len == 0) {
+		const char *e_omp_num_threads = getenv("VE_OMP_NUM_THREADS");
+		if (e_omp_num_threads != NULL) {
+			omp_num_threads = strtoull(e_omp_num_threads, NULL, 0);
+		}
+		if (omp_num_threads != (uint64_t)-1) {
+			len = omp_num_threads * URPC_BUFF_LEN_PER_THREADS;
+		} else {
+			len = 4 * URPC_BUFF_LEN_PER_THREADS;
+		}
+	}
+	if (getenv("URPC_BUFF_ADAPTIVE") && _urpc_adapt_buff_len[q] > len)
+		len = _urpc_adapt_buff_len[q];
+	if (len > URPC_MAX_DATA_BUFF_LEN) {
+		eprintf("veo_urpc_peer_create: buffer length %ld exceeds maximum, "
+			"using %ld\n", len, URPC_MAX_DATA_BUFF_LEN);
+		len = URPC_MAX_DATA_BUFF_LEN;
+	}
+	return ALIGN8B(len);
+}
+
+/*
+  Adaptive sizing: look at the allocation statistics of a finished peer
+  and grow the queue length for the next peer if the queue was too small.
+  Queues which saw allocation failures are doubled, queues whose use
+  exceeded URPC_ADAPT_HIGH_WATER_PCT grow by half.
+*/
+static void _vh_urpc_adapt(urpc_peer_t *up)
+{
+	urpc_shm_hdr_t *hdr = (urpc_shm_hdr_t *)up->shm_addr;
+	transfer_queue_t *tq[2];
+
+	tq[URPC_Q_VH2VE] = up->send.tq;
+	tq[URPC_Q_VE2VH] = up->recv.tq;
+	for (int q = 0; q < 2; q++) {
+		int64_t len = hdr->q_len[q];
+		int64_t end = hdr->data_buff_len[q] - 4096;
+
+		if (TQ_READ64(tq[q]->alloc_fail) > 0)
+			len *= 2;
+		else if (TQ_READ64(tq[q]->high_water) * 100 >
+			 end * URPC_ADAPT_HIGH_WATER_PCT)
+			len += len / 2;
+		if (len > URPC_MAX_DATA_BUFF_LEN)
+			len = URPC_MAX_DATA_BUFF_LEN;
+		if (len > _urpc_adapt_buff_len[q]) {
+			dprintf("adaptive buffer length q=%d: %ld -> %ld\n",
+				q, hdr->q_len[q], len);
+			_urpc_adapt_buff_len[q] = len;
+		}
+	}
+}
+
 /*
   VH side UDMA RPC communication init.
   
   - allocate shm seg for one peer
   - initialize VH side peer structure
+
+  The segment pages are populated at creation if URPC_SHM_PREFAULT is set
+  and locked if URPC_SHM_MLOCK is set. The backing that was used is
+  recorded in up->shm_backing.
+
+  numa_node: NUMA node to place the segment on, URPC_NUMA_LOCAL for the
+  node of the calling thread or URPC_NUMA_NONE for first touch placement.
  
   Returns: urpc_peer pointer if successful, NULL if failed.
 */
-urpc_peer_t *vh_urpc_peer_create(void)
+urpc_peer_t *vh_urpc_peer_create_numa(int numa_node)
 {
 	int rc = 0, i, peer_id;
 	char *env, *mb_offs = NULL;
+	int64_t urpc_buff_len[2];
 
-	uint64_t omp_num_threads = -1;
-	int64_t data_buff_end = 0, urpc_buff_len = 0;
-	const char *e_omp_num_threads = getenv("VE_OMP_NUM_THREADS");
-	if (e_omp_num_threads != NULL) {
-		omp_num_threads = atoi(e_omp_num_threads);
-	}
-	if (omp_num_threads != (uint64_t)-1) {
-		urpc_buff_len = omp_num_threads * URPC_BUFF_LEN_PER_THREADS;
-	} else {
-		urpc_buff_len = 4 * URPC_BUFF_LEN_PER_THREADS;
-	}
+	urpc_buff_len[URPC_Q_VH2VE] = _vh_urpc_buff_len(URPC_Q_VH2VE);
+	urpc_buff_len[URPC_Q_VE2VH] = _vh_urpc_buff_len(URPC_Q_VE2VH);
 
-	if (_urpc_num_peers == URPC_MAX_PEERS) {
+	// peers may be created concurrently, e.g. by a pool thread
+	if (__atomic_add_fetch(&_urpc_num_peers, 1, __ATOMIC_RELAXED) > URPC_MAX_PEERS) {
+		__atomic_sub_fetch(&_urpc_num_peers, 1, __ATOMIC_RELAXED);
 		eprintf("veo_urpc_peer_init: max number of urpc peers reached!\n");
 		errno = -ENOMEM;
 		return NULL;
@@ -98,61 +233,313 @@ urpc_peer_t *vh_urpc_peer_create(void)
 
 	urpc_peer_t *up = (urpc_peer_t *)malloc(sizeof(urpc_peer_t));
 	if (!up) {
+		__atomic_sub_fetch(&_urpc_num_peers, 1, __ATOMIC_RELAXED);
 		eprintf("veo_urpc_peer_create: malloc peer struct failed.\n");
 		errno = -ENOMEM;
 		return NULL;
 	}
 	memset(up, 0, sizeof(urpc_peer_t));
+	up->ready_fd = -1;
 
-	up->urpc_data_buff_len = urpc_buff_len - 8*(URPC_LEN_MB + 2);
-	data_buff_end = up->urpc_data_buff_len - 4096;
+	up->urpc_data_buff_len = URPC_TQ_DATA_LEN(urpc_buff_len[URPC_Q_VH2VE]);
 
 	/* TODO: make key VE and core specific to avoid duplicate use of UDMA */
 	up->shm_key = IPC_PRIVATE;
-	up->shm_size = 2 * urpc_buff_len;
+	up->shm_size = URPC_SHM_HDR_SIZE + urpc_buff_len[0] + urpc_buff_len[1];
+	up->shm_size = (up->shm_size + URPC_SHM_ALIGN - 1) & ~(URPC_SHM_ALIGN - 1);
 	/*
 	 * Allocate shared memory segment
 	 */
-	up->shm_segid = _vh_shm_init(up->shm_key, up->shm_size, &up->shm_addr);
+	up->shm_segid = _vh_shm_init(up->shm_key, up->shm_size, &up->shm_addr,
+				     &up->shm_backing);
 	if (up->shm_segid < 0) {
 		rc = _vh_shm_fini(up->shm_segid, up->shm_addr);
+		__atomic_sub_fetch(&_urpc_num_peers, 1, __ATOMIC_RELAXED);
+		free(up);
 		errno = -ENOMEM;
 		return NULL;
 	}
+	if (numa_node == URPC_NUMA_LOCAL)
+		numa_node = _vh_numa_local_node();
+	up->numa_node = URPC_NUMA_NONE;
+	if (numa_node >= 0 &&
+	    _vh_shm_mbind(up->shm_addr, up->shm_size, numa_node) == 0)
+		up->numa_node = numa_node;
+	int populate = 0;
+	if (getenv("URPC_SHM_PREFAULT"))
+		populate |= URPC_SHM_PREFAULTED;
+	if (getenv("URPC_SHM_MLOCK"))
+		populate |= URPC_SHM_LOCKED;
+	if (populate)
+		up->shm_backing |= _vh_shm_populate(up->shm_addr, up->shm_size,
+						    populate);
+	dprintf("peer shm segment %d: %s%s%s\n", up->shm_segid,
+		(up->shm_backing & URPC_SHM_HUGETLB) ? "hugetlb" : "regular pages + THP",
+		(up->shm_backing & URPC_SHM_PREFAULTED) ? ", prefaulted" : "",
+		(up->shm_backing & URPC_SHM_LOCKED) ? ", locked" : "");
+
+	_vh_urpc_peer_init(up, urpc_buff_len);
+	return up;
+}
 
-	_urpc_num_peers++;
+/*
+  Initialize the segment header, both communicators, the handler table
+  and the statistics of a peer whose segment is attached.
+*/
+static void _vh_urpc_peer_init(urpc_peer_t *up, int64_t *urpc_buff_len)
+{
+	vh_urpc_shm_hdr_init(up, urpc_buff_len);
+	urpc_shm_hdr_t *hdr = (urpc_shm_hdr_t *)up->shm_addr;
 
 	//
 	// Set up send communicator
 	//
-	up->send.tq = (transfer_queue_t *)up->shm_addr;
-	vh_urpc_comm_init(&up->send, data_buff_end);
+	up->send.tq = (transfer_queue_t *)(up->shm_addr + hdr->q_offs[URPC_Q_VH2VE]);
+	vh_urpc_comm_init(&up->send, hdr->data_buff_len[URPC_Q_VH2VE] - 4096);
 
     //
     // Set up recv communicator
     //
-    up->recv.tq = (transfer_queue_t *)(up->shm_addr + urpc_buff_len);
-	vh_urpc_comm_init(&up->recv, data_buff_end);
+    up->recv.tq = (transfer_queue_t *)(up->shm_addr + hdr->q_offs[URPC_Q_VE2VH]);
+	vh_urpc_comm_init(&up->recv, hdr->data_buff_len[URPC_Q_VE2VH] - 4096);
 
         pthread_mutex_init(&up->lock, NULL);
 
 	// initialize handler table
 	for (int i = 0; i <= URPC_MAX_HANDLERS; i++)
 		up->handler[i] = NULL;
+	up->stats = NULL;
+	up->poll = NULL;
+	up->stats_mem = NULL;
+	up->poll_mem = NULL;
+	up->ext = NULL;
+	up->batch = NULL;
+	urpc_shm_stats_init(up, (urpc_shm_stats_t *)(up->shm_addr + hdr->stats_offs), 0);
+	urpc_stats_init(up);
+	urpc_poll_stats_init(up);
+	urpc_trace_init(up);
+	urpc_run_handler_init_hooks(up);
+}
+
+/*
+  VH side peer creation with the NUMA policy taken from the environment.
+  URPC_NUMA_NODE can be a node number or "local".
+*/
+urpc_peer_t *vh_urpc_peer_create(void)
+{
+	int numa_node = URPC_NUMA_NONE;
+	const char *e = getenv("URPC_NUMA_NODE");
+
+	if (e) {
+		if (strcmp(e, "local") == 0)
+			numa_node = URPC_NUMA_LOCAL;
+		else
+			numa_node = atoi(e);
+	}
+	return vh_urpc_peer_create_numa(numa_node);
+}
+
+/*
+  Host loopback child mode: attach to the segment of a peer created by
+  another VH process, taking the role of the VE side. The child receives
+  on the VH -> VE queue and sends on the VE -> VH queue, with the same
+  code as the VH side. The segment ID is taken from the argument or, if
+  it is 0, from URPC_SHM_SEGID, which vh_urpc_child_create() sets.
+
+  Returns: urpc_peer pointer if successful, NULL if failed.
+*/
+urpc_peer_t *vh_urpc_peer_attach(int segid)
+{
+	char *e;
+
+	if (segid == 0) {
+		if ((e = getenv("URPC_SHM_SEGID")) == NULL) {
+			eprintf("env variable URPC_SHM_SEGID not found.\n");
+			errno = ENOENT;
+			return NULL;
+		}
+		segid = atol(e);
+	}
+	urpc_peer_t *up = (urpc_peer_t *)malloc(sizeof(urpc_peer_t));
+	if (!up) {
+		eprintf("vh_urpc_peer_attach: malloc peer struct failed.\n");
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(up, 0, sizeof(urpc_peer_t));
+	up->shm_segid = segid;
+	up->shm_addr = shmat(segid, NULL, 0);
+	if (up->shm_addr == (void *)-1) {
+		eprintf("vh_urpc_peer_attach: shmat segment %d failed: %s\n",
+			segid, strerror(errno));
+		free(up);
+		return NULL;
+	}
+	urpc_shm_hdr_t *hdr = (urpc_shm_hdr_t *)up->shm_addr;
+	if (hdr->magic != URPC_SHM_MAGIC || hdr->version != URPC_SHM_VERSION ||
+	    hdr->offs_shift != URPC_OFFSET_SHIFT) {
+		eprintf("shm segment %d has an unknown header, magic=%lx version=%u\n",
+			segid, hdr->magic, hdr->version);
+		shmdt(up->shm_addr);
+		free(up);
+		errno = EINVAL;
+		return NULL;
+	}
+	up->shm_size = URPC_SHM_HDR_SIZE + hdr->q_len[0] + hdr->q_len[1];
+	up->shm_backing = hdr->backing;
+	up->numa_node = URPC_NUMA_NONE;
+	up->child_pid = -1;
+	up->ready_fd = -1;
+	up->urpc_data_buff_len = hdr->data_buff_len[URPC_Q_VH2VE];
+
+	// roles swapped: the creator's send queue is our receive queue
+	up->recv.tq = (transfer_queue_t *)(up->shm_addr + hdr->q_offs[URPC_Q_VH2VE]);
+	up->send.tq = (transfer_queue_t *)(up->shm_addr + hdr->q_offs[URPC_Q_VE2VH]);
+	pthread_mutex_init(&up->recv.lock, NULL);
+	up->send.mem[0].end = up->send.data_buff_end =
+		hdr->data_buff_len[URPC_Q_VE2VH] - 4096;
+	up->send.active = &up->send.mem[0];
+	pthread_mutex_init(&up->send.lock, NULL);
+	pthread_mutex_init(&up->lock, NULL);
+
+	for (int i = 0; i <= URPC_MAX_HANDLERS; i++)
+		up->handler[i] = NULL;
+	up->stats = NULL;
+	up->poll = NULL;
+	up->stats_mem = NULL;
+	up->poll_mem = NULL;
+	up->ext = NULL;
+	up->batch = NULL;
+	urpc_shm_stats_init(up, (urpc_shm_stats_t *)(up->shm_addr + hdr->stats_offs), 1);
+	urpc_stats_init(up);
+	urpc_poll_stats_init(up);
+	urpc_trace_init(up);
 	urpc_run_handler_init_hooks(up);
 
+	urpc_signal_attached();
 	return up;
 }
 
+/*
+  Detach a peer attached with vh_urpc_peer_attach(). The segment belongs
+  to the creator and is not destroyed.
+*/
+int vh_urpc_peer_detach(urpc_peer_t *up)
+{
+	urpc_set_receiver_flags(&up->recv,
+				urpc_get_receiver_flags(&up->recv) | URPC_FLAG_EXITED);
+	urpc_set_sender_flags(&up->send,
+			      urpc_get_sender_flags(&up->send) | URPC_FLAG_EXITED);
+	_urpc_cnt_publish(&up->recv);
+	_urpc_cnt_publish(&up->send);
+	int rc = shmdt(up->shm_addr);
+	if (rc)
+		eprintf("vh_urpc_peer_detach: shmdt failed for peer %p\n", (void *)up);
+	urpc_stats_fini(up);
+	urpc_poll_stats_fini(up);
+	urpc_trace_fini(up);
+	urpc_handlers_fini(up);
+	free(up);
+	return rc;
+}
+
+/*
+  Placement hint for the thread driving the progress of a peer: restrict
+  the calling thread to the CPUs of the NUMA node the peer segment is on.
+
+  Return 0 if all went well, -errno if not.
+*/
+int vh_urpc_numa_bind_thread(urpc_peer_t *up)
+{
+	char path[64], buf[1024];
+	cpu_set_t set;
+	FILE *f;
+
+	if (up->numa_node < 0)
+		return -EINVAL;
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		 up->numa_node);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -errno;
+	if (fgets(buf, sizeof(buf), f) == NULL) {
+		fclose(f);
+		return -EIO;
+	}
+	fclose(f);
+
+	// cpulist format: "0-3,8,10-11"
+	CPU_ZERO(&set);
+	char *save;
+	for (char *p = strtok_r(buf, ",\n", &save); p; p = strtok_r(NULL, ",\n", &save)) {
+		int lo, hi;
+		int n = sscanf(p, "%d-%d", &lo, &hi);
+		if (n < 1)
+			continue;
+		if (n == 1)
+			hi = lo;
+		for (int c = lo; c <= hi && c < CPU_SETSIZE; c++)
+			CPU_SET(c, &set);
+	}
+	int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+	return -rc;
+}
+
 int vh_urpc_peer_destroy(urpc_peer_t *up)
 {
+	if (getenv("URPC_BUFF_ADAPTIVE"))
+		_vh_urpc_adapt(up);
 	int rc = _vh_shm_fini(up->shm_segid, up->shm_addr);
 	if (rc) {
           eprintf("vh_shm_fini failed for peer %p, rc=%d\n", (void *)up, rc);
 		return rc;
 	}
+	if (up->ready_fd >= 0)
+		close(up->ready_fd);
+	urpc_stats_fini(up);
+	urpc_poll_stats_fini(up);
+	urpc_trace_fini(up);
+	urpc_handlers_fini(up);
 	free(up);
-        _urpc_num_peers--;
+	__atomic_sub_fetch(&_urpc_num_peers, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+  Reset a peer for reuse with a new child, keeping its shm segment and the
+  pages already populated. The queues, the segment header, the handlers
+  and the statistics are initialized as in vh_urpc_peer_create(), handler
+  init hooks run again. The former child must have detached from the
+  segment, it is reaped if it exited.
+
+  Return 0 if all went well, -EBUSY if another process is still attached,
+  -errno if the segment can't be inspected.
+*/
+int vh_urpc_peer_reset(urpc_peer_t *up)
+{
+	urpc_shm_hdr_t *hdr = (urpc_shm_hdr_t *)up->shm_addr;
+	int64_t urpc_buff_len[2];
+	struct shmid_ds ds;
+
+	if (shmctl(up->shm_segid, IPC_STAT, &ds) < 0)
+		return -errno;
+	if (ds.shm_nattch > 1)
+		return -EBUSY;
+	if (up->child_pid > 0)
+		waitpid(up->child_pid, NULL, WNOHANG);
+	up->child_pid = 0;
+	if (up->ready_fd >= 0) {
+		close(up->ready_fd);
+		up->ready_fd = -1;
+	}
+
+	urpc_stats_fini(up);
+	urpc_poll_stats_fini(up);
+	urpc_trace_fini(up);
+	urpc_handlers_fini(up);
+	urpc_buff_len[URPC_Q_VH2VE] = hdr->q_len[URPC_Q_VH2VE];
+	urpc_buff_len[URPC_Q_VE2VH] = hdr->q_len[URPC_Q_VE2VH];
+	_vh_urpc_peer_init(up, urpc_buff_len);
 	return 0;
 }
 
@@ -160,10 +547,11 @@ static int argsexp(char *args, char **argv, int maxargs)
 {
 	int argc = 0;
 	
-	char *p2 = strtok(args, " ");
+	char *save;
+	char *p2 = strtok_r(args, " ", &save);
 	while (p2 && argc < maxargs-1) {
 		argv[argc++] = p2;
-		p2 = strtok(0, " ");
+		p2 = strtok_r(0, " ", &save);
 	}
 	argv[argc] = 0;
 	return argc;
@@ -176,6 +564,21 @@ static void handle_sigchld(int sig)
 	errno = saved_errno;
 }
 
+/*
+  Name of the ftrace output file of a VE child process.
+ */
+static void _ve_ftrace_out_name(char *buf, size_t len, const char *mpiuniverse,
+				const char *mpirank, int venode_id, pid_t pid)
+{
+	if (mpiuniverse != NULL && mpirank != NULL) {
+		snprintf(buf, len, "%s.%s.%s.%s.%d.%d",
+			"ftrace.out", mpiuniverse, mpirank, "veo", venode_id, pid);
+	} else {
+		snprintf(buf, len, "%s.%s.%d.%d",
+			"ftrace.out", "veo", venode_id, pid);
+	}
+}
+
 /*
   Set environment variable VE_FTRACE_OUT_NAME.
  */
@@ -183,38 +586,210 @@ void set_ve_ftrace_out_name(int venode_id)
 {
 	uint64_t len = 1024;
 	char filename[len];
-	const char *mpiuniverse = getenv("MPIUNIVERSE");
-	const char *mpirank = getenv("MPIRANK");
 
-	if (mpiuniverse != NULL && mpirank != NULL) {
-		snprintf(filename, len, "%s.%s.%s.%s.%d.%d",
-			"ftrace.out", mpiuniverse, mpirank, "veo", venode_id, getpid());
-	} else {
-		snprintf(filename, len, "%s.%s.%d.%d",
-			"ftrace.out", "veo", venode_id, getpid());
-	}
+	_ve_ftrace_out_name(filename, len, getenv("MPIUNIVERSE"), getenv("MPIRANK"),
+			    venode_id, getpid());
 	dprintf("VE_FTRACE_OUT_NAME = %s\n", filename);
 	setenv("VE_FTRACE_OUT_NAME", filename, 1);
 }
 
+#define URPC_CHILD_VARS 5
+#define URPC_CHILD_STACK (64 * 1024)
+
+/*
+  Everything the child needs between clone/fork and execve, prepared by
+  the parent such that the child neither allocates memory nor touches the
+  parent's environment. The VE_FTRACE_OUT_NAME entry contains the pid of
+  the child and is filled in by the child.
+ */
+struct child_launch {
+	char **argv;
+	char **envp;
+	char vars[URPC_CHILD_VARS][64];
+	char ftrace[1100];
+	const char *mpiuniverse, *mpirank;
+	int venode_id;
+	int ready_fd;			// write end of the handshake pipe
+	pid_t ppid;
+	sigset_t oldmask;
+	volatile int err;		// set by the child if it fails before exec
+};
+
+static int _env_is(const char *entry, const char *name)
+{
+	size_t n = strlen(name);
+	return strncmp(entry, name, n) == 0 && entry[n] == '=';
+}
+
+/*
+  Build the child environment: the current environment with the urpc
+  variables replaced.
+
+  Return 0 if all went well, -ENOMEM if not.
+ */
+static int _child_envp(struct child_launch *cl, urpc_peer_t *up,
+		       int venode_id, int ve_core)
+{
+	extern char **environ;
+	int n = 0, nvars = 0;
+
+	for (char **e = environ; *e; e++)
+		n++;
+	cl->envp = (char **)malloc((n + URPC_CHILD_VARS + 2) * sizeof(char *));
+	if (cl->envp == NULL)
+		return -ENOMEM;
+	n = 0;
+	for (char **e = environ; *e; e++) {
+		if (_env_is(*e, "URPC_SHM_SEGID") || _env_is(*e, "VE_NODE_NUMBER") ||
+		    _env_is(*e, "VE_FTRACE_OUT_NAME") || _env_is(*e, "URPC_DATA_BUFF_LEN") ||
+		    _env_is(*e, "URPC_READY_FD") ||
+		    (ve_core >= 0 && _env_is(*e, "URPC_VE_CORE")))
+			continue;
+		cl->envp[n++] = *e;
+	}
+	snprintf(cl->vars[nvars++], 64, "URPC_SHM_SEGID=%d", up->shm_segid);
+	snprintf(cl->vars[nvars++], 64, "VE_NODE_NUMBER=%d", venode_id);
+	if (ve_core >= 0)
+		snprintf(cl->vars[nvars++], 64, "URPC_VE_CORE=%d", ve_core);
+	snprintf(cl->vars[nvars++], 64, "URPC_DATA_BUFF_LEN=%ld", up->urpc_data_buff_len);
+	snprintf(cl->vars[nvars++], 64, "URPC_READY_FD=%d", cl->ready_fd);
+	for (int i = 0; i < nvars; i++)
+		cl->envp[n++] = cl->vars[i];
+	cl->envp[n++] = cl->ftrace;
+	cl->envp[n] = NULL;
+
+	cl->mpiuniverse = getenv("MPIUNIVERSE");
+	cl->mpirank = getenv("MPIRANK");
+	cl->venode_id = venode_id;
+	return 0;
+}
+
+/*
+  Child side of the launch, after clone or fork: reset the signal handlers
+  of the parent, arm the parent death signal, let the handshake pipe
+  survive the exec and exec the binary.
+ */
+static int _child_exec(void *arg)
+{
+	struct child_launch *cl = (struct child_launch *)arg;
+	size_t n = strlen("VE_FTRACE_OUT_NAME=");
+	struct sigaction sa;
+
+	for (int sig = 1; sig < _NSIG; sig++) {
+		if (sigaction(sig, NULL, &sa) < 0 || sa.sa_handler == SIG_IGN ||
+		    sa.sa_handler == SIG_DFL)
+			continue;
+		sa.sa_handler = SIG_DFL;
+		sa.sa_flags = 0;
+		sigaction(sig, &sa, NULL);
+	}
+	if (prctl(PR_SET_PDEATHSIG, SIGTERM) == -1) {
+		cl->err = errno;
+		_exit(127);
+	}
+	if (getppid() != cl->ppid)
+		_exit(1);
+	memcpy(cl->ftrace, "VE_FTRACE_OUT_NAME=", n);
+	_ve_ftrace_out_name(cl->ftrace + n, sizeof(cl->ftrace) - n, cl->mpiuniverse,
+			    cl->mpirank, cl->venode_id, getpid());
+	fcntl(cl->ready_fd, F_SETFD, 0);
+	sigprocmask(SIG_SETMASK, &cl->oldmask, NULL);
+	execve(cl->argv[0], cl->argv, cl->envp);
+	cl->err = errno;
+	_exit(127);
+}
+
+/*
+  Launch with clone(CLONE_VM | CLONE_VFORK): the page tables of the parent
+  are not copied, the launch time does not depend on the parent's memory
+  size. The child runs on its own small stack in our address space until
+  it execs, we are suspended until then. Handlers installed by the parent
+  must not run in the child, all signals stay blocked until the handlers
+  are reset.
+
+  Returns the pid of the child or -errno.
+ */
+static pid_t _child_spawn(struct child_launch *cl)
+{
+	sigset_t all;
+	pid_t pid;
+
+	char *stack = mmap(NULL, URPC_CHILD_STACK, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED)
+		return -errno;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &cl->oldmask);
+	pid = clone(&_child_exec, stack + URPC_CHILD_STACK,
+		    CLONE_VM | CLONE_VFORK | SIGCHLD, cl);
+	if (pid < 0)
+		pid = -errno;
+	pthread_sigmask(SIG_SETMASK, &cl->oldmask, NULL);
+	munmap(stack, URPC_CHILD_STACK);
+	return pid;
+}
+
+/*
+  Launch with fork(). The child detaches from our segment before the
+  parent goes on, such that only the real peer is counted in shm_nattch.
+
+  Returns the pid of the child or -errno.
+ */
+static pid_t _child_fork(struct child_launch *cl, urpc_peer_t *up)
+{
+	size_t pagesize = sysconf(_SC_PAGE_SIZE);
+	sem_t *sem = mmap(NULL, pagesize, PROT_READ | PROT_WRITE,
+			  MAP_ANONYMOUS | MAP_SHARED,
+			 -1, 0);
+	if (sem == MAP_FAILED) {
+		perror("ERROR: mmap");
+		return -ENOMEM;
+	}
+	sem_init(sem, 1, 0);
+	sigprocmask(SIG_SETMASK, NULL, &cl->oldmask);
+	pid_t c_pid = fork();
+	if (c_pid == 0) {
+		// this is the child
+		shmdt(up->shm_addr);
+		sem_post(sem);
+		_child_exec(cl);
+		/* Not Reached */
+	} else if (c_pid > 0) {
+		// this is the parent
+		sem_wait(sem);
+	} else
+		c_pid = -errno;
+	sem_destroy(sem);
+	munmap(sem, pagesize);
+	return c_pid;
+}
+
 /*
   Create a child process running the binary in the args. Create appropriate
   environment vars for the child process and store the pid of the new process.
   This process is supposed to be the remote peer process running on a VE and
   connecting to the VH that created the up.
 
+  The child is launched with clone(CLONE_VM | CLONE_VFORK), or with fork()
+  if URPC_CHILD_FORK is set. Its environment is built explicitly, it gets
+  SIGTERM when the calling thread exits.
+
+  The child inherits the write end of a pipe whose number is passed in
+  URPC_READY_FD, it reports the attach of the segment through it (see
+  urpc_wait_peer_attach()).
+
   Return 0 if all went well, -errno if not.
  */
 int vh_urpc_child_create(urpc_peer_t *up, char *binary,
                          int venode_id, int ve_core)
 {
-	int err;
+	struct child_launch cl;
 	struct stat sb;
 	int maxargs = 64;
 	char *argv[maxargs];
+	pid_t c_pid;
 
 	// exec binary
-	extern char** environ;
 	char *e;
 	e = getenv("URPC_VE_BIN");
 	if (!e)
@@ -224,6 +799,7 @@ int vh_urpc_child_create(urpc_peer_t *up, char *binary,
 
 	if (stat(argv[0], &sb) == -1) {
 		perror("stat");
+		free(args);
 		return -ENOENT;
 	}
 #if 0
@@ -241,67 +817,47 @@ int vh_urpc_child_create(urpc_peer_t *up, char *binary,
 	}
 #endif
 
-	size_t pagesize = sysconf(_SC_PAGE_SIZE);
-	sem_t *sem = mmap(NULL, pagesize, PROT_READ | PROT_WRITE,
-			  MAP_ANONYMOUS | MAP_SHARED,
-			 -1, 0);
-	if (sem == MAP_FAILED) {
-		perror("ERROR: mmap");
+	// attach handshake, only the write end survives the execve
+	int ready[2];
+	if (pipe2(ready, O_CLOEXEC) < 0) {
+		perror("ERROR: pipe2");
+		free(args);
+		return -errno;
+	}
+	if (up->ready_fd >= 0)
+		close(up->ready_fd);
+	up->ready_fd = -1;
+
+	memset(&cl, 0, sizeof(cl));
+	cl.argv = argv;
+	cl.ready_fd = ready[1];
+	cl.ppid = getpid();
+	if (_child_envp(&cl, up, venode_id, ve_core) < 0) {
+		free(args);
+		close(ready[0]);
+		close(ready[1]);
 		return -ENOMEM;
 	}
-	sem_init(sem, 1, 0);
-	pid_t p_pid = getpid();
-	pid_t c_pid = fork();
-	if (c_pid == 0) {
-		// this is the child
-		err = prctl(PR_SET_PDEATHSIG, SIGTERM);
-		if (err == -1) { 
-			perror("ERROR: prctl");
-			_exit(errno);
-		 }
-		if (getppid() != p_pid)
-			exit(1);
-
-		shmdt(up->shm_addr);
-		sem_post(sem);
-
-		// set env vars
-		char tmp[16];
-		sprintf(tmp, "%d", up->shm_segid);
-		setenv("URPC_SHM_SEGID", tmp, 1);
 
-		sprintf(tmp, "%d", venode_id);
-		setenv("VE_NODE_NUMBER", tmp, 1);
-		if (ve_core >= 0) {
-			sprintf(tmp, "%d", ve_core);
-			setenv("URPC_VE_CORE", tmp, 1);
-		}
-
-		// Set environment variable VE_FTRACE_OUT_NAME
-		set_ve_ftrace_out_name(venode_id);
-
-		// Set buff length
-		sprintf(tmp, "%d", up->urpc_data_buff_len);
-		setenv("URPC_DATA_BUFF_LEN", tmp, 1);
-
-		err = execve(argv[0], argv, environ);
-		if (err) {
-			perror("ERROR: execve");
-			_exit(errno);
-		}
-		/* Not Reached */
-	} else if (c_pid > 0) {
-		// this is the parent
-		free(args);
-		sem_wait(sem);
-		sem_destroy(sem);
-		munmap(sem, pagesize);
-		up->child_pid = c_pid;
-	} else {
-		// this is an error
-		perror("ERROR vh_urpc_child_create");
-		return -errno;
+	if (getenv("URPC_CHILD_FORK"))
+		c_pid = _child_fork(&cl, up);
+	else
+		c_pid = _child_spawn(&cl);
+	if (c_pid > 0 && cl.err) {
+		// with clone the child reports exec failures back to us
+		waitpid(c_pid, NULL, 0);
+		c_pid = -cl.err;
+	}
+	free(cl.envp);
+	free(args);
+	close(ready[1]);
+	if (c_pid < 0) {
+		eprintf("vh_urpc_child_create: %s\n", strerror(-c_pid));
+		close(ready[0]);
+		return c_pid;
 	}
+	up->ready_fd = ready[0];
+	up->child_pid = c_pid;
 	return 0;
 }
 
@@ -329,48 +885,77 @@ int vh_urpc_recv_progress(urpc_peer_t *up, int ncmds)
 	urpc_mb_t m;
 	void *payload = NULL;
 	size_t plen = 0;
+	URPC_STATS_DECL(t0);
+	URPC_POLL_DECL(tp);
 
+	URPC_POLL_START(up, tp);
 	while (done < ncmds) {
 		int64_t req = urpc_get_cmd(tq, &m);
 		if (req < 0)
 			break;
+		URPC_POLL_OCC(up, tq, req, done);
+		URPC_STATS_START(up, t0);
+		URPC_TRACE(up->trace, URPC_EV_GET, m.c.cmd, req, m.c.len);
+		if (up->batch && up->batch[m.c.cmd]) {
+			size_t bytes;
+			int n = urpc_batch_dispatch(up, &m, req, ncmds - done, &bytes);
+			URPC_STATS_END_N(up, m.c.cmd, n, bytes, t0);
+			uc->cnt.bytes += bytes;
+			done += n;
+			continue;
+		}
 		//
 		// set/receive payload, if needed
 		//
 		set_recv_payload(uc, &m, &payload, &plen);
+		URPC_TRACE(up->trace, URPC_EV_PAYLOAD, m.c.cmd, req, plen);
 		//
 		// call handler
 		//
 		func = up->handler[m.c.cmd];
 		if (func) {
+			URPC_TRACE(up->trace, URPC_EV_HANDLER_BEGIN, m.c.cmd, req, 1);
 			err = func(up, &m, req, payload, plen);
+			URPC_TRACE(up->trace, URPC_EV_HANDLER_END, m.c.cmd, req, err);
 			if (err)
 				eprintf("Warning: RPC handler %d returned %d\n",
 					m.c.cmd, err);
 		}
 
+		URPC_STATS_END(up, m.c.cmd, plen, t0);
+		uc->cnt.bytes += plen;
+		URPC_TRACE(up->trace, URPC_EV_SLOT_DONE, m.c.cmd, req, 0);
 		urpc_slot_done(tq, REQ2SLOT(req), &m);
 		++done;
 	}
+	URPC_POLL_END(up, done, tp);
+	_urpc_cnt_progress(up, done);
 	return done;
 }
 
 /*
-  Progress loop with timeout.
+  Progress loop with timeout: run until no command arrived for timeout_us.
+
+  Returns the number of commands done.
 */
 int vh_urpc_recv_progress_timeout(urpc_peer_t *up, int ncmds, long timeout_us)
 {
-	long done_ts = 0;
+	urpc_deadline_t d = {0};
+	int idle = 0, total = 0;
+
 	do {
 		int done = vh_urpc_recv_progress(up, ncmds);
 		if (done == 0) {
-			if (done_ts == 0)
-				done_ts = get_time_us();
-		} else
-			done_ts = 0;
-
-	} while (done_ts == 0 || timediff_us(done_ts) < timeout_us);
-
+			if (!idle) {
+				urpc_deadline_init(&d, timeout_us);
+				idle = 1;
+			}
+		} else {
+			total += done;
+			idle = 0;
+		}
+	} while (!idle || !urpc_deadline_passed(&d));
+	return total;
 }
 
 int64_t urpc_max_send_cmd_size(urpc_peer_t *up) {
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "urpc_common.h"
+
+/*
+  Payload allocator benchmark and randomized stress test. Does not need a
+  VE: payloads are allocated with alloc_payload() in the send queue of a
+  peer and put into the mailbox, a simulated consumer takes them out and
+  completes them in order with a configurable lag.
+
+  usage: bench_alloc_vh [-n ops] [-s dist] [-l lag] [-m max] [-r seed]
+
+  -s fixed:<size>                  all payloads of one size
+     bimodal:<small>:<large>:<p>   small with probability p, else large
+     pareto:<min>:<alpha>          heavy tailed, cut at max
+  -l <n> or <lo>:<hi>              commands in flight before the consumer
+                                   completes the oldest one, uniformly
+                                   drawn from [lo, hi] for each step
+  -m <max>                         largest payload, default 1/8 of the buffer
+
+  The buffer size is set with URPC_SEND_BUFF_LEN. Every allocation is
+  checked against all payloads in flight, overlaps and allocations outside
+  the buffer are reported as violations and make the test fail.
+*/
+
+enum { D_FIXED, D_BIMODAL, D_PARETO };
+
+static int dist = D_FIXED;
+static double d_a = 4096, d_b = 0, d_p = 0;
+static uint32_t maxsize;
+static int lag_lo = 16, lag_hi = 16;
+
+struct live {
+	uint64_t begin, end;
+};
+static struct live live[URPC_LEN_MB];	// by slot
+
+static uint32_t draw_size(void)
+{
+	double u = (rand() + 1.0) / ((double)RAND_MAX + 2.0), s;
+
+	switch (dist) {
+	case D_BIMODAL:
+		s = u < d_p ? d_a : d_b;
+		break;
+	case D_PARETO:
+		s = d_a / pow(u, 1.0 / d_b);
+		break;
+	default:
+		s = d_a;
+	}
+	if (s > maxsize)
+		s = maxsize;
+	if (s < 8)
+		s = 8;
+	return (uint32_t)s;
+}
+
+static int parse_dist(char *arg)
+{
+	if (sscanf(arg, "fixed:%lf", &d_a) == 1)
+		dist = D_FIXED;
+	else if (sscanf(arg, "bimodal:%lf:%lf:%lf", &d_a, &d_b, &d_p) == 3)
+		dist = D_BIMODAL;
+	else if (sscanf(arg, "pareto:%lf:%lf", &d_a, &d_b) == 2 && d_b > 0)
+		dist = D_PARETO;
+	else
+		return -1;
+	return 0;
+}
+
+static uint64_t live_bytes;
+static int inflight;
+
+/*
+  The consumer: take the oldest command out of the mailbox and mark it done.
+ */
+static void complete_oldest(transfer_queue_t *tq)
+{
+	urpc_mb_t c;
+	int64_t req = urpc_get_cmd(tq, &c);
+	int slot = REQ2SLOT(req);
+
+	live_bytes -= live[slot].end - live[slot].begin;
+	live[slot].begin = live[slot].end = 0;
+	urpc_slot_done(tq, slot, &c);
+	inflight--;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t nops = 1000000;
+	int opt, seed = 1;
+
+	while ((opt = getopt(argc, argv, "n:s:l:m:r:")) != -1) {
+		switch (opt) {
+		case 'n': nops = atol(optarg); break;
+		case 's':
+			if (parse_dist(optarg) < 0) {
+				fprintf(stderr, "invalid distribution %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'l':
+			if (sscanf(optarg, "%d:%d", &lag_lo, &lag_hi) != 2)
+				lag_hi = lag_lo = atoi(optarg);
+			break;
+		case 'm': maxsize = atol(optarg); break;
+		case 'r': seed = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-n ops] [-s dist] [-l lag] [-m max] "
+				"[-r seed]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (lag_lo < 0)
+		lag_lo = 0;
+	if (lag_hi > URPC_LEN_MB - 1)
+		lag_hi = URPC_LEN_MB - 1;
+	if (lag_hi < lag_lo)
+		lag_hi = lag_lo;
+	srand(seed);
+
+	urpc_peer_t *up = vh_urpc_peer_create();
+	uint64_t *lat = malloc(nops * sizeof(uint64_t));
+	if (up == NULL || lat == NULL) {
+		printf("setup failed\n");
+		return 1;
+	}
+	urpc_comm_t *uc = &up->send;
+	transfer_queue_t *tq = uc->tq;
+	if (maxsize == 0 || maxsize > uc->data_buff_end)
+		maxsize = uc->data_buff_end / 8;
+
+	uint64_t fails = 0, violations = 0;
+	double util_sum = 0.0, util_fail_sum = 0.0, util_max = 0.0;
+
+	for (uint64_t op = 0; op < nops; op++) {
+		uint32_t size = draw_size();
+		int lag = lag_lo + (lag_hi > lag_lo ? rand() % (lag_hi - lag_lo + 1) : 0);
+		urpc_mb_t m;
+
+		while (inflight > lag)
+			complete_oldest(tq);
+
+		uint64_t t0 = get_cycles();
+		m.u64 = alloc_payload(uc, size);
+		uint64_t t1 = get_cycles();
+		while (m.u64 == 0) {
+			fails++;
+			util_fail_sum += (double)live_bytes / uc->data_buff_end;
+			if (inflight == 0) {
+				printf("allocation of %u bytes failed with an empty buffer\n",
+				       size);
+				return 1;
+			}
+			// make the consumer complete one more request
+			complete_oldest(tq);
+			t0 = get_cycles();
+			m.u64 = alloc_payload(uc, size);
+			t1 = get_cycles();
+		}
+		lat[op] = t1 - t0;
+
+		// invariants: inside the buffer, no overlap with payloads in flight
+		uint64_t b = MB_OFFS(&m), e = b + ALIGN8B(size);
+		if (e > (uint64_t)uc->data_buff_end || m.c.len != size)
+			violations++;
+		for (int slot = 0; slot < URPC_LEN_MB; slot++) {
+			struct live *l = &live[slot];
+			if (b < l->end && l->begin < e) {
+				if (violations < 10)
+					printf("op %lu: [%lu,%lu) overlaps slot %d [%lu,%lu)\n",
+					       op, b, e, slot, l->begin, l->end);
+				violations++;
+			}
+		}
+
+		m.c.cmd = 1;
+		int64_t req = urpc_put_cmd(up, &m);
+		int slot = REQ2SLOT(req);
+		live[slot].begin = b;
+		live[slot].end = e;
+		live_bytes += e - b;
+		inflight++;
+
+		double util = (double)live_bytes / uc->data_buff_end;
+		util_sum += util;
+		if (util > util_max)
+			util_max = util;
+	}
+
+	qsort(lat, nops, sizeof(uint64_t), cmp_u64);
+	printf("buffer %ld bytes, max payload %u, lag %d..%d, %lu ops\n",
+	       uc->data_buff_end, maxsize, lag_lo, lag_hi, nops);
+	printf("alloc latency [ns]: p50 %lu p99 %lu p99.9 %lu max %lu\n",
+	       urpc_cycles_to_ns(lat[nops / 2]), urpc_cycles_to_ns(lat[nops * 99 / 100]),
+	       urpc_cycles_to_ns(lat[nops * 999 / 1000]), urpc_cycles_to_ns(lat[nops - 1]));
+	printf("gc runs %lu (%.2f per 1000 allocs), failed allocs %lu (%.3f%%)\n",
+	       uc->gc_runs, 1000.0 * uc->gc_runs / nops, fails, 100.0 * fails / nops);
+	printf("buffer utilization: mean %.1f%% max %.1f%%, at failed allocs %.1f%%\n",
+	       100.0 * util_sum / nops, 100.0 * util_max,
+	       fails ? 100.0 * util_fail_sum / fails : 0.0);
+	printf("invariant violations: %lu\n", violations);
+
+	while (inflight > 0)
+		complete_oldest(tq);
+	vh_urpc_peer_destroy(up);
+	free(lat);
+	return violations ? 1 : 0;
+}
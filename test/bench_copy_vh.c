@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "urpc.h"
+
+/*
+  Bandwidth of the payload copy methods. Does not need a VE.
+
+  usage: bench_copy_vh [max_size [total_bytes]]
+
+  Copies buffers of increasing size (4kB up to max_size, default 64MB) until
+  total_bytes (default 1GB) are moved per size and method. The destination
+  rotates through a buffer larger than the last level cache, like the data
+  buffer of a peer does. Set URPC_COPY_THREADS to measure the parallel copy.
+*/
+
+static const char *method_name[] = { "auto", "memcpy", "nt", "parallel" };
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t max_size = 64UL << 20, total = 1UL << 30;
+
+	if (argc > 1)
+		max_size = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		total = strtoul(argv[2], NULL, 0);
+
+	size_t dlen = 4 * max_size > (256UL << 20) ? 4 * max_size : (256UL << 20);
+	char *src = aligned_alloc(4096, max_size);
+	char *dst = aligned_alloc(4096, dlen);
+	if (src == NULL || dst == NULL) {
+		printf("allocation failed\n");
+		return 1;
+	}
+	memset(src, 0x5a, max_size);
+	memset(dst, 0, dlen);
+
+	printf("streaming stores: %s\n", urpc_memcpy_info());
+	printf("%12s", "size");
+	for (int m = 0; m < 4; m++)
+		printf(" %10s", method_name[m]);
+	printf("   [GB/s]\n");
+
+	int err = 0;
+	for (size_t size = 4096; size <= max_size; size *= 2) {
+		long iter = total / size;
+		if (iter < 4)
+			iter = 4;
+		printf("%12lu", size);
+		for (int m = 0; m < 4; m++) {
+			size_t off = 0;
+			double t0 = now();
+			for (long i = 0; i < iter; i++) {
+				if (off + size > dlen)
+					off = 0;
+				urpc_memcpy_method(m, dst + off, src, size);
+				off += size;
+			}
+			double t = now() - t0;
+			if (memcmp(dst + off - size, src, size) != 0)
+				err++;
+			printf(" %10.2f", (double)iter * size / t * 1e-9);
+		}
+		printf("\n");
+	}
+	free(src);
+	free(dst);
+	if (err)
+		printf("%d copies were corrupted\n", err);
+	return err ? 1 : 0;
+}
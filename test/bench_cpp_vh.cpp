@@ -0,0 +1,101 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "urpc.hpp"
+#include "urpc_time.h"
+
+/*
+  Microbenchmark of the typed C++ pack/unpack against urpc_generic_send()
+  and urpc_unpack_payload(). Does not need a VE: the commands are sent on
+  the VH send queue and consumed from the same queue in this process.
+
+  usage: bench_cpp_vh [nloop [bufsize]]
+*/
+
+#define CMD_C   5
+#define CMD_CPP 6
+
+using Cmd = urpc::command<CMD_CPP, uint32_t, uint64_t, uint64_t, urpc::buffer>;
+
+static uint64_t sum = 0;
+
+static int c_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+		     void *payload, size_t plen)
+{
+	uint32_t a;
+	uint64_t b, c;
+	void *p;
+	size_t sz;
+
+	urpc_unpack_payload(payload, plen, (char *)"IxLLP", &a, &b, &c, &p, &sz);
+	sum += a + b + c + sz;
+	return 0;
+}
+
+static int cpp_handler(urpc_peer_t *up, int64_t req, uint32_t a, uint64_t b,
+		       uint64_t c, urpc::buffer buf)
+{
+	sum += a + b + c + buf.len;
+	return 0;
+}
+
+// consume the commands sent by ourselves
+static void drain(urpc_peer_t *up)
+{
+	urpc_comm_t *uc = &up->send;
+	urpc_mb_t m;
+	void *payload;
+	size_t plen;
+	int64_t req;
+
+	while ((req = urpc_get_cmd(uc->tq, &m)) >= 0) {
+		set_recv_payload(uc, &m, &payload, &plen);
+		up->handler[m.c.cmd](up, &m, req, payload, plen);
+		urpc_slot_done(uc->tq, REQ2SLOT(req), &m);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int nloop = argc > 1 ? atoi(argv[1]) : 1000000;
+	size_t bufsize = argc > 2 ? atol(argv[2]) : 64;
+	char *buf = (char *)calloc(1, bufsize + 1);
+	long ts, te;
+
+	urpc::Peer peer;
+	urpc_register_handler(peer.get(), CMD_C, &c_handler);
+	peer.handle<Cmd, &cpp_handler>();
+
+	for (int pass = 0; pass < 2; pass++) {
+		ts = get_time_us();
+		for (int i = 0; i < nloop; i++) {
+			urpc_generic_send(peer.get(), CMD_C, (char *)"IxLLP",
+					  (uint32_t)i, (uint64_t)i, (uint64_t)i,
+					  buf, bufsize);
+			if ((i & 63) == 63)
+				drain(peer.get());
+		}
+		drain(peer.get());
+		te = get_time_us();
+		if (pass)
+			printf("C   generic send+unpack: %8.1f ns/op\n",
+			       (double)(te - ts) * 1000.0 / nloop);
+
+		ts = get_time_us();
+		for (int i = 0; i < nloop; i++) {
+			peer.send<Cmd>((uint32_t)i, (uint64_t)i, (uint64_t)i,
+				       urpc::buffer{buf, bufsize});
+			if ((i & 63) == 63)
+				drain(peer.get());
+		}
+		drain(peer.get());
+		te = get_time_us();
+		if (pass)
+			printf("C++ typed send+unpack:   %8.1f ns/op\n",
+			       (double)(te - ts) * 1000.0 / nloop);
+	}
+	printf("checksum %lu\n", sum);
+	free(buf);
+	return 0;
+}
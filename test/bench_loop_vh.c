@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "urpc.h"
+#include "urpc_time.h"
+
+/*
+  Latency and throughput of the urpc protocol between two host processes.
+  Does not need a VE: the peer is this binary, started again in host
+  loopback child mode with vh_urpc_child_create() and attached to the
+  segment with vh_urpc_peer_attach().
+
+  usage: bench_loop_vh [-n msgs] [-s sizes] [-d depths] [-b batches]
+
+  sizes, depths and batches are comma separated lists, all combinations
+  are measured. depth is the number of requests in flight (at most
+  URPC_LEN_MB), batch the number of commands the child takes per progress
+  call; batches > 1 use a batch handler. The child answers each request
+  with a small reply, the latency is measured from sending a request to
+  handling its reply.
+
+  The result is a JSON array on stdout, one object per combination.
+  With less than two CPUs both processes yield the CPU when they find
+  nothing to do, the latencies are then dominated by the scheduler.
+*/
+
+#define CMD_REQ   5
+#define CMD_REQ_B 6
+#define CMD_CONF  7
+#define CMD_EXIT  8
+#define CMD_REPLY 9
+
+#define MAX_LIST 32
+
+static uint64_t t_send[URPC_LEN_MB];
+static uint64_t *lat;
+static uint64_t nlat, warm;
+static int inflight;
+static int child_batch = 1, child_done = 0;
+static int yield_idle;
+
+static void progress(urpc_peer_t *up, int ncmds)
+{
+	if (vh_urpc_recv_progress(up, ncmds) == 0 && yield_idle)
+		sched_yield();
+}
+
+/* child side */
+
+static int req_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+		       void *payload, size_t plen)
+{
+	uint64_t seq;
+	void *p;
+	size_t sz;
+
+	urpc_unpack_payload(payload, plen, (char *)"LP", &seq, &p, &sz);
+	// the parent frees the reply buffers, retry until it did
+	while (urpc_generic_send(up, CMD_REPLY, (char *)"L", seq) < 0);
+	return 0;
+}
+
+static int req_batch_handler(urpc_peer_t *up, int n, urpc_mb_t *m, int64_t *req,
+			     void **payload, size_t *plen)
+{
+	for (int i = 0; i < n; i++)
+		req_handler(up, &m[i], req[i], payload[i], plen[i]);
+	return 0;
+}
+
+static int conf_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			void *payload, size_t plen)
+{
+	uint64_t seq, batch;
+
+	urpc_unpack_payload(payload, plen, (char *)"LL", &seq, &batch);
+	child_batch = (int)batch;
+	while (urpc_generic_send(up, CMD_REPLY, (char *)"L", seq) < 0);
+	return 0;
+}
+
+static int exit_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			void *payload, size_t plen)
+{
+	child_done = 1;
+	return 0;
+}
+
+static int child(void)
+{
+	urpc_peer_t *up = vh_urpc_peer_attach(0);
+
+	if (up == NULL)
+		return 1;
+	urpc_register_handler(up, CMD_REQ, &req_handler);
+	urpc_register_batch_handler(up, CMD_REQ_B, &req_batch_handler);
+	urpc_register_handler(up, CMD_CONF, &conf_handler);
+	urpc_register_handler(up, CMD_EXIT, &exit_handler);
+	while (!child_done)
+		progress(up, child_batch);
+	vh_urpc_peer_detach(up);
+	return 0;
+}
+
+/* parent side */
+
+static int reply_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			 void *payload, size_t plen)
+{
+	uint64_t seq;
+
+	urpc_unpack_payload(payload, plen, (char *)"L", &seq);
+	if (seq >= warm && lat)
+		lat[nlat++] = get_cycles() - t_send[seq % URPC_LEN_MB];
+	inflight--;
+	return 0;
+}
+
+static void send_req(urpc_peer_t *up, int cmd, uint64_t seq, void *buf, size_t size)
+{
+	t_send[seq % URPC_LEN_MB] = get_cycles();
+	while (urpc_generic_send(up, cmd, (char *)"LP", seq, buf, size) < 0)
+		progress(up, URPC_LEN_MB);
+	inflight++;
+}
+
+static void drain(urpc_peer_t *up)
+{
+	while (inflight > 0)
+		progress(up, URPC_LEN_MB);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double pct(double p)
+{
+	if (nlat == 0)
+		return 0.0;
+	uint64_t i = (uint64_t)(p / 100.0 * (nlat - 1));
+	return (double)urpc_cycles_to_ns(lat[i]);
+}
+
+static void run(urpc_peer_t *up, uint64_t n, size_t size, int depth, int batch,
+		char *buf, int first)
+{
+	int cmd = batch > 1 ? CMD_REQ_B : CMD_REQ;
+
+	// configure the child, the reply is not measured
+	lat = NULL;
+	warm = UINT64_MAX;
+	while (urpc_generic_send(up, CMD_CONF, (char *)"LL", 0UL, (uint64_t)batch) < 0)
+		progress(up, URPC_LEN_MB);
+	inflight++;
+	drain(up);
+
+	warm = n / 10 < 1000 ? n / 10 : 1000;
+	nlat = 0;
+	lat = (uint64_t *)malloc(n * sizeof(uint64_t));
+	uint64_t t0 = 0;
+	for (uint64_t seq = 0; seq < warm + n; seq++) {
+		if (seq == warm)
+			t0 = get_cycles();
+		while (inflight >= depth)
+			progress(up, URPC_LEN_MB);
+		send_req(up, cmd, seq, buf, size);
+	}
+	drain(up);
+	double secs = urpc_cycles_to_ns(get_cycles() - t0) / 1e9;
+
+	qsort(lat, nlat, sizeof(uint64_t), cmp_u64);
+	printf("%s  {\"size\": %lu, \"depth\": %d, \"batch\": %d, \"msgs\": %lu, "
+	       "\"msgs_per_s\": %.0f, \"MB_per_s\": %.1f, \"lat_ns\": {\"p50\": %.0f, "
+	       "\"p90\": %.0f, \"p99\": %.0f, \"p999\": %.0f, \"max\": %.0f}}",
+	       first ? "" : ",\n", size, depth, batch, n, n / secs,
+	       n * (double)size / secs / 1e6, pct(50), pct(90), pct(99), pct(99.9),
+	       pct(100));
+	fflush(stdout);
+	free(lat);
+	lat = NULL;
+}
+
+static int parse_list(char *s, long *v)
+{
+	int n = 0;
+
+	for (char *p = strtok(s, ","); p && n < MAX_LIST; p = strtok(NULL, ","))
+		v[n++] = atol(p);
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	long sizes[MAX_LIST] = { 8, 64, 1024, 16384, 262144 };
+	long depths[MAX_LIST] = { 1, 16, 128 };
+	long batches[MAX_LIST] = { 1, 16 };
+	int nsizes = 5, ndepths = 3, nbatches = 2;
+	uint64_t n = 100000;
+	int opt;
+
+	yield_idle = sysconf(_SC_NPROCESSORS_ONLN) < 2;
+	if (argc > 1 && strcmp(argv[1], "--child") == 0)
+		return child();
+
+	while ((opt = getopt(argc, argv, "n:s:d:b:")) != -1) {
+		switch (opt) {
+		case 'n': n = atol(optarg); break;
+		case 's': nsizes = parse_list(optarg, sizes); break;
+		case 'd': ndepths = parse_list(optarg, depths); break;
+		case 'b': nbatches = parse_list(optarg, batches); break;
+		default:
+			fprintf(stderr, "usage: %s [-n msgs] [-s sizes] [-d depths] "
+				"[-b batches]\n", argv[0]);
+			return 1;
+		}
+	}
+	size_t maxsize = 0;
+	for (int i = 0; i < nsizes; i++)
+		if (sizes[i] > maxsize)
+			maxsize = sizes[i];
+	char *buf = (char *)calloc(1, maxsize + 1);
+
+	urpc_peer_t *up = vh_urpc_peer_create();
+	if (up == NULL || buf == NULL) {
+		fprintf(stderr, "setup failed\n");
+		return 1;
+	}
+	urpc_register_handler(up, CMD_REPLY, &reply_handler);
+
+	char self[1024], cmdline[1100];
+	ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len < 0) {
+		perror("readlink");
+		return 1;
+	}
+	self[len] = 0;
+	snprintf(cmdline, sizeof(cmdline), "%s --child", self);
+	if (vh_urpc_child_create(up, cmdline, 0, -1) != 0
+	    || urpc_wait_peer_attach(up) != 0) {
+		fprintf(stderr, "starting the child failed\n");
+		return 1;
+	}
+
+	int first = 1;
+	printf("[\n");
+	for (int s = 0; s < nsizes; s++)
+		for (int d = 0; d < ndepths; d++)
+			for (int b = 0; b < nbatches; b++) {
+				int depth = depths[d] < 1 ? 1 : depths[d] > URPC_LEN_MB
+					? URPC_LEN_MB : depths[d];
+				run(up, n, sizes[s], depth, batches[b], buf, first);
+				first = 0;
+			}
+	printf("\n]\n");
+
+	urpc_generic_send(up, CMD_EXIT, (char *)"");
+	waitpid(up->child_pid, NULL, 0);
+	vh_urpc_peer_destroy(up);
+	free(buf);
+	return 0;
+}
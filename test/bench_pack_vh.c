@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "urpc_common.h"
+
+/*
+  Cost of packing and unpacking payloads, separated from the transport.
+  Does not need a VE: commands are sent into the send queue of a peer and
+  taken out again by the same process, like in bench_alloc_vh.
+
+  usage: bench_pack_vh [-n ops] [-s sizes] [-c cases] [-p packers]
+
+  -n  operations per measurement (default 200000)
+  -s  comma separated buffer sizes for the cases with a buffer
+      (default 64,1024,16384)
+  -c  comma separated case names, default all: I IxL LLLLP P many AD
+  -p  comma separated packers, default all:
+        generic   urpc_generic_send() / urpc_unpack_payload(), format
+                  string parsed on each call
+        compiled  urpc_send_fmt() / urpc_unpack_fmt() with a format
+                  compiled once by urpc_fmt_compile()
+        raw       hand written packing into urpc_alloc_send_payload()
+                  and urpc_submit_send(), the baseline for the others
+
+  "send" is the time from the start of the send call until the command is
+  in the mailbox, it includes the payload allocation and urpc_put_cmd().
+  The difference to the "raw" packer is the cost of the format handling.
+  "unpack" only times the unpack calls. Bytes per cycle are computed from
+  the payload length and the cycle counter. The unpacked values are
+  checked, mismatches are counted as errors and make the run fail.
+
+  Other packers are added by extending the pack_send() and unpack()
+  switches.
+*/
+
+#define CMD 5
+#define BATCH 128	// commands in flight between send and unpack phases
+#define MAX_LIST 16
+#define NMANY 8		// many: NMANY each of I, L and D
+
+enum { P_GENERIC, P_COMPILED, P_RAW, P_NUM };
+static const char *pname[P_NUM] = { "generic", "compiled", "raw" };
+
+enum { C_I, C_IXL, C_LLLLP, C_P, C_MANY, C_AD, C_NUM };
+static const char *cname[C_NUM] = { "I", "IxL", "LLLLP", "P", "many", "AD" };
+static const char *cfmt[C_NUM] = {
+	"I", "IxL", "LLLLP", "P", "IIIIIIIILLLLLLLLDDDDDDDD", "AD" };
+static const int csized[C_NUM] = { 0, 0, 1, 1, 0, 1 };
+
+static urpc_fmt_t *cf[C_NUM];
+static char *buf;
+static uint64_t errors;
+
+static int64_t pack_send(urpc_peer_t *up, int p, int c, uint64_t v, size_t size)
+{
+	uint32_t u = (uint32_t)v;
+	double d = (double)v;
+
+	if (p == P_GENERIC) {
+		char *fmt = (char *)cfmt[c];
+		switch (c) {
+		case C_I:
+			return urpc_generic_send(up, CMD, fmt, u);
+		case C_IXL:
+			return urpc_generic_send(up, CMD, fmt, u, v);
+		case C_LLLLP:
+			return urpc_generic_send(up, CMD, fmt, v, v, v, v, buf, size);
+		case C_P:
+			return urpc_generic_send(up, CMD, fmt, buf, size);
+		case C_MANY:
+			return urpc_generic_send(up, CMD, fmt, u, u, u, u, u, u, u, u,
+						 v, v, v, v, v, v, v, v,
+						 d, d, d, d, d, d, d, d);
+		case C_AD:
+			return urpc_generic_send(up, CMD, fmt, buf, size / 8);
+		}
+	} else if (p == P_COMPILED) {
+		urpc_fmt_t *f = cf[c];
+		switch (c) {
+		case C_I:
+			return urpc_send_fmt(up, CMD, f, u);
+		case C_IXL:
+			return urpc_send_fmt(up, CMD, f, u, v);
+		case C_LLLLP:
+			return urpc_send_fmt(up, CMD, f, v, v, v, v, buf, size);
+		case C_P:
+			return urpc_send_fmt(up, CMD, f, buf, size);
+		case C_MANY:
+			return urpc_send_fmt(up, CMD, f, u, u, u, u, u, u, u, u,
+					     v, v, v, v, v, v, v, v,
+					     d, d, d, d, d, d, d, d);
+		case C_AD:
+			return urpc_send_fmt(up, CMD, f, buf, size / 8);
+		}
+	}
+
+	// raw: same payload layout, written by hand
+	urpc_mb_t mb;
+	size_t len = 0;
+	switch (c) {
+	case C_I: len = 4; break;
+	case C_IXL: len = 16; break;
+	case C_LLLLP: len = 40 + size; break;
+	case C_P: len = 8 + size; break;
+	case C_MANY: len = NMANY * 20; break;
+	case C_AD: len = 8 + size / 8 * 8; break;
+	}
+	char *pp = (char *)urpc_alloc_send_payload(&up->send, ALIGN8B(len), &mb);
+	if (pp == NULL)
+		return -EAGAIN;
+	mb.c.cmd = CMD;
+	switch (c) {
+	case C_I:
+		*(uint32_t *)pp = u;
+		break;
+	case C_IXL:
+		*(uint32_t *)pp = u;
+		*(uint64_t *)(pp + 8) = v;
+		break;
+	case C_LLLLP:
+		for (int i = 0; i < 4; i++)
+			((uint64_t *)pp)[i] = v;
+		*(uint64_t *)(pp + 32) = size;
+		memcpy(pp + 40, buf, size);
+		break;
+	case C_P:
+		*(uint64_t *)pp = size;
+		memcpy(pp + 8, buf, size);
+		break;
+	case C_MANY:
+		for (int i = 0; i < NMANY; i++) {
+			((uint32_t *)pp)[i] = u;
+			((uint64_t *)(pp + 4 * NMANY))[i] = v;
+			((double *)(pp + 12 * NMANY))[i] = d;
+		}
+		break;
+	case C_AD:
+		*(uint64_t *)pp = size / 8;
+		memcpy(pp + 8, buf, size / 8 * 8);
+		break;
+	}
+	return urpc_submit_send(up, &mb, len);
+}
+
+/*
+  Unpack and check the values, returns a value depending on the buffer
+  content such that the compiler can't drop the buffer access.
+ */
+static uint64_t unpack(int p, int c, void *payload, size_t plen, uint64_t v, size_t size)
+{
+	uint32_t u[NMANY];
+	uint64_t l[NMANY];
+	double d[NMANY];
+	void *bp = NULL;
+	size_t bsz = 0;
+	int rc = 0, bad = 0;
+
+	if (p == P_RAW) {
+		char *pp = (char *)payload;
+		switch (c) {
+		case C_I:
+			u[0] = *(uint32_t *)pp;
+			break;
+		case C_IXL:
+			u[0] = *(uint32_t *)pp;
+			l[0] = *(uint64_t *)(pp + 8);
+			break;
+		case C_LLLLP:
+			for (int i = 0; i < 4; i++)
+				l[i] = ((uint64_t *)pp)[i];
+			bsz = *(uint64_t *)(pp + 32);
+			bp = pp + 40;
+			break;
+		case C_P:
+		case C_AD:
+			bsz = *(uint64_t *)pp;
+			bp = pp + 8;
+			break;
+		case C_MANY:
+			for (int i = 0; i < NMANY; i++) {
+				u[i] = ((uint32_t *)pp)[i];
+				l[i] = ((uint64_t *)(pp + 4 * NMANY))[i];
+				d[i] = ((double *)(pp + 12 * NMANY))[i];
+			}
+			break;
+		}
+	} else {
+		char *fmt = (char *)cfmt[c];
+		urpc_fmt_t *f = cf[c];
+		int gen = p == P_GENERIC;
+		switch (c) {
+		case C_I:
+			rc = gen ? urpc_unpack_payload(payload, plen, fmt, &u[0])
+				: urpc_unpack_fmt(payload, plen, f, &u[0]);
+			break;
+		case C_IXL:
+			rc = gen ? urpc_unpack_payload(payload, plen, fmt, &u[0], &l[0])
+				: urpc_unpack_fmt(payload, plen, f, &u[0], &l[0]);
+			break;
+		case C_LLLLP:
+			rc = gen ? urpc_unpack_payload(payload, plen, fmt, &l[0], &l[1],
+						       &l[2], &l[3], &bp, &bsz)
+				: urpc_unpack_fmt(payload, plen, f, &l[0], &l[1],
+						  &l[2], &l[3], &bp, &bsz);
+			break;
+		case C_P:
+		case C_AD:
+			rc = gen ? urpc_unpack_payload(payload, plen, fmt, &bp, &bsz)
+				: urpc_unpack_fmt(payload, plen, f, &bp, &bsz);
+			break;
+		case C_MANY:
+			rc = gen ? urpc_unpack_payload(payload, plen, fmt,
+				&u[0], &u[1], &u[2], &u[3], &u[4], &u[5], &u[6], &u[7],
+				&l[0], &l[1], &l[2], &l[3], &l[4], &l[5], &l[6], &l[7],
+				&d[0], &d[1], &d[2], &d[3], &d[4], &d[5], &d[6], &d[7])
+				: urpc_unpack_fmt(payload, plen, f,
+				&u[0], &u[1], &u[2], &u[3], &u[4], &u[5], &u[6], &u[7],
+				&l[0], &l[1], &l[2], &l[3], &l[4], &l[5], &l[6], &l[7],
+				&d[0], &d[1], &d[2], &d[3], &d[4], &d[5], &d[6], &d[7]);
+			break;
+		}
+	}
+
+	switch (c) {
+	case C_I:
+		bad = u[0] != (uint32_t)v;
+		break;
+	case C_IXL:
+		bad = u[0] != (uint32_t)v || l[0] != v;
+		break;
+	case C_LLLLP:
+		bad = l[0] != v || l[3] != v || bsz != size;
+		break;
+	case C_P:
+		bad = bsz != size;
+		break;
+	case C_AD:
+		bad = bsz != size / 8;
+		break;
+	case C_MANY:
+		for (int i = 0; i < NMANY; i++)
+			bad |= u[i] != (uint32_t)v || l[i] != v || d[i] != (double)v;
+		break;
+	}
+	if (rc != 0 || bad)
+		errors++;
+	return bsz ? *(char *)bp : 0;
+}
+
+/*
+  Measure one case with one packer: send BATCH commands, take them out of
+  the mailbox, unpack them, mark them done. Repeat until n ops are done.
+ */
+static void run(urpc_peer_t *up, int p, int c, size_t size, uint64_t n)
+{
+	transfer_queue_t *tq = up->send.tq;
+	urpc_mb_t m[BATCH];
+	int64_t req[BATCH];
+	void *payload[BATCH];
+	size_t plen[BATCH];
+	uint64_t send_cyc = 0, unpack_cyc = 0, bytes = 0, sink = 0, v = 0;
+	uint64_t t0, t1;
+
+	for (uint64_t done = 0; done < n; done += BATCH) {
+		t0 = get_cycles();
+		for (int i = 0; i < BATCH; i++)
+			if (pack_send(up, p, c, v + i, size) < 0) {
+				printf("send failed, payload buffer too small?\n");
+				exit(1);
+			}
+		t1 = get_cycles();
+		send_cyc += t1 - t0;
+
+		for (int i = 0; i < BATCH; i++) {
+			req[i] = urpc_get_cmd(tq, &m[i]);
+			set_recv_payload(&up->send, &m[i], &payload[i], &plen[i]);
+			bytes += plen[i];
+		}
+		t0 = get_cycles();
+		for (int i = 0; i < BATCH; i++)
+			sink += unpack(p, c, payload[i], plen[i], v + i, size);
+		t1 = get_cycles();
+		unpack_cyc += t1 - t0;
+
+		for (int i = 0; i < BATCH; i++)
+			urpc_slot_done(tq, REQ2SLOT(req[i]), &m[i]);
+		v += BATCH;
+	}
+	n = v;
+	printf("%-6s %-9s %7lu %8lu %10.1f %10.2f %10.1f %10.2f\n",
+	       cname[c], pname[p], csized[c] ? size : 0, bytes / n,
+	       (double)urpc_cycles_to_ns(send_cyc) / n, (double)bytes / send_cyc,
+	       (double)urpc_cycles_to_ns(unpack_cyc) / n, (double)bytes / unpack_cyc);
+	fflush(stdout);
+	if (sink == 1)	// practically never, keeps sink alive
+		printf(" ");
+}
+
+static int parse_list(char *s, long *v)
+{
+	int n = 0;
+
+	for (char *p = strtok(s, ","); p && n < MAX_LIST; p = strtok(NULL, ","))
+		v[n++] = atol(p);
+	return n;
+}
+
+static int parse_names(char *s, int *sel, const char **names, int nnames)
+{
+	memset(sel, 0, nnames * sizeof(int));
+	for (char *p = strtok(s, ","); p; p = strtok(NULL, ",")) {
+		int i;
+		for (i = 0; i < nnames; i++)
+			if (strcmp(p, names[i]) == 0)
+				break;
+		if (i == nnames) {
+			fprintf(stderr, "unknown name %s\n", p);
+			return -1;
+		}
+		sel[i] = 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	long sizes[MAX_LIST] = { 64, 1024, 16384 };
+	int nsizes = 3, csel[C_NUM], psel[P_NUM], opt;
+	uint64_t n = 200000;
+
+	for (int i = 0; i < C_NUM; i++)
+		csel[i] = 1;
+	for (int i = 0; i < P_NUM; i++)
+		psel[i] = 1;
+	while ((opt = getopt(argc, argv, "n:s:c:p:")) != -1) {
+		switch (opt) {
+		case 'n': n = atol(optarg); break;
+		case 's': nsizes = parse_list(optarg, sizes); break;
+		case 'c':
+			if (parse_names(optarg, csel, cname, C_NUM) < 0)
+				return 1;
+			break;
+		case 'p':
+			if (parse_names(optarg, psel, pname, P_NUM) < 0)
+				return 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n ops] [-s sizes] [-c cases] "
+				"[-p packers]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (n < BATCH)
+		n = BATCH;
+
+	long maxsize = 0;
+	for (int i = 0; i < nsizes; i++)
+		if (sizes[i] > maxsize)
+			maxsize = sizes[i];
+	buf = (char *)malloc(maxsize + 8);
+	urpc_peer_t *up = vh_urpc_peer_create();
+	if (up == NULL || buf == NULL) {
+		fprintf(stderr, "setup failed\n");
+		return 1;
+	}
+	memset(buf, 1, maxsize + 8);
+	for (int c = 0; c < C_NUM; c++)
+		cf[c] = urpc_fmt_compile(cfmt[c]);
+
+	printf("%-6s %-9s %7s %8s %10s %10s %10s %10s\n", "case", "packer", "size",
+	       "payload", "send[ns]", "send[B/c]", "unpack[ns]", "unpk[B/c]");
+	for (int c = 0; c < C_NUM; c++) {
+		if (!csel[c])
+			continue;
+		for (int s = 0; s < (csized[c] ? nsizes : 1); s++)
+			for (int p = 0; p < P_NUM; p++)
+				if (psel[p])
+					run(up, p, c, sizes[s], n);
+	}
+	printf("errors: %lu\n", errors);
+
+	for (int c = 0; c < C_NUM; c++)
+		urpc_fmt_free(cf[c]);
+	vh_urpc_peer_destroy(up);
+	free(buf);
+	return errors ? 1 : 0;
+}
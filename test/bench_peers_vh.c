@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "urpc.h"
+#include "urpc_time.h"
+
+/*
+  Scaling with the number of peers. Creates N peers, attaches them from
+  host loopback children (this binary in child mode, no VE needed) and
+  drives them from M VH threads, each thread owning every M-th peer.
+
+  usage: bench_peers_vh [-p peers] [-m threads] [-C children] [-t secs]
+                        [-s size] [-d depth] [-b buff_len]
+
+  -p  comma separated peer counts (default 1,2,4,8,16,32,64,144)
+  -m  VH threads driving the peers (default 1)
+  -C  child processes, peers are distributed round robin (default 1)
+  -t  seconds of traffic per peer count (default 1)
+  -s  request payload size (default 64)
+  -d  requests in flight per peer (default 4)
+  -b  queue length per direction, sets URPC_SEND_BUFF_LEN and
+      URPC_RECV_BUFF_LEN unless they are set (default 1M)
+
+  For each peer count it prints the peer creation time (mean and max),
+  the time until the children attached to all segments, the shm
+  footprint (reserved and resident, from /proc/sysvipc/shm), the
+  aggregate throughput, latency percentiles over all requests, and the
+  lowest and highest per peer throughput.
+*/
+
+#define CMD_REQ   5
+#define CMD_EXIT  8
+#define CMD_REPLY 9
+
+#define MAX_LIST 32
+#define MAX_THREADS 64
+#define MAX_SAMPLES (1 << 20)	// latency samples kept per thread
+
+struct peer {
+	urpc_peer_t *up;
+	int inflight;
+	uint64_t seq, done;
+	uint64_t t_send[URPC_LEN_MB];
+};
+
+struct thr {
+	pthread_t tid;
+	int id;
+	uint64_t *lat;
+	uint64_t nlat;
+};
+
+static struct peer peers[URPC_MAX_PEERS];
+static struct thr thr[MAX_THREADS];
+static int npeers, nthreads = 1, depth = 4;
+static size_t size = 64;
+static char *buf;
+static volatile int stop;
+static int yield_idle;
+
+/* child side */
+
+static int child_exits;
+
+static int req_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+		       void *payload, size_t plen)
+{
+	uint64_t idx, seq;
+	void *p;
+	size_t sz;
+
+	urpc_unpack_payload(payload, plen, (char *)"LLP", &idx, &seq, &p, &sz);
+	// the parent frees the reply buffers, retry until it did
+	while (urpc_generic_send(up, CMD_REPLY, (char *)"LL", idx, seq) < 0);
+	return 0;
+}
+
+static int exit_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			void *payload, size_t plen)
+{
+	child_exits++;
+	return 0;
+}
+
+/*
+  Attach all segments in the comma separated list and serve them round
+  robin until each got an exit command.
+ */
+static int child(char *segids)
+{
+	urpc_peer_t *ups[URPC_MAX_PEERS];
+	int n = 0;
+
+	for (char *p = strtok(segids, ","); p && n < URPC_MAX_PEERS; p = strtok(NULL, ",")) {
+		ups[n] = vh_urpc_peer_attach(atoi(p));
+		if (ups[n] == NULL)
+			return 1;
+		urpc_register_handler(ups[n], CMD_REQ, &req_handler);
+		urpc_register_handler(ups[n], CMD_EXIT, &exit_handler);
+		n++;
+	}
+	while (child_exits < n) {
+		int done = 0;
+		for (int i = 0; i < n; i++)
+			done += vh_urpc_recv_progress(ups[i], 16);
+		if (done == 0 && yield_idle)
+			sched_yield();
+	}
+	for (int i = 0; i < n; i++)
+		vh_urpc_peer_detach(ups[i]);
+	return 0;
+}
+
+/* parent side */
+
+static __thread struct thr *self;
+
+static int reply_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			 void *payload, size_t plen)
+{
+	uint64_t idx, seq;
+
+	urpc_unpack_payload(payload, plen, (char *)"LL", &idx, &seq);
+	struct peer *p = &peers[idx];
+	if (self->nlat < MAX_SAMPLES)
+		self->lat[self->nlat++] = get_cycles() - p->t_send[seq % URPC_LEN_MB];
+	p->inflight--;
+	p->done++;
+	return 0;
+}
+
+static void *driver(void *arg)
+{
+	self = (struct thr *)arg;
+
+	while (!stop) {
+		int active = 0;
+		for (int i = self->id; i < npeers; i += nthreads) {
+			struct peer *p = &peers[i];
+			while (p->inflight < depth) {
+				p->t_send[p->seq % URPC_LEN_MB] = get_cycles();
+				if (urpc_generic_send(p->up, CMD_REQ, (char *)"LLP", (uint64_t)i,
+						      p->seq, buf, size) < 0)
+					break;
+				p->seq++;
+				p->inflight++;
+			}
+			active += vh_urpc_recv_progress(p->up, URPC_LEN_MB);
+		}
+		if (active == 0 && yield_idle)
+			sched_yield();
+	}
+	// drain
+	for (int i = self->id; i < npeers; i += nthreads)
+		while (peers[i].inflight > 0)
+			if (vh_urpc_recv_progress(peers[i].up, URPC_LEN_MB) == 0 && yield_idle)
+				sched_yield();
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+  Resident size of our segments in bytes, from /proc/sysvipc/shm.
+ */
+static uint64_t shm_rss(void)
+{
+	FILE *f = fopen("/proc/sysvipc/shm", "r");
+	char line[512];
+	uint64_t rss_sum = 0;
+
+	if (f == NULL)
+		return 0;
+	if (fgets(line, sizeof(line), f) == NULL) {
+		fclose(f);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		int segid;
+		unsigned long rss;
+		if (sscanf(line, "%*d %d %*o %*u %*d %*d %*u %*u %*u %*u %*u %*u %*u %*u %lu",
+			   &segid, &rss) != 2)
+			continue;
+		for (int i = 0; i < npeers; i++)
+			if (peers[i].up->shm_segid == segid)
+				rss_sum += rss;
+	}
+	fclose(f);
+	return rss_sum;
+}
+
+static int run(const char *self_exe, int n, int nchildren, double secs)
+{
+	pid_t pids[URPC_MAX_PEERS];
+	uint64_t t_create = 0, t_create_max = 0, shm = 0;
+
+	memset(peers, 0, sizeof(peers));
+	npeers = n;
+	for (int i = 0; i < n; i++) {
+		uint64_t t0 = urpc_get_time_ns();
+		peers[i].up = vh_urpc_peer_create();
+		uint64_t dt = urpc_get_time_ns() - t0;
+		if (peers[i].up == NULL) {
+			fprintf(stderr, "creating peer %d failed\n", i);
+			return -1;
+		}
+		urpc_register_handler(peers[i].up, CMD_REPLY, &reply_handler);
+		t_create += dt;
+		if (dt > t_create_max)
+			t_create_max = dt;
+		shm += peers[i].up->shm_size;
+	}
+
+	// start the children, each gets its list of segment IDs
+	uint64_t t0 = urpc_get_time_ns();
+	if (nchildren > n)
+		nchildren = n;
+	for (int c = 0; c < nchildren; c++) {
+		char *cmdline = (char *)malloc(strlen(self_exe) + 16 + 12 * n);
+		int len = sprintf(cmdline, "%s --child ", self_exe);
+		for (int i = c; i < n; i += nchildren)
+			len += sprintf(cmdline + len, "%s%d", i == c ? "" : ",",
+				       peers[i].up->shm_segid);
+		if (vh_urpc_child_create(peers[c].up, cmdline, 0, -1) != 0) {
+			fprintf(stderr, "starting child %d failed\n", c);
+			return -1;
+		}
+		free(cmdline);
+		pids[c] = peers[c].up->child_pid;
+	}
+	for (int i = 0; i < n; i++) {
+		peers[i].up->child_pid = pids[i % nchildren];
+		if (urpc_wait_peer_attach(peers[i].up) != 0) {
+			fprintf(stderr, "peer %d did not attach\n", i);
+			return -1;
+		}
+	}
+	uint64_t t_attach = urpc_get_time_ns() - t0;
+
+	stop = 0;
+	t0 = get_cycles();
+	for (int t = 0; t < nthreads; t++) {
+		thr[t].id = t;
+		thr[t].nlat = 0;
+		pthread_create(&thr[t].tid, NULL, driver, &thr[t]);
+	}
+	usleep((useconds_t)(secs * 1e6));
+	stop = 1;
+	for (int t = 0; t < nthreads; t++)
+		pthread_join(thr[t].tid, NULL);
+	double elapsed = urpc_cycles_to_ns(get_cycles() - t0) / 1e9;
+
+	// merge latency samples
+	uint64_t nlat = 0, total = 0, pmin = UINT64_MAX, pmax = 0;
+	for (int t = 0; t < nthreads; t++)
+		nlat += thr[t].nlat;
+	uint64_t *lat = (uint64_t *)malloc((nlat + 1) * sizeof(uint64_t));
+	nlat = 0;
+	for (int t = 0; t < nthreads; t++) {
+		memcpy(lat + nlat, thr[t].lat, thr[t].nlat * sizeof(uint64_t));
+		nlat += thr[t].nlat;
+	}
+	qsort(lat, nlat, sizeof(uint64_t), cmp_u64);
+	for (int i = 0; i < n; i++) {
+		total += peers[i].done;
+		if (peers[i].done < pmin)
+			pmin = peers[i].done;
+		if (peers[i].done > pmax)
+			pmax = peers[i].done;
+	}
+	uint64_t rss = shm_rss();
+
+	printf("%5d %7d %10.1f %10.1f %9.1f %9.1f %8.1f %10.0f %8.1f %8.1f %10.0f %10.0f\n",
+	       n, nthreads, t_create / 1e3 / n, t_create_max / 1e3, t_attach / 1e6,
+	       shm / 1048576.0, rss / 1048576.0, total / elapsed,
+	       nlat ? urpc_cycles_to_ns(lat[nlat / 2]) / 1e3 : 0.0,
+	       nlat ? urpc_cycles_to_ns(lat[nlat * 99 / 100]) / 1e3 : 0.0,
+	       pmin / elapsed, pmax / elapsed);
+	fflush(stdout);
+	free(lat);
+
+	for (int i = 0; i < n; i++)
+		while (urpc_generic_send(peers[i].up, CMD_EXIT, (char *)"") < 0)
+			vh_urpc_recv_progress(peers[i].up, URPC_LEN_MB);
+	for (int c = 0; c < nchildren; c++)
+		waitpid(pids[c], NULL, 0);
+	for (int i = 0; i < n; i++)
+		vh_urpc_peer_destroy(peers[i].up);
+	return 0;
+}
+
+static int parse_list(char *s, long *v)
+{
+	int n = 0;
+
+	for (char *p = strtok(s, ","); p && n < MAX_LIST; p = strtok(NULL, ","))
+		v[n++] = atol(p);
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	long counts[MAX_LIST] = { 1, 2, 4, 8, 16, 32, 64, URPC_MAX_PEERS };
+	int ncounts = 8, nchildren = 1, opt;
+	double secs = 1;
+	char *buff_len = (char *)"1M";
+
+	yield_idle = sysconf(_SC_NPROCESSORS_ONLN) < 2;
+	if (argc > 2 && strcmp(argv[1], "--child") == 0)
+		return child(argv[2]);
+
+	while ((opt = getopt(argc, argv, "p:m:C:t:s:d:b:")) != -1) {
+		switch (opt) {
+		case 'p': ncounts = parse_list(optarg, counts); break;
+		case 'm': nthreads = atoi(optarg); break;
+		case 'C': nchildren = atoi(optarg); break;
+		case 't': secs = atof(optarg); break;
+		case 's': size = atol(optarg); break;
+		case 'd': depth = atoi(optarg); break;
+		case 'b': buff_len = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-p peers] [-m threads] [-C children] "
+				"[-t secs] [-s size] [-d depth] [-b buff_len]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nthreads < 1 || nthreads > MAX_THREADS || nchildren < 1) {
+		fprintf(stderr, "invalid number of threads or children\n");
+		return 1;
+	}
+	if (depth < 1)
+		depth = 1;
+	if (depth > URPC_LEN_MB / 2)
+		depth = URPC_LEN_MB / 2;
+	setenv("URPC_SEND_BUFF_LEN", buff_len, 0);
+	setenv("URPC_RECV_BUFF_LEN", buff_len, 0);
+
+	char self_exe[1024];
+	ssize_t len = readlink("/proc/self/exe", self_exe, sizeof(self_exe) - 1);
+	if (len < 0) {
+		perror("readlink");
+		return 1;
+	}
+	self_exe[len] = 0;
+	buf = (char *)calloc(1, size + 1);
+	for (int t = 0; t < nthreads; t++)
+		thr[t].lat = (uint64_t *)malloc(MAX_SAMPLES * sizeof(uint64_t));
+
+	printf("# %d children, %lu byte requests, depth %d per peer, %.1f s per run\n",
+	       nchildren, size, depth, secs);
+	printf("%5s %7s %10s %10s %9s %9s %8s %10s %8s %8s %10s %10s\n", "peers",
+	       "threads", "create[us]", "cr_max[us]", "attach[ms]", "shm[MB]", "rss[MB]",
+	       "msgs/s", "p50[us]", "p99[us]", "peer_min/s", "peer_max/s");
+	for (int i = 0; i < ncounts; i++) {
+		int n = counts[i] < 1 ? 1 : counts[i] > URPC_MAX_PEERS
+			? URPC_MAX_PEERS : counts[i];
+		if (run(self_exe, n, nchildren, secs) < 0)
+			return 1;
+	}
+	for (int t = 0; t < nthreads; t++)
+		free(thr[t].lat);
+	free(buf);
+	return 0;
+}
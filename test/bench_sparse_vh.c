@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "urpc.h"
+#include "urpc_time.h"
+
+/*
+  Crossover density of zero block elision. Does not need a VE: the commands
+  are sent on the VH send queue and consumed from the same queue in this
+  process.
+
+  usage: bench_sparse_vh [bufsize [nloop]]
+
+  For each density of non-zero cache lines the time of a plain send ("P")
+  plus copy-out is compared with urpc_send_sparse() plus urpc_sparse_decode()
+  using cache line and page sized blocks. Non-zero lines are clustered in
+  runs of 8 lines, like rows of a sparse matrix.
+*/
+
+#define CMD_PLAIN  5
+#define CMD_SPARSE 6
+
+static char *out;
+static size_t outlen;
+static int errors = 0;
+
+static int plain_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			 void *payload, size_t plen)
+{
+	void *p;
+	size_t sz;
+
+	urpc_unpack_payload(payload, plen, "P", &p, &sz);
+	memcpy(out, p, sz);
+	return 0;
+}
+
+static int sparse_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			  void *payload, size_t plen)
+{
+	if (urpc_sparse_decode(payload, plen, out, outlen) != (int64_t)outlen)
+		errors++;
+	return 0;
+}
+
+static void drain(urpc_peer_t *up, size_t *plen_seen)
+{
+	urpc_comm_t *uc = &up->send;
+	urpc_mb_t m;
+	void *payload;
+	size_t plen;
+	int64_t req;
+
+	while ((req = urpc_get_cmd(uc->tq, &m)) >= 0) {
+		set_recv_payload(uc, &m, &payload, &plen);
+		*plen_seen = plen;
+		up->handler[m.c.cmd](up, &m, req, payload, plen);
+		urpc_slot_done(uc->tq, REQ2SLOT(req), &m);
+	}
+}
+
+static double run(urpc_peer_t *up, int cmd, int shift, char *buf, size_t len,
+		  int nloop, size_t *plen)
+{
+	long ts = get_time_us();
+	for (int i = 0; i < nloop; i++) {
+		if (cmd == CMD_PLAIN)
+			urpc_generic_send(up, cmd, "P", buf, len);
+		else
+			urpc_send_sparse(up, cmd, buf, len, shift);
+		drain(up, plen);
+	}
+	return (double)timediff_us(ts) * 1000.0 / nloop;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t len = argc > 1 ? atol(argv[1]) : 1024 * 1024;
+	int nloop = argc > 2 ? atoi(argv[2]) : 200;
+	int density[] = { 0, 1, 2, 5, 10, 20, 30, 50, 75, 100 };
+	char *buf = malloc(len);
+	size_t plen;
+
+	outlen = len;
+	out = malloc(len);
+	urpc_peer_t *up = vh_urpc_peer_create();
+	if (up == NULL || buf == NULL || out == NULL) {
+		printf("setup failed\n");
+		return 1;
+	}
+	urpc_register_handler(up, CMD_PLAIN, &plain_handler);
+	urpc_register_handler(up, CMD_SPARSE, &sparse_handler);
+
+	printf("%8s %12s %12s %12s %10s %10s\n", "dens[%]", "plain[ns]",
+	       "line[ns]", "page[ns]", "line[kB]", "page[kB]");
+	for (int d = 0; d < sizeof(density) / sizeof(int); d++) {
+		size_t nlines = len / 64;
+		memset(buf, 0, len);
+		srand(d);
+		for (size_t l = 0; l < nlines; l += 8)
+			if (rand() % 100 < density[d])
+				memset(buf + l * 64, 1 + l % 255,
+				       (l + 8 <= nlines ? 8 : nlines - l) * 64);
+
+		double tp = run(up, CMD_PLAIN, 0, buf, len, nloop, &plen);
+		double tl = run(up, CMD_SPARSE, URPC_SPARSE_LINE, buf, len, nloop, &plen);
+		if (memcmp(buf, out, len) != 0)
+			errors++;
+		size_t szl = plen;
+		double tg = run(up, CMD_SPARSE, URPC_SPARSE_PAGE, buf, len, nloop, &plen);
+		if (memcmp(buf, out, len) != 0)
+			errors++;
+		printf("%8d %12.0f %12.0f %12.0f %10lu %10lu\n", density[d], tp, tl, tg,
+		       szl / 1024, plen / 1024);
+	}
+	if (errors)
+		printf("%d decoding errors\n", errors);
+	vh_urpc_peer_destroy(up);
+	free(buf);
+	free(out);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "urpc.h"
+#include "urpc_time.h"
+
+/*
+  Extended commands (URPC_EXT_CMD()) between two host processes, no VE
+  needed: the child is this binary in host loopback child mode.
+
+  usage: ext_vh [rounds]
+
+  The child registers sub-command handlers in several groups. The parent
+  sends each of them, with payloads of varying, also zero and unaligned,
+  size, followed by a sub-command without handler in a registered group.
+  Each handler checks that it got the payload meant for its command and
+  reports back. The child also checks the registration errors and that the
+  group dispatch rejects the unregistered sub-command.
+*/
+
+#define CMD_EXIT    8
+#define CMD_RESULT  9
+#define CMD_SUMMARY 10
+
+#define NEXT 6
+static const int ext_grp[NEXT] = { 1, 1, 11, 11, 11, 200 };
+static const int ext_sub[NEXT] = { 0, 255, 0, 1, 2, 77 };
+#define UNREG_CMD URPC_EXT_CMD(11, 3)
+
+static int child_done, calls, child_errors;
+
+static size_t payload_len(int r, int i)
+{
+	return (size_t)((r * 37 + i * 13) % 300);
+}
+
+static uint32_t make_tag(int i, int r)
+{
+	return (uint32_t)(i << 16 | r);
+}
+
+static void fill(char *buf, size_t len, uint32_t tag)
+{
+	for (size_t k = 0; k < len; k++)
+		buf[k] = (char)(tag * 31 + k);
+}
+
+/*
+  Handler i: check the payload and send the result back.
+ */
+static int check(urpc_peer_t *up, int i, void *payload, size_t plen)
+{
+	uint32_t tag, ok = 0;
+	void *buf;
+	size_t len;
+
+	calls++;
+	if (urpc_unpack_payload(payload, plen, (char *)"IxP", &tag, &buf, &len) == 0
+	    && (int)(tag >> 16) == i && len == payload_len(tag & 0xffff, i)) {
+		char *ref = (char *)malloc(len + 1);
+		fill(ref, len, tag);
+		ok = memcmp(ref, buf, len) == 0;
+		free(ref);
+	}
+	while (urpc_generic_send(up, CMD_RESULT, (char *)"II", tag, ok) < 0)
+		vh_urpc_recv_progress(up, 1);
+	return 0;
+}
+
+#define EXT_HANDLER(i)							\
+	static int ext_handler_##i(urpc_peer_t *up, urpc_mb_t *m, int64_t req, \
+				   void *payload, size_t plen)		\
+	{								\
+		return check(up, i, payload, plen);			\
+	}
+EXT_HANDLER(0)
+EXT_HANDLER(1)
+EXT_HANDLER(2)
+EXT_HANDLER(3)
+EXT_HANDLER(4)
+EXT_HANDLER(5)
+
+static urpc_handler_func ext_handler[NEXT] = {
+	ext_handler_0, ext_handler_1, ext_handler_2,
+	ext_handler_3, ext_handler_4, ext_handler_5,
+};
+
+static int exit_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			void *payload, size_t plen)
+{
+	child_done = 1;
+	return 0;
+}
+
+static void expect(int cond, const char *what)
+{
+	if (!cond) {
+		fprintf(stderr, "child: %s failed\n", what);
+		child_errors++;
+	}
+}
+
+/*
+  Call the group dispatch of the unregistered sub-command with a payload
+  built by hand, as the progress loop would.
+ */
+static void check_unregistered(urpc_peer_t *up)
+{
+	uint64_t payload[2] = { 0, 0 };
+	urpc_ext_hdr_t h = { UNREG_CMD, 0 };
+	urpc_mb_t m;
+
+	memcpy(payload, &h, sizeof(h));
+	m.u64 = 0;
+	m.c.cmd = URPC_EXT_GROUP(UNREG_CMD);
+	urpc_handler_func dispatch = up->handler[m.c.cmd];
+	expect(dispatch != NULL, "group dispatch registered");
+	if (dispatch)
+		expect(dispatch(up, &m, 0, payload, sizeof(payload)) == -ENOENT,
+		       "rejecting the unregistered sub-command");
+}
+
+static int child(void)
+{
+	urpc_peer_t *up = vh_urpc_peer_attach(0);
+
+	if (up == NULL)
+		return 1;
+	for (int i = 0; i < NEXT; i++)
+		expect(urpc_register_handler(up, URPC_EXT_CMD(ext_grp[i], ext_sub[i]),
+					     ext_handler[i]) > 0, "registration");
+	expect(urpc_register_handler(up, URPC_EXT_CMD(11, 1), ext_handler[0]) == -EEXIST,
+	       "duplicate sub-command registration");
+	expect(urpc_register_handler(up, 11, ext_handler[0]) == -EEXIST,
+	       "plain command on a group ID");
+	urpc_register_handler(up, CMD_EXIT, &exit_handler);
+	expect(urpc_register_handler(up, URPC_EXT_CMD(CMD_EXIT, 1), ext_handler[0]) == -EEXIST,
+	       "group on a plain command ID");
+	check_unregistered(up);
+
+	while (!child_done)
+		if (vh_urpc_recv_progress(up, 16) == 0)
+			sched_yield();
+	while (urpc_generic_send(up, CMD_SUMMARY, (char *)"II", calls, child_errors) < 0)
+		vh_urpc_recv_progress(up, 1);
+	// wait for the parent to take the summary before detaching
+	urpc_deadline_t d;
+	urpc_deadline_init(&d, 5000000);
+	while (up->send.tq->last_get_req < up->send.tq->last_put_req
+	       && !urpc_deadline_passed(&d))
+		sched_yield();
+	vh_urpc_peer_detach(up);
+	return 0;
+}
+
+static int results, bad_results, summary, child_calls, child_errs;
+
+static int result_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			  void *payload, size_t plen)
+{
+	uint32_t tag, ok;
+
+	if (urpc_unpack_payload(payload, plen, (char *)"II", &tag, &ok) != 0 || !ok)
+		bad_results++;
+	results++;
+	return 0;
+}
+
+static int summary_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			   void *payload, size_t plen)
+{
+	uint32_t c, e;
+
+	urpc_unpack_payload(payload, plen, (char *)"II", &c, &e);
+	child_calls = c;
+	child_errs = e;
+	summary = 1;
+	return 0;
+}
+
+static void progress(urpc_peer_t *up)
+{
+	if (vh_urpc_recv_progress(up, 16) == 0)
+		sched_yield();
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = 50;
+	char buf[512];
+
+	if (argc > 1 && strcmp(argv[1], "--child") == 0)
+		return child();
+	if (argc > 1)
+		rounds = atoi(argv[1]);
+
+	char self[1024], cmdline[1100];
+	ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len < 0) {
+		perror("readlink");
+		return 1;
+	}
+	self[len] = 0;
+	snprintf(cmdline, sizeof(cmdline), "%s --child", self);
+
+	urpc_peer_t *up = vh_urpc_peer_create();
+	if (up == NULL || vh_urpc_child_create(up, cmdline, 0, -1) != 0
+	    || urpc_wait_peer_attach(up) != 0) {
+		fprintf(stderr, "starting the child failed\n");
+		return 1;
+	}
+	urpc_register_handler(up, CMD_RESULT, &result_handler);
+	urpc_register_handler(up, CMD_SUMMARY, &summary_handler);
+
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < NEXT; i++) {
+			uint32_t tag = make_tag(i, r);
+			size_t plen = payload_len(r, i);
+			fill(buf, plen, tag);
+			while (urpc_generic_send(up, URPC_EXT_CMD(ext_grp[i], ext_sub[i]),
+						 (char *)"IxP", tag, buf, plen) < 0)
+				progress(up);
+		}
+		while (urpc_generic_send(up, UNREG_CMD, (char *)"IxP", 0, buf, (size_t)8) < 0)
+			progress(up);
+	}
+	while (urpc_generic_send(up, CMD_EXIT, (char *)"") < 0)
+		progress(up);
+
+	urpc_deadline_t d;
+	urpc_deadline_init(&d, 10000000);
+	while (!summary && !urpc_deadline_passed(&d))
+		progress(up);
+	waitpid(up->child_pid, NULL, 0);
+	vh_urpc_peer_destroy(up);
+
+	int expected = rounds * NEXT;
+	int errors = !summary + bad_results + (results != expected)
+		+ (child_calls != expected) + child_errs;
+	printf("ext_vh: %d extended commands, %d results (%d bad), child handler "
+	       "calls %d, child check errors %d: %s\n", expected, results,
+	       bad_results, child_calls, child_errs, errors ? "FAILED" : "ok");
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "urpc.h"
+#include "urpc_time.h"
+
+/*
+  Open loop load generator. Requests are issued at a target rate, with
+  constant or exponentially distributed (Poisson) gaps, against a peer
+  running this binary in host loopback child mode. No VE needed.
+
+  usage: load_vh [-r rate] [-p] [-t secs] [-w window_s] [-s size]
+                 [-c work_us] [-S seed]
+
+  -r  requests per second (default 10000)
+  -p  Poisson arrivals instead of a constant rate
+  -t  duration of the run in seconds (default 10)
+  -w  length of the reporting windows in seconds (default 1)
+  -s  payload size in bytes (default 64)
+  -c  busy time of the child per request in microseconds (default 0)
+
+  Each request gets an intended send time from the schedule, the latency
+  is measured from this time to handling the reply. Requests which can't
+  be sent on time, because the send ring is full or the generator fell
+  behind, are not dropped from the schedule, their waiting time is part
+  of the latency (no coordinated omission). The latencies go into
+  log-linear histograms with ~1% resolution, one per window and one for
+  the whole run. The "lag" column is the largest delay between intended
+  and actual send time in the window.
+*/
+
+#define CMD_REQ   5
+#define CMD_EXIT  8
+#define CMD_REPLY 9
+
+/*
+  HDR style histogram: values below 2^HIST_SUB_BITS are counted exactly,
+  above that each power of two is split into 2^(HIST_SUB_BITS-1) buckets.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_HALF     (1 << (HIST_SUB_BITS - 1))
+#define HIST_MAX_BITS 40	// ~18 minutes in ns
+#define HIST_BUCKETS  ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_HALF)
+
+struct hist {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t total, max;
+};
+
+static int hist_index(uint64_t v)
+{
+	int shift;
+
+	if (v >= (1UL << HIST_MAX_BITS))
+		v = (1UL << HIST_MAX_BITS) - 1;
+	shift = 63 - __builtin_clzl(v | ((1 << HIST_SUB_BITS) - 1)) - HIST_SUB_BITS + 1;
+	return shift * HIST_HALF + (int)(v >> shift);
+}
+
+/*
+  Highest value which falls into the same bucket.
+ */
+static uint64_t hist_value(int idx)
+{
+	int shift = idx < 2 * HIST_HALF ? 0 : idx / HIST_HALF - 1;
+	uint64_t sub = idx - shift * HIST_HALF;
+
+	return ((sub + 1) << shift) - 1;
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+	h->count[hist_index(v)]++;
+	h->total++;
+	if (v > h->max)
+		h->max = v;
+}
+
+static uint64_t hist_pct(struct hist *h, double p)
+{
+	uint64_t want = (uint64_t)ceil(p / 100.0 * h->total), seen = 0;
+
+	if (h->total == 0)
+		return 0;
+	if (want == 0)
+		want = 1;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen >= want) {
+			uint64_t v = hist_value(i);
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
+
+/* child side */
+
+static long child_work_us;
+static int child_done;
+static int yield_idle;
+
+static int req_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+		       void *payload, size_t plen)
+{
+	uint64_t seq;
+	void *p;
+	size_t sz;
+
+	urpc_unpack_payload(payload, plen, (char *)"LP", &seq, &p, &sz);
+	if (child_work_us)
+		busy_sleep_us(child_work_us);
+	// the parent frees the reply buffers, retry until it did
+	while (urpc_generic_send(up, CMD_REPLY, (char *)"L", seq) < 0);
+	return 0;
+}
+
+static int exit_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			void *payload, size_t plen)
+{
+	child_done = 1;
+	return 0;
+}
+
+static int child(void)
+{
+	urpc_peer_t *up = vh_urpc_peer_attach(0);
+
+	if (up == NULL)
+		return 1;
+	urpc_register_handler(up, CMD_REQ, &req_handler);
+	urpc_register_handler(up, CMD_EXIT, &exit_handler);
+	while (!child_done)
+		if (vh_urpc_recv_progress(up, 16) == 0 && yield_idle)
+			sched_yield();
+	vh_urpc_peer_detach(up);
+	return 0;
+}
+
+/* parent side */
+
+#define RING 4096	// requests in flight, intended send times by seq
+
+static uint64_t t_intended[RING];
+static uint64_t done;
+static struct hist win, all;
+
+static int reply_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			 void *payload, size_t plen)
+{
+	uint64_t seq, lat;
+
+	urpc_unpack_payload(payload, plen, (char *)"L", &seq);
+	lat = urpc_get_time_ns() - t_intended[seq % RING];
+	hist_add(&win, lat);
+	hist_add(&all, lat);
+	done++;
+	return 0;
+}
+
+static void print_hist(const char *label, struct hist *h, uint64_t sent, double secs,
+		       uint64_t lag)
+{
+	printf("%8s %9lu %9lu %10.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+	       label, sent, h->total, h->total / secs,
+	       hist_pct(h, 50) / 1e3, hist_pct(h, 99) / 1e3, hist_pct(h, 99.9) / 1e3,
+	       h->max / 1e3, lag / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+	double rate = 10000, secs = 10, window = 1;
+	int poisson = 0, seed = 1, opt;
+	size_t size = 64;
+
+	yield_idle = sysconf(_SC_NPROCESSORS_ONLN) < 2;
+	if (argc > 2 && strcmp(argv[1], "--child") == 0) {
+		child_work_us = atol(argv[2]);
+		return child();
+	}
+
+	while ((opt = getopt(argc, argv, "r:pt:w:s:c:S:")) != -1) {
+		switch (opt) {
+		case 'r': rate = atof(optarg); break;
+		case 'p': poisson = 1; break;
+		case 't': secs = atof(optarg); break;
+		case 'w': window = atof(optarg); break;
+		case 's': size = atol(optarg); break;
+		case 'c': child_work_us = atol(optarg); break;
+		case 'S': seed = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-r rate] [-p] [-t secs] [-w window_s] "
+				"[-s size] [-c work_us] [-S seed]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (rate <= 0 || secs <= 0 || window <= 0) {
+		fprintf(stderr, "rate, duration and window must be positive\n");
+		return 1;
+	}
+	srand(seed);
+
+	char *buf = (char *)calloc(1, size + 1);
+	urpc_peer_t *up = vh_urpc_peer_create();
+	if (up == NULL || buf == NULL) {
+		fprintf(stderr, "setup failed\n");
+		return 1;
+	}
+	urpc_register_handler(up, CMD_REPLY, &reply_handler);
+
+	char self[1024], cmdline[1200];
+	ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len < 0) {
+		perror("readlink");
+		return 1;
+	}
+	self[len] = 0;
+	snprintf(cmdline, sizeof(cmdline), "%s --child %ld", self, child_work_us);
+	if (vh_urpc_child_create(up, cmdline, 0, -1) != 0
+	    || urpc_wait_peer_attach(up) != 0) {
+		fprintf(stderr, "starting the child failed\n");
+		return 1;
+	}
+
+	printf("# %s arrivals, %g req/s, %lu byte payloads, child work %ld us\n",
+	       poisson ? "poisson" : "constant", rate, size, child_work_us);
+	printf("%8s %9s %9s %10s %10s %10s %10s %10s %10s\n", "time[s]", "sent",
+	       "done", "done/s", "p50[us]", "p99[us]", "p99.9[us]", "max[us]", "lag[us]");
+
+	double gap_ns = 1e9 / rate;
+	uint64_t t_start = urpc_get_time_ns();
+	uint64_t t_end = t_start + (uint64_t)(secs * 1e9);
+	uint64_t win_ns = (uint64_t)(window * 1e9);
+	uint64_t t_win = t_start + win_ns;
+	double next = (double)t_start;
+	uint64_t seq = 0, win_sent = 0, win_lag = 0, max_lag = 0;
+	uint64_t t_active = t_start, t_stop;
+	int nwin = 0;
+
+	for (;;) {
+		uint64_t now = t_stop = urpc_get_time_ns();
+
+		// issue everything which is due, oldest intended time first
+		while ((uint64_t)next <= now && (uint64_t)next < t_end
+		       && seq - done < RING) {
+			t_intended[seq % RING] = (uint64_t)next;
+			if (urpc_generic_send(up, CMD_REQ, (char *)"LP", seq, buf, size) < 0)
+				break;
+			uint64_t lag = urpc_get_time_ns() - (uint64_t)next;
+			if (lag > win_lag)
+				win_lag = lag;
+			seq++;
+			win_sent++;
+			t_active = urpc_get_time_ns();
+			if (poisson)
+				next += -log((rand() + 1.0) / ((double)RAND_MAX + 2.0)) * gap_ns;
+			else
+				next += gap_ns;
+		}
+		int n = vh_urpc_recv_progress(up, URPC_LEN_MB);
+		now = t_stop = urpc_get_time_ns();
+		if (n > 0)
+			t_active = now;
+		else if (yield_idle)
+			sched_yield();
+
+		if (now >= t_win) {
+			char label[16];
+			snprintf(label, sizeof(label), "%.1f", (++nwin) * window);
+			print_hist(label, &win, win_sent, window, win_lag);
+			fflush(stdout);
+			if (win_lag > max_lag)
+				max_lag = win_lag;
+			memset(&win, 0, sizeof(win));
+			win_sent = win_lag = 0;
+			t_win += win_ns;
+		}
+		if ((uint64_t)next >= t_end && done == seq)
+			break;
+		// give up when nothing was sent or answered for a second plus the
+		// child's work per request
+		if (seq > done && now - t_active > 1000000000UL + child_work_us * 1000UL) {
+			fprintf(stderr, "%lu replies missing\n", seq - done);
+			break;
+		}
+	}
+	// the last, partial window, with its real length
+	if (win_sent || win.total) {
+		char label[16];
+		double secs = (t_stop - (t_win - win_ns)) / 1e9;
+		snprintf(label, sizeof(label), "%.1f", (t_stop - t_start) / 1e9);
+		print_hist(label, &win, win_sent, secs, win_lag);
+	}
+	if (win_lag > max_lag)
+		max_lag = win_lag;
+
+	printf("%8s %9lu %9lu %10.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+	       "total", seq, all.total,
+	       all.total / ((t_stop - t_start) / 1e9),
+	       hist_pct(&all, 50) / 1e3, hist_pct(&all, 99) / 1e3,
+	       hist_pct(&all, 99.9) / 1e3, all.max / 1e3, max_lag / 1e3);
+
+	urpc_generic_send(up, CMD_EXIT, (char *)"");
+	waitpid(up->child_pid, NULL, 0);
+	vh_urpc_peer_destroy(up);
+	free(buf);
+	return 0;
+}
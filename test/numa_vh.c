@@ -0,0 +1,80 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "urpc.h"
+#include "urpc_debug.h"
+
+/*
+  Check NUMA placement of a peer's shm segment. Does not need a VE.
+
+  usage: numa_vh [node|local]
+
+  Creates a peer with the given NUMA policy, populates the segment and
+  reports on which nodes its pages ended up. Compare with the output of
+  "numactl --hardware".
+*/
+
+#define MAX_NODES 64
+
+int main(int argc, char *argv[])
+{
+	int node = URPC_NUMA_LOCAL;
+
+	if (argc > 1 && strcmp(argv[1], "local") != 0)
+		node = atoi(argv[1]);
+
+	setenv("URPC_SHM_PREFAULT", "1", 1);
+	urpc_peer_t *up = vh_urpc_peer_create_numa(node);
+	if (up == NULL) {
+		printf("peer creation failed\n");
+		return 1;
+	}
+	printf("segment %d: %lu bytes, %s, numa node %d\n", up->shm_segid, up->shm_size,
+	       (up->shm_backing & URPC_SHM_HUGETLB) ? "hugetlb" : "regular pages",
+	       up->numa_node);
+
+	size_t pagesize = sysconf(_SC_PAGE_SIZE);
+	unsigned long npages = up->shm_size / pagesize;
+	void **pages = malloc(npages * sizeof(void *));
+	int *status = malloc(npages * sizeof(int));
+	for (unsigned long i = 0; i < npages; i++)
+		pages[i] = (char *)up->shm_addr + i * pagesize;
+
+	// with nodes == NULL move_pages only queries the node of each page
+	if (syscall(SYS_move_pages, 0, npages, pages, NULL, status, 0) < 0) {
+		perror("move_pages");
+		return 1;
+	}
+	unsigned long count[MAX_NODES] = { 0 }, other = 0;
+	for (unsigned long i = 0; i < npages; i++) {
+		if (status[i] >= 0 && status[i] < MAX_NODES)
+			count[status[i]]++;
+		else
+			other++;
+	}
+	int err = 0;
+	for (int n = 0; n < MAX_NODES; n++) {
+		if (count[n] == 0)
+			continue;
+		printf("node %d: %lu pages\n", n, count[n]);
+		if (up->numa_node >= 0 && n != up->numa_node)
+			err = 1;
+	}
+	if (other)
+		printf("not present: %lu pages\n", other);
+
+	if (vh_urpc_numa_bind_thread(up) == 0)
+		printf("progress thread bound to node %d, now on cpu %d\n",
+		       up->numa_node, sched_getcpu());
+
+	free(pages);
+	free(status);
+	vh_urpc_peer_destroy(up);
+	printf("%s\n", err ? "FAILED" : "OK");
+	return err;
+}
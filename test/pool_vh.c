@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "urpc.h"
+#include "urpc_time.h"
+
+/*
+  Time until a ready peer is available, with and without a peer pool.
+  Does not need a VE: the children are this binary in host loopback child
+  mode.
+
+  usage: pool_vh [-n iterations] [-p pool_size] [-g gap_ms]
+
+  Three modes are measured, each runs a short "job" per iteration: get a
+  peer with an attached child, exchange a ping, let the child exit and
+  release the peer.
+
+  cold      vh_urpc_peer_create(), vh_urpc_child_create() and
+            urpc_wait_peer_attach(), vh_urpc_peer_destroy() at the end
+  pool      vh_urpc_pool_get() of a pre-created peer, then the child is
+            launched; vh_urpc_pool_put() resets the segment for reuse
+  pool+exec vh_urpc_pool_get() of a peer with pre-launched child
+
+  The gap between jobs gives the pool thread time to refill. Finally a
+  peer taken from a pool with pre-launched children is used after the pool
+  was destroyed, its child must survive the destruction.
+*/
+
+#define CMD_PING  5
+#define CMD_EXIT  8
+#define CMD_PONG  9
+
+static int child_done, pongs;
+
+static int ping_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			void *payload, size_t plen)
+{
+	while (urpc_generic_send(up, CMD_PONG, (char *)"") < 0);
+	return 0;
+}
+
+static int exit_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			void *payload, size_t plen)
+{
+	child_done = 1;
+	return 0;
+}
+
+static int child(void)
+{
+	urpc_peer_t *up = vh_urpc_peer_attach(0);
+
+	if (up == NULL)
+		return 1;
+	urpc_register_handler(up, CMD_PING, &ping_handler);
+	urpc_register_handler(up, CMD_EXIT, &exit_handler);
+	while (!child_done)
+		if (vh_urpc_recv_progress(up, 16) == 0)
+			sched_yield();
+	vh_urpc_peer_detach(up);
+	return 0;
+}
+
+static int pong_handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+			void *payload, size_t plen)
+{
+	pongs++;
+	return 0;
+}
+
+/*
+  The job: ping the child, let it exit and reap it.
+ */
+static int job(urpc_peer_t *up)
+{
+	urpc_register_handler(up, CMD_PONG, &pong_handler);
+	pongs = 0;
+	urpc_generic_send(up, CMD_PING, (char *)"");
+	urpc_deadline_t d;
+	urpc_deadline_init(&d, 5000000);
+	while (pongs == 0 && !urpc_deadline_passed(&d))
+		if (vh_urpc_recv_progress(up, 16) == 0)
+			sched_yield();
+	urpc_generic_send(up, CMD_EXIT, (char *)"");
+	waitpid(up->child_pid, NULL, 0);
+	return pongs == 1 ? 0 : -1;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *mode, uint64_t *t, int n, int errors)
+{
+	qsort(t, n, sizeof(uint64_t), cmp_u64);
+	printf("%-10s %10.1f %10.1f %10.1f %7d\n", mode, t[n / 2] / 1e3,
+	       t[n * 9 / 10] / 1e3, t[n - 1] / 1e3, errors);
+}
+
+int main(int argc, char *argv[])
+{
+	int n = 50, psize = 4, gap_ms = 20, opt;
+
+	if (argc > 1 && strcmp(argv[1], "--child") == 0)
+		return child();
+
+	while ((opt = getopt(argc, argv, "n:p:g:")) != -1) {
+		switch (opt) {
+		case 'n': n = atoi(optarg); break;
+		case 'p': psize = atoi(optarg); break;
+		case 'g': gap_ms = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] [-p pool_size] "
+				"[-g gap_ms]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (n < 1)
+		n = 1;
+
+	char self[1024], cmdline[1100];
+	ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len < 0) {
+		perror("readlink");
+		return 1;
+	}
+	self[len] = 0;
+	snprintf(cmdline, sizeof(cmdline), "%s --child", self);
+	uint64_t *t = (uint64_t *)malloc(n * sizeof(uint64_t));
+	int errors;
+
+	printf("# time until a peer with attached child is ready, %d jobs, "
+	       "gap %d ms\n", n, gap_ms);
+	printf("%-10s %10s %10s %10s %7s\n", "mode", "p50[us]", "p90[us]",
+	       "max[us]", "errors");
+
+	errors = 0;
+	for (int i = 0; i < n; i++) {
+		uint64_t t0 = urpc_get_time_ns();
+		urpc_peer_t *up = vh_urpc_peer_create();
+		if (up == NULL || vh_urpc_child_create(up, cmdline, 0, -1) != 0
+		    || urpc_wait_peer_attach(up) != 0) {
+			fprintf(stderr, "cold start failed\n");
+			return 1;
+		}
+		t[i] = urpc_get_time_ns() - t0;
+		errors += job(up) != 0;
+		vh_urpc_peer_destroy(up);
+		usleep(gap_ms * 1000);
+	}
+	report("cold", t, n, errors);
+
+	for (int exec = 0; exec < 2; exec++) {
+		urpc_pool_t *pool = vh_urpc_pool_create(psize, URPC_NUMA_NONE,
+							exec ? cmdline : NULL, 0, -1);
+		if (pool == NULL) {
+			perror("vh_urpc_pool_create");
+			return 1;
+		}
+		usleep(100000 + gap_ms * 1000 * psize);	// initial fill
+		errors = 0;
+		for (int i = 0; i < n; i++) {
+			uint64_t t0 = urpc_get_time_ns();
+			urpc_peer_t *up = vh_urpc_pool_get(pool);
+			if (up == NULL) {
+				fprintf(stderr, "pool get failed\n");
+				return 1;
+			}
+			if (!exec && (vh_urpc_child_create(up, cmdline, 0, -1) != 0
+				      || urpc_wait_peer_attach(up) != 0)) {
+				fprintf(stderr, "child start failed\n");
+				return 1;
+			}
+			t[i] = urpc_get_time_ns() - t0;
+			errors += job(up) != 0;
+			vh_urpc_pool_put(pool, up);
+			usleep(gap_ms * 1000);
+		}
+		urpc_peer_t *kept = exec ? vh_urpc_pool_get(pool) : NULL;
+		vh_urpc_pool_destroy(pool);
+		report(exec ? "pool+exec" : "pool", t, n, errors);
+		if (kept) {
+			usleep(100000);
+			errors = job(kept) != 0;
+			printf("peer used after pool destroy: %s\n",
+			       errors ? "FAILED" : "ok");
+			vh_urpc_peer_destroy(kept);
+		}
+	}
+	free(t);
+	return errors;
+}
@@ -16,6 +16,7 @@ int core2 = 0;
 #define SEND_Q  7
 #define SEND_Ix 8
 #define SEND_D  9
+#define SEND_Z  16
 
 #define RET_I  10
 #define RET_L  11
@@ -23,6 +24,7 @@ int core2 = 0;
 #define RET_Q  13
 #define RET_Ix 14
 #define RET_D  15
+#define RET_Z  17
 
 void send_ping_nolock(urpc_peer_t *up)
 {
@@ -69,8 +71,11 @@ int send_string_nolock(urpc_peer_t *up, char *s, uint32_t i, uint64_t l, char *f
 	case 'Q':
 		rc = urpc_generic_send(up, SEND_Q, fmt, s, (size_t)strlen(s));
 		break;
+	case 'D':
+		rc = urpc_generic_send(up, SEND_D, fmt, (double)l);
+		break;
 	default:
-		rc = urpc_generic_send(up, SEND_D, fmt, i);
+		rc = urpc_generic_send(up, SEND_Z, fmt, i);
 		break;
 	}
 	if (rc < 0)
@@ -106,6 +111,7 @@ static int string_handler_rcv(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
 	uint32_t i;
 	uint32_t i2;
 	uint64_t l;
+	double d;
 	char *p;
 	size_t sz;
 	char *p_tmp;
@@ -152,10 +158,17 @@ static int string_handler_rcv(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
 
 		break;
 	case SEND_D:
+		urpc_unpack_payload(payload, plen, "D", &d);
+		printf("buffer: '%g'\n", d);
+		fflush(stdout);
+                urpc_generic_send(up, RET_D, (char *)"D", d);
+
+		break;
+	case SEND_Z:
 		printf("buffer:Default'\n");
 		fflush(stdout);
 		i=2001;
-                urpc_generic_send(up, RET_D, (char *)"D", i);
+                urpc_generic_send(up, RET_Z, (char *)"Z", i);
 
 		break;
 	}
@@ -168,6 +181,7 @@ static int string_handler_retrcv(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
         uint32_t i;
         uint32_t i2;
         uint64_t l;
+        double d;
         char *p;
         size_t sz;
         char *p_tmp;
@@ -203,7 +217,12 @@ static int string_handler_retrcv(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
 		fflush(stdout);
                 break;
         case RET_D:
-                urpc_unpack_payload(payload, plen, "D", &i);
+                urpc_unpack_payload(payload, plen, "D", &d);
+                printf("ret buffer: '%g'\n", d);
+		fflush(stdout);
+                break;
+        case RET_Z:
+                urpc_unpack_payload(payload, plen, "Z", &i);
 		printf("buffer:Default'\n");
 		fflush(stdout);
                 break;
@@ -250,6 +269,8 @@ void sendrecv_init(urpc_peer_t *up)
 		eprintf("register_handler failed for cmd %d\n", SEND_Ix);
         if ((err = urpc_register_handler(up, SEND_D, &string_handler_rcv)) < 0)
                 eprintf("register_handler failed for cmd %d\n", SEND_D);
+        if ((err = urpc_register_handler(up, SEND_Z, &string_handler_rcv)) < 0)
+                eprintf("register_handler failed for cmd %d\n", SEND_Z);
         if ((err = urpc_register_handler(up, RET_I, &string_handler_retrcv)) < 0)
                 eprintf("register_handler failed for cmd %d\n", RET_I);
         if ((err = urpc_register_handler(up, RET_L, &string_handler_retrcv)) < 0)
@@ -262,6 +283,8 @@ void sendrecv_init(urpc_peer_t *up)
                 eprintf("register_handler failed for cmd %d\n", RET_Ix);
         if ((err = urpc_register_handler(up, RET_D, &string_handler_retrcv)) < 0)
                 eprintf("register_handler failed for cmd %d\n", RET_D);
+        if ((err = urpc_register_handler(up, RET_Z, &string_handler_retrcv)) < 0)
+                eprintf("register_handler failed for cmd %d\n", RET_Z);
 
 }
 
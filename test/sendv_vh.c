@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "urpc_common.h"
+
+/*
+  Check of urpc_sendv() and of the 'V' pack format. Does not need a VE:
+  commands are sent into the send queue of a peer and taken out again by
+  the same process, like in bench_pack_vh.
+
+  usage: sendv_vh [-n iterations] [-r seed]
+
+  Each iteration gathers a random iovec of up to MAX_IOV elements, with
+  zero length elements and elements of odd length at odd addresses, and
+  sends it as plain and as extended command with urpc_sendv() and with
+  urpc_generic_send("IxV"). The received payload is compared byte for byte
+  with the concatenated elements. Mismatches are counted as errors and make
+  the run fail.
+
+  Only the VH gather path runs here, the chunked DMA of the VE side needs
+  a VE.
+*/
+
+#define CMD 5
+#define EXT_CMD URPC_EXT_CMD(3, 5)
+#define MAX_IOV 16
+#define MAX_ELEM 3000
+#define SRC_LEN (MAX_IOV * (MAX_ELEM + 8))
+
+static char src[SRC_LEN];
+static uint64_t errors, checked, bytes;
+
+/*
+  Take the command out of the send queue, compare its payload with the
+  gathered content and release the slot.
+ */
+static void receive(urpc_peer_t *up, int64_t req, int ext, int fmt,
+		    const char *ref, size_t len, uint32_t tag)
+{
+	transfer_queue_t *tq = up->send.tq;
+	urpc_mb_t m;
+	void *payload;
+	size_t plen;
+
+	if (req < 0 || urpc_get_cmd(tq, &m) != req) {
+		errors++;
+		return;
+	}
+	set_recv_payload(&up->send, &m, &payload, &plen);
+	char *p = (char *)payload;
+	if (ext) {
+		urpc_ext_hdr_t *h = (urpc_ext_hdr_t *)p;
+		if (m.c.cmd != URPC_EXT_GROUP(EXT_CMD) || plen < sizeof(*h)
+		    || h->cmd != EXT_CMD)
+			errors++;
+		p += sizeof(*h);
+		plen -= sizeof(*h);
+	} else if (m.c.cmd != CMD)
+		errors++;
+
+	if (fmt) {
+		uint32_t t;
+		void *vp;
+		size_t vlen;
+		if (urpc_unpack_payload(p, plen, (char *)"IxV", &t, &vp, &vlen) != 0
+		    || t != tag || vlen != len || memcmp(vp, ref, len) != 0)
+			errors++;
+	} else if (plen != len || memcmp(p, ref, len) != 0)
+		errors++;
+	checked++;
+	bytes += len;
+	urpc_slot_done(tq, REQ2SLOT(req), &m);
+}
+
+int main(int argc, char *argv[])
+{
+	struct iovec iov[MAX_IOV];
+	char *ref = (char *)malloc(SRC_LEN);
+	int n = 10000, seed = 1, opt;
+
+	while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+		switch (opt) {
+		case 'n': n = atoi(optarg); break;
+		case 'r': seed = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] [-r seed]\n", argv[0]);
+			return 1;
+		}
+	}
+	srand(seed);
+	for (int i = 0; i < SRC_LEN; i++)
+		src[i] = (char)rand();
+
+	urpc_peer_t *up = vh_urpc_peer_create();
+	if (up == NULL) {
+		fprintf(stderr, "vh_urpc_peer_create failed\n");
+		return 1;
+	}
+
+	for (int it = 0; it < n; it++) {
+		int niov = rand() % (MAX_IOV + 1);
+		size_t len = 0;
+		char *s = src;
+
+		for (int i = 0; i < niov; i++) {
+			size_t l;
+			switch (rand() % 4) {
+			case 0: l = 0; break;
+			case 1: l = 1 + rand() % 7; break;
+			default: l = rand() % MAX_ELEM; break;
+			}
+			s += rand() % 8;	// odd start addresses
+			iov[i].iov_base = s;
+			iov[i].iov_len = l;
+			memcpy(ref + len, s, l);
+			len += l;
+			s += l;
+		}
+		uint32_t tag = (uint32_t)it;
+		for (int ext = 0; ext < 2; ext++) {
+			int cmd = ext ? EXT_CMD : CMD;
+			receive(up, urpc_sendv(up, cmd, iov, niov), ext, 0, ref, len, tag);
+			receive(up, urpc_generic_send(up, cmd, (char *)"IxV", tag, iov, niov),
+				ext, 1, ref, len, tag);
+		}
+	}
+	vh_urpc_peer_destroy(up);
+	free(ref);
+	printf("sendv_vh: %lu payloads, %lu bytes, %lu errors\n", checked, bytes, errors);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "urpc.h"
+#include "urpc_time.h"
+
+/*
+  Child launch time against the resident size of the parent process, for
+  the fork() path (URPC_CHILD_FORK set) and the default clone(CLONE_VM |
+  CLONE_VFORK) path of vh_urpc_child_create(). Does not need a VE: the
+  children are this binary in host loopback child mode.
+
+  usage: spawn_vh [-m rss_mib_list] [-n iterations]
+
+  For each parent RSS (MiB, anonymous memory touched before measuring) and
+  method it reports the time spent in vh_urpc_child_create() ("launch")
+  and the time until the child attached ("ready"), as p50 and max.
+*/
+
+static int child(void)
+{
+	urpc_peer_t *up = vh_urpc_peer_attach(0);
+
+	if (up == NULL)
+		return 1;
+	vh_urpc_peer_detach(up);
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int measure(urpc_peer_t *up, char *cmdline, int n,
+		   uint64_t *t_launch, uint64_t *t_ready)
+{
+	for (int i = 0; i < n; i++) {
+		uint64_t t0 = urpc_get_time_ns();
+		if (vh_urpc_child_create(up, cmdline, 0, -1) != 0)
+			return -1;
+		uint64_t t1 = urpc_get_time_ns();
+		if (urpc_wait_peer_attach(up) != 0)
+			return -1;
+		uint64_t t2 = urpc_get_time_ns();
+		t_launch[i] = t1 - t0;
+		t_ready[i] = t2 - t0;
+		waitpid(up->child_pid, NULL, 0);
+		if (vh_urpc_peer_reset(up) != 0)
+			return -1;
+	}
+	qsort(t_launch, n, sizeof(uint64_t), cmp_u64);
+	qsort(t_ready, n, sizeof(uint64_t), cmp_u64);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char mlist_default[] = "0,256,1024", *mlist = mlist_default;
+	int n = 20, opt;
+
+	if (argc > 1 && strcmp(argv[1], "--child") == 0)
+		return child();
+
+	while ((opt = getopt(argc, argv, "m:n:")) != -1) {
+		switch (opt) {
+		case 'm': mlist = optarg; break;
+		case 'n': n = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-m rss_mib_list] [-n iterations]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (n < 1)
+		n = 1;
+
+	char self[1024], cmdline[1100];
+	ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len < 0) {
+		perror("readlink");
+		return 1;
+	}
+	self[len] = 0;
+	snprintf(cmdline, sizeof(cmdline), "%s --child", self);
+
+	urpc_peer_t *up = vh_urpc_peer_create();
+	if (up == NULL) {
+		fprintf(stderr, "vh_urpc_peer_create failed\n");
+		return 1;
+	}
+	uint64_t *t_launch = (uint64_t *)malloc(n * sizeof(uint64_t));
+	uint64_t *t_ready = (uint64_t *)malloc(n * sizeof(uint64_t));
+
+	printf("# child launch time vs. parent RSS, %d launches each\n", n);
+	printf("%8s %-6s %12s %12s %12s %12s\n", "rss[MiB]", "method",
+	       "launch p50", "launch max", "ready p50", "ready max");
+	printf("%8s %-6s %12s %12s %12s %12s\n", "", "", "[us]", "[us]",
+	       "[us]", "[us]");
+
+	char *save, *tok = strtok_r(mlist, ",", &save);
+	while (tok) {
+		size_t rss = (size_t)atol(tok) << 20;
+		char *mem = NULL;
+		if (rss) {
+			mem = (char *)mmap(NULL, rss, PROT_READ | PROT_WRITE,
+					   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mem == MAP_FAILED) {
+				perror("mmap");
+				return 1;
+			}
+			memset(mem, 1, rss);
+		}
+		for (int fork_path = 1; fork_path >= 0; fork_path--) {
+			if (fork_path)
+				setenv("URPC_CHILD_FORK", "1", 1);
+			else
+				unsetenv("URPC_CHILD_FORK");
+			if (measure(up, cmdline, n, t_launch, t_ready) != 0) {
+				fprintf(stderr, "launch failed\n");
+				return 1;
+			}
+			printf("%8s %-6s %12.1f %12.1f %12.1f %12.1f\n", tok,
+			       fork_path ? "fork" : "clone",
+			       t_launch[n / 2] / 1e3, t_launch[n - 1] / 1e3,
+			       t_ready[n / 2] / 1e3, t_ready[n - 1] / 1e3);
+		}
+		if (mem)
+			munmap(mem, rss);
+		tok = strtok_r(NULL, ",", &save);
+	}
+	vh_urpc_peer_destroy(up);
+	free(t_launch);
+	free(t_ready);
+	return 0;
+}
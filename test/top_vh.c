@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "urpc.h"
+#include "urpc_time.h"
+
+/*
+  Traffic generator for urpc-top. Does not need a VE: the commands are sent
+  into the VE -> VH queue of the peer and consumed by the progress loop of
+  the same process, so both the sender and the receiver counters of that
+  queue move.
+
+  usage: top_vh [seconds [msg_size [idle_ms]]]
+
+  Run urpc-top with the printed segment ID in another shell. Every second
+  the generator pauses for idle_ms milliseconds, which shows up as idle
+  time and as receiver spins.
+*/
+
+#define CMD_DATA 5
+
+static int handler(urpc_peer_t *up, urpc_mb_t *m, int64_t req,
+		   void *payload, size_t plen)
+{
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int secs = argc > 1 ? atoi(argv[1]) : 30;
+	size_t size = argc > 2 ? atol(argv[2]) : 1024;
+	long idle_ms = argc > 3 ? atol(argv[3]) : 200;
+	char *buf = calloc(1, size);
+
+	urpc_peer_t *up = vh_urpc_peer_create();
+	if (up == NULL || buf == NULL) {
+		printf("setup failed\n");
+		return 1;
+	}
+	urpc_register_handler(up, CMD_DATA, &handler);
+
+	// a second view of the peer which sends into its receive queue
+	urpc_shm_stats_t *st = (urpc_shm_stats_t *)((char *)up->shm_addr
+						    + URPC_SHM_STATS_OFFS);
+	urpc_peer_t lp = *up;
+	lp.send = up->recv;
+	lp.send.active = &lp.send.mem[0];
+	lp.send.shm_cnt = &st->q[URPC_Q_VE2VH][URPC_SHM_SENDER];
+
+	printf("segid %d, run: ../bin/urpc-top %d\n", up->shm_segid, up->shm_segid);
+	fflush(stdout);
+
+	long t_end = get_time_us() + secs * 1000000L, t_pause = get_time_us() + 1000000;
+	uint64_t n = 0;
+	while (get_time_us() < t_end) {
+		for (int i = 0; i < 128; i++)
+			if (urpc_generic_send(&lp, CMD_DATA, "P", buf, size) >= 0)
+				n++;
+		while (vh_urpc_recv_progress(up, 128));
+		if (get_time_us() > t_pause) {
+			vh_urpc_recv_progress_timeout(up, 1, idle_ms * 1000);
+			t_pause = get_time_us() + 1000000;
+		}
+	}
+	printf("sent %lu messages\n", n);
+	vh_urpc_peer_destroy(up);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,263 @@
+/**
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *
+ * Live view of the message counters of running urpc peers.
+ *
+ * Copyright (c) 2020 Erich Focht
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "urpc.h"
+
+/*
+  usage: urpc-top [-i interval_s] [-n count] [segid ...]
+
+  Reads the shm segments of the given peers, or all urpc segments found in
+  /proc/sysvipc/shm, and prints per queue direction the
+  message, byte, ring full and spin rates, the number of requests in
+  flight, the data buffer high water mark and the time since the last
+  activity. The counters are published by the peers every
+  URPC_SHM_STATS_EVERY messages and when they go idle.
+
+  The peer processes are not touched, only their segments are read. Each
+  refresh attaches a segment read-only, copies the counters and detaches
+  right away. Peers check shm_nattch (vh_shm_wait_peers(),
+  vh_urpc_peer_reset()), they can only see urpc-top during that copy.
+*/
+
+#define MAX_SEGS 256
+
+// counters of a segment, copied while attached
+struct snap {
+	int pid[2];
+	urpc_shm_cnt_t cnt[2][2];
+	int64_t depth[2];
+	uint64_t high_water[2];
+};
+
+struct seg {
+	int segid;
+	struct snap cur;
+	urpc_shm_cnt_t prev[2][2];
+	int gone;
+};
+
+static struct seg segs[MAX_SEGS];
+static int nsegs = 0;
+
+static uint64_t now_us(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/*
+  Read a counter block, the writer publishes it with plain stores.
+ */
+static void read_cnt(urpc_shm_cnt_t *dst, volatile urpc_shm_cnt_t *src)
+{
+	dst->msgs = src->msgs;
+	dst->bytes = src->bytes;
+	dst->full = src->full;
+	dst->spins = src->spins;
+	dst->alloc_fail = src->alloc_fail;
+	dst->last_us = src->last_us;
+}
+
+/*
+  Attach a segment read-only, copy its counters and detach.
+ */
+static int read_seg(int segid, struct snap *sn, int quiet)
+{
+	void *addr = shmat(segid, NULL, SHM_RDONLY);
+
+	if (addr == (void *)-1) {
+		if (!quiet)
+			perror("shmat");
+		return -1;
+	}
+	urpc_shm_hdr_t *hdr = (urpc_shm_hdr_t *)addr;
+	if (hdr->magic != URPC_SHM_MAGIC || hdr->version != URPC_SHM_VERSION
+	    || hdr->stats_offs == 0) {
+		if (!quiet)
+			fprintf(stderr, "segment %d is not a urpc segment of version %d\n",
+				segid, URPC_SHM_VERSION);
+		shmdt(addr);
+		return -1;
+	}
+	urpc_shm_stats_t *stats = (urpc_shm_stats_t *)((char *)addr + hdr->stats_offs);
+	sn->pid[0] = stats->pid[0];
+	sn->pid[1] = stats->pid[1];
+	for (int q = 0; q < 2; q++) {
+		transfer_queue_t *tq = (transfer_queue_t *)((char *)addr + hdr->q_offs[q]);
+		for (int side = 0; side < 2; side++)
+			read_cnt(&sn->cnt[q][side], &stats->q[q][side]);
+		sn->depth[q] = tq->last_put_req - tq->last_get_req;
+		sn->high_water[q] = tq->high_water;
+	}
+	shmdt(addr);
+	return 0;
+}
+
+static int add_seg(int segid, int quiet)
+{
+	struct seg *s = &segs[nsegs];
+
+	if (nsegs == MAX_SEGS)
+		return -1;
+	if (read_seg(segid, &s->cur, quiet) < 0)
+		return -1;
+	s->segid = segid;
+	memcpy(s->prev, s->cur.cnt, sizeof(s->prev));
+	s->gone = 0;
+	nsegs++;
+	return 0;
+}
+
+/*
+  Find all segments with a urpc header. Segments of other users which we
+  can't read are skipped silently.
+ */
+static void scan_segments(void)
+{
+	FILE *f = fopen("/proc/sysvipc/shm", "r");
+	char line[512];
+
+	if (f == NULL) {
+		perror("/proc/sysvipc/shm");
+		return;
+	}
+	if (fgets(line, sizeof(line), f) == NULL) {
+		fclose(f);
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		int key, segid;
+		unsigned long size;
+
+		if (sscanf(line, "%d %d %*o %lu", &key, &segid, &size) != 3)
+			continue;
+		if (size < URPC_SHM_HDR_SIZE)
+			continue;
+		add_seg(segid, 1);
+	}
+	fclose(f);
+}
+
+/*
+  The segments are marked for removal after the peers attached, they
+  disappear with the last detach.
+ */
+static int peers_gone(struct seg *s)
+{
+	struct shmid_ds ds;
+
+	if (shmctl(s->segid, IPC_STAT, &ds) < 0)
+		return 1;
+	return ds.shm_nattch == 0;
+}
+
+static void print_seg(struct seg *s, double dt, uint64_t t_us)
+{
+	static const char *qname[2] = { "VH->VE", "VE->VH" };
+
+	for (int q = 0; q < 2; q++) {
+		urpc_shm_cnt_t *c = s->cur.cnt[q];
+		urpc_shm_cnt_t *p = s->prev[q];
+		uint64_t last = c[0].last_us > c[1].last_us ? c[0].last_us : c[1].last_us;
+
+		printf("%8d %8d %8d %7s %10.0f %10.0f %9.2f %8.0f %10.0f %10.0f %6ld %9lu %7lu ",
+		       s->segid, s->cur.pid[0], s->cur.pid[1], qname[q],
+		       (c[0].msgs - p[0].msgs) / dt, (c[1].msgs - p[1].msgs) / dt,
+		       (c[0].bytes - p[0].bytes) / dt / 1e6,
+		       (c[0].full - p[0].full) / dt,
+		       (c[0].spins - p[0].spins) / dt, (c[1].spins - p[1].spins) / dt,
+		       s->cur.depth[q], s->cur.high_water[q] / 1024, c[0].alloc_fail);
+		if (s->gone)
+			printf("%8s\n", "gone");
+		else if (last == 0)
+			printf("%8s\n", "-");
+		else
+			printf("%8.1f\n", t_us > last ? (t_us - last) / 1e6 : 0.0);
+		p[0] = c[0];
+		p[1] = c[1];
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	double interval = 1.0;
+	long count = -1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:n:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = atof(optarg);
+			break;
+		case 'n':
+			count = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-i interval_s] [-n count] [segid ...]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc) {
+		for (int i = optind; i < argc; i++)
+			if (add_seg(atoi(argv[i]), 0) < 0)
+				return 1;
+	} else
+		scan_segments();
+	if (nsegs == 0) {
+		fprintf(stderr, "no urpc segments found\n");
+		return 1;
+	}
+
+	int tty = isatty(STDOUT_FILENO);
+	uint64_t t0 = now_us();
+	while (count < 0 || count-- > 0) {
+		usleep((useconds_t)(interval * 1e6));
+		uint64_t t1 = now_us();
+		double dt = (t1 - t0) / 1e6;
+		t0 = t1;
+
+		if (tty)
+			printf("\033[H\033[2J");
+		printf("%8s %8s %8s %7s %10s %10s %9s %8s %10s %10s %6s %9s %7s %8s\n",
+		       "segid", "vh_pid", "ve_pid", "queue", "put/s", "get/s", "MB/s",
+		       "full/s", "sspin/s", "rspin/s", "depth", "hiwat[kB]",
+		       "allocf", "idle[s]");
+		for (int i = 0; i < nsegs; i++) {
+			if (!segs[i].gone)
+				segs[i].gone = read_seg(segs[i].segid, &segs[i].cur, 1) < 0
+					|| peers_gone(&segs[i]);
+			print_seg(&segs[i], dt, t1);
+		}
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,175 @@
+/**
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ *
+ * Convert urpc trace dumps to Chrome/Perfetto trace JSON.
+ *
+ * Copyright (c) 2020 Erich Focht
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "urpc.h"
+
+/*
+  usage: urpc-trace2json trace.vh.<segid> [trace.ve.<segid> ...] > trace.json
+
+  Each dump becomes one process in the trace. Cycle timestamps are converted
+  to wall clock time with the references in the dump headers, so VH and VE
+  dumps of the same peer line up. Handlers are shown as slices, the other
+  events as instants, and each request is connected from its put on one
+  side to its get on the other side by a flow arrow.
+
+  Open the output in chrome://tracing or https://ui.perfetto.dev
+*/
+
+static const char *ev_name[] = {
+	"none", "put", "get", "payload", "handler", "handler", "slot_done",
+	"alloc", "gc",
+};
+
+static uint64_t t_min = UINT64_MAX;
+
+struct dump {
+	urpc_trace_file_hdr_t hdr;
+	urpc_trace_ev_t *ev;
+	double cycles_per_us;
+};
+
+static int read_dump(const char *path, struct dump *d)
+{
+	FILE *f = fopen(path, "r");
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	if (fread(&d->hdr, sizeof(d->hdr), 1, f) != 1
+	    || d->hdr.magic != URPC_TRACE_MAGIC
+	    || d->hdr.version != URPC_TRACE_VERSION) {
+		fprintf(stderr, "%s: not a urpc trace dump\n", path);
+		fclose(f);
+		return -1;
+	}
+	d->ev = malloc(d->hdr.nevents * sizeof(urpc_trace_ev_t) + 1);
+	if (d->ev == NULL
+	    || fread(d->ev, sizeof(urpc_trace_ev_t), d->hdr.nevents, f) != d->hdr.nevents) {
+		fprintf(stderr, "%s: truncated dump\n", path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	if (d->hdr.end_us > d->hdr.ref_us && d->hdr.end_cycles > d->hdr.ref_cycles)
+		d->cycles_per_us = (double)(d->hdr.end_cycles - d->hdr.ref_cycles)
+			/ (d->hdr.end_us - d->hdr.ref_us);
+	else
+		d->cycles_per_us = d->hdr.side ? 1400.0 : 1000.0;
+	if (d->hdr.ref_us < t_min)
+		t_min = d->hdr.ref_us;
+	if (d->hdr.lost)
+		fprintf(stderr, "%s: %lu older events were overwritten\n", path,
+			d->hdr.lost);
+	return 0;
+}
+
+static double ev_time(struct dump *d, urpc_trace_ev_t *e)
+{
+	return (double)(d->hdr.ref_us - t_min)
+		+ ((double)e->ts - (double)d->hdr.ref_cycles) / d->cycles_per_us;
+}
+
+/*
+  Flow IDs connect put and get of a request: the VH puts and the VE gets
+  on queue URPC_Q_VH2VE, the other way round on URPC_Q_VE2VH.
+ */
+static uint64_t flow_id(struct dump *d, urpc_trace_ev_t *e)
+{
+	int q = (d->hdr.side == 0) == (e->type == URPC_EV_PUT) ? URPC_Q_VH2VE
+		: URPC_Q_VE2VH;
+	return ((uint64_t)e->req << 1) | q;
+}
+
+static void print_dump(struct dump *d, int pid, int *first)
+{
+	printf("%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+	       "\"args\":{\"name\":\"%s pid %d segid %d\"}}",
+	       *first ? "" : ",\n", pid, d->hdr.side ? "VE" : "VH",
+	       d->hdr.pid, d->hdr.segid);
+	*first = 0;
+	for (uint64_t i = 0; i < d->hdr.nevents; i++) {
+		urpc_trace_ev_t *e = &d->ev[i];
+		double ts = ev_time(d, e);
+		const char *name = e->type <= URPC_EV_GC ? ev_name[e->type] : "unknown";
+
+		switch (e->type) {
+		case URPC_EV_HANDLER_BEGIN:
+			printf(",\n{\"name\":\"cmd %u\",\"ph\":\"B\",\"ts\":%.3f,"
+			       "\"pid\":%d,\"tid\":1,\"args\":{\"req\":%ld,\"n\":%u}}",
+			       e->cmd, ts, pid, e->req, e->arg);
+			break;
+		case URPC_EV_HANDLER_END:
+			printf(",\n{\"name\":\"cmd %u\",\"ph\":\"E\",\"ts\":%.3f,"
+			       "\"pid\":%d,\"tid\":1,\"args\":{\"rc\":%d}}",
+			       e->cmd, ts, pid, (int)e->arg);
+			break;
+		case URPC_EV_PUT:
+		case URPC_EV_GET:
+			printf(",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+			       "\"pid\":%d,\"tid\":1,\"args\":{\"cmd\":%u,\"req\":%ld,\"len\":%u}}",
+			       name, ts, pid, e->cmd, e->req, e->arg);
+			printf(",\n{\"name\":\"req\",\"cat\":\"urpc\",\"ph\":\"%s\",%s\"id\":%lu,"
+			       "\"ts\":%.3f,\"pid\":%d,\"tid\":1}",
+			       e->type == URPC_EV_PUT ? "s" : "f",
+			       e->type == URPC_EV_PUT ? "" : "\"bp\":\"e\",",
+			       flow_id(d, e), ts, pid);
+			break;
+		case URPC_EV_ALLOC:
+		case URPC_EV_GC:
+			printf(",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+			       "\"pid\":%d,\"tid\":2,\"args\":{\"%s\":%ld,\"%s\":%u}}",
+			       name, ts, pid, e->type == URPC_EV_ALLOC ? "offs" : "last_req",
+			       e->req, e->type == URPC_EV_ALLOC ? "size" : "free", e->arg);
+			break;
+		default:
+			printf(",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+			       "\"pid\":%d,\"tid\":1,\"args\":{\"cmd\":%u,\"req\":%ld,\"arg\":%u}}",
+			       name, ts, pid, e->cmd, e->req, e->arg);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct dump *d;
+	int first = 1;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s trace_dump [trace_dump ...] > trace.json\n",
+			argv[0]);
+		return 1;
+	}
+	d = calloc(argc - 1, sizeof(struct dump));
+	for (int i = 0; i < argc - 1; i++)
+		if (read_dump(argv[i + 1], &d[i]) < 0)
+			return 1;
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (int i = 0; i < argc - 1; i++)
+		print_dump(&d[i], i + 1, &first);
+	printf("\n]}\n");
+	return 0;
+}